@@ -0,0 +1,68 @@
+#include <iostream>
+#include <map>
+#include <vector>
+#include <cstring>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "AlignedBuffer.h"
+
+using namespace std;
+
+// Freed buffers kept for reuse, by size. Only a few of each size are kept
+// so that one large request doesn't pin its memory forever.
+static const size_t MAX_POOLED_BUFFERS_PER_SIZE = 16;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+
+class BufferPool : public map<size_t, vector<unsigned char *> > {
+ public:
+  ~BufferPool() {
+    for (iterator iter = begin(); iter != end(); iter++) {
+      for (size_t idx = 0; idx < iter->second.size(); idx++) {
+        free(iter->second[idx]);
+      }
+    }
+  }
+};
+static BufferPool pool;
+
+AlignedBuffer::AlignedBuffer(size_t size) {
+  this->length = size;
+  this->buffer = NULL;
+
+  pthread_mutex_lock(&poolLock);
+  BufferPool::iterator iter = pool.find(size);
+  if (iter != pool.end() && !iter->second.empty()) {
+    this->buffer = iter->second.back();
+    iter->second.pop_back();
+  }
+  pthread_mutex_unlock(&poolLock);
+
+  if (this->buffer == NULL) {
+    void *memory;
+    // posix_memalign doesn't accept a size of 0
+    if (posix_memalign(&memory, DIRECT_IO_ALIGNMENT, size > 0 ? size : 1) != 0) {
+      cerr << "Could not allocate an aligned buffer of " << size << " bytes" << endl;
+      exit(1);
+    }
+    this->buffer = (unsigned char *) memory;
+  }
+  memset(this->buffer, 0, size);
+}
+
+AlignedBuffer::~AlignedBuffer() {
+  pthread_mutex_lock(&poolLock);
+  vector<unsigned char *> &freeBuffers = pool[length];
+  if (freeBuffers.size() < MAX_POOLED_BUFFERS_PER_SIZE) {
+    freeBuffers.push_back(buffer);
+    buffer = NULL;
+  }
+  pthread_mutex_unlock(&poolLock);
+  free(buffer);
+}
+
+bool AlignedBuffer::isAligned(const void *address, size_t size) {
+  return ((uintptr_t) address % DIRECT_IO_ALIGNMENT) == 0 && (size % DIRECT_IO_ALIGNMENT) == 0;
+}
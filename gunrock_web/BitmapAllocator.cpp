@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <cstring>
+#include <endian.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "BitmapAllocator.h"
+
+using namespace std;
+
+// The 64 bits of the bitmap starting at bit word * 64, with bit i of the
+// bitmap as bit i % 64 of the word.
+static uint64_t loadWord(const unsigned char *data, size_t word) {
+  uint64_t value;
+  memcpy(&value, data + word * 8, sizeof(value));
+  return le64toh(value);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Returns the first word from word on, in steps of four, that starts a
+// 256 bit span that isn't all ones (or, unless full, all zeros), or the
+// first one that can't start a whole span before words. Compiled for
+// AVX2 whatever the build flags, so only call it when the CPU has it.
+__attribute__((target("avx2")))
+static size_t skipSpans(const unsigned char *data, size_t word, size_t words, bool full) {
+  const __m256i ones = _mm256_set1_epi8(-1);
+  while (word + 4 <= words) {
+    __m256i span = _mm256_loadu_si256((const __m256i *) (data + word * 8));
+    if (full ? !_mm256_testc_si256(span, ones) : !_mm256_testz_si256(span, span)) {
+      break;
+    }
+    word += 4;
+  }
+  return word;
+}
+
+static bool hasAvx2() {
+  static const bool supported = []() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+  }();
+  return supported;
+}
+#else
+static size_t skipSpans(const unsigned char *data, size_t word, size_t words, bool full) {
+  return word;
+}
+
+static bool hasAvx2() {
+  return false;
+}
+#endif
+
+BitmapAllocator::BitmapAllocator() {
+  this->bitmap = NULL;
+  this->numBits = 0;
+  this->cursor = 0;
+  this->hasExtentIndex = false;
+}
+
+void BitmapAllocator::attach(vector<unsigned char> *bitmap, int numBits) {
+  this->bitmap = bitmap;
+  this->numBits = numBits;
+  this->cursor = 0;
+  this->hasExtentIndex = false;
+  extentsByStart.clear();
+  extentsByLength.clear();
+}
+
+int BitmapAllocator::scan(int start, bool findSet) {
+  if (start >= numBits) {
+    return numBits;
+  }
+  const unsigned char *data = bitmap->data();
+  size_t words = ((size_t) numBits + 63) / 64;
+  size_t word = start / 64;
+  // the bits being looked for are the ones in candidates
+  uint64_t flip = findSet ? 0 : ~0ULL;
+  uint64_t candidates = (loadWord(data, word) ^ flip) & (~0ULL << (start % 64));
+  bool useAvx2 = hasAvx2();
+  while (candidates == 0 && ++word < words) {
+    if (useAvx2 && word % 4 == 0) {
+      word = skipSpans(data, word, words, !findSet);
+      if (word >= words) {
+        break;
+      }
+    }
+    candidates = loadWord(data, word) ^ flip;
+  }
+  if (candidates == 0) {
+    return numBits;
+  }
+  return min(numBits, (int) (word * 64) + __builtin_ctzll(candidates));
+}
+
+int BitmapAllocator::findFree(int from) {
+  from = max(from, 0);
+  int found = scan(max(from, cursor), false);
+  found = found < numBits ? found : -1;
+  // Everything between the cursor and what this search found is set.
+  if (from <= cursor) {
+    cursor = found < 0 ? numBits : found;
+  }
+  return found;
+}
+
+bool BitmapAllocator::findExtents(int count, vector<int> &bits) {
+  bits.clear();
+  if (count <= 0) {
+    return true;
+  }
+  if (!hasExtentIndex) {
+    buildExtentIndex();
+  }
+  // The extents from taken to the end of extentsByLength, the largest
+  // ones, are used whole.
+  vector<pair<int, int> > runs;
+  std::set<pair<int, int> >::iterator taken = extentsByLength.end();
+  int needed = count;
+  while (needed > 0) {
+    std::set<pair<int, int> >::iterator fit = extentsByLength.lower_bound(make_pair(needed, -1));
+    if (fit != extentsByLength.end() && (taken == extentsByLength.end() || *fit < *taken)) {
+      runs.push_back(make_pair(fit->second, needed));
+      break;
+    }
+    if (taken == extentsByLength.begin()) {
+      return false;
+    }
+    --taken;
+    runs.push_back(make_pair(taken->second, taken->first));
+    needed -= taken->first;
+  }
+  sort(runs.begin(), runs.end());
+  for (size_t idx = 0; idx < runs.size(); idx++) {
+    for (int bit = runs[idx].first; bit < runs[idx].first + runs[idx].second; bit++) {
+      bits.push_back(bit);
+    }
+  }
+  return true;
+}
+
+bool BitmapAllocator::isSet(int bit) {
+  return ((*bitmap)[bit / 8] & (1 << (bit % 8))) != 0;
+}
+
+void BitmapAllocator::set(int bit) {
+  if (isSet(bit)) {
+    return;
+  }
+  (*bitmap)[bit / 8] |= 1 << (bit % 8);
+  if (bit == cursor) {
+    cursor++;
+  }
+  if (hasExtentIndex) {
+    // split the extent around bit
+    map<int, int>::iterator extent = --extentsByStart.upper_bound(bit);
+    int start = extent->first;
+    int length = extent->second;
+    removeExtent(start, length);
+    if (bit > start) {
+      addExtent(start, bit - start);
+    }
+    if (bit + 1 < start + length) {
+      addExtent(bit + 1, start + length - bit - 1);
+    }
+  }
+}
+
+void BitmapAllocator::clear(int bit) {
+  if (!isSet(bit)) {
+    return;
+  }
+  (*bitmap)[bit / 8] &= ~(1 << (bit % 8));
+  cursor = min(cursor, bit);
+  if (hasExtentIndex) {
+    // merge bit with the extents on either side
+    int start = bit;
+    int length = 1;
+    map<int, int>::iterator next = extentsByStart.find(bit + 1);
+    if (next != extentsByStart.end()) {
+      length += next->second;
+      removeExtent(next->first, next->second);
+    }
+    map<int, int>::iterator previous = extentsByStart.lower_bound(bit);
+    if (previous != extentsByStart.begin()) {
+      --previous;
+      if (previous->first + previous->second == bit) {
+        start = previous->first;
+        length += previous->second;
+        removeExtent(previous->first, previous->second);
+      }
+    }
+    addExtent(start, length);
+  }
+}
+
+void BitmapAllocator::rewind(int bit) {
+  cursor = min(cursor, max(bit, 0));
+  hasExtentIndex = false;
+}
+
+void BitmapAllocator::buildExtentIndex() {
+  extentsByStart.clear();
+  extentsByLength.clear();
+  for (int start = scan(0, false); start < numBits; ) {
+    int end = scan(start, true);
+    addExtent(start, end - start);
+    start = scan(end, false);
+  }
+  hasExtentIndex = true;
+}
+
+void BitmapAllocator::addExtent(int start, int length) {
+  extentsByStart[start] = length;
+  extentsByLength.insert(make_pair(length, start));
+}
+
+void BitmapAllocator::removeExtent(int start, int length) {
+  extentsByStart.erase(start);
+  extentsByLength.erase(make_pair(length, start));
+}
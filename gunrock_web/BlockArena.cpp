@@ -0,0 +1,43 @@
+#include <iostream>
+
+#include <stdlib.h>
+
+#include "BlockArena.h"
+#include "AlignedBuffer.h"
+
+using namespace std;
+
+BlockArena::BlockArena(int blockSize, int blocksPerSlab) {
+  this->blockSize = blockSize;
+  this->blocksPerSlab = blocksPerSlab;
+  this->currentSlab = 0;
+  this->nextBlockInSlab = 0;
+}
+
+BlockArena::~BlockArena() {
+  for (size_t idx = 0; idx < slabs.size(); idx++) {
+    free(slabs[idx]);
+  }
+}
+
+unsigned char *BlockArena::allocate() {
+  if (nextBlockInSlab == blocksPerSlab) {
+    currentSlab++;
+    nextBlockInSlab = 0;
+  }
+  if (currentSlab == (int) slabs.size()) {
+    // Aligned so that an O_DIRECT backend can fill the buffers in place.
+    void *slab;
+    if (posix_memalign(&slab, DIRECT_IO_ALIGNMENT, (size_t) blocksPerSlab * blockSize) != 0) {
+      cerr << "Could not allocate a block arena slab" << endl;
+      exit(1);
+    }
+    slabs.push_back((unsigned char *) slab);
+  }
+  return slabs[currentSlab] + (size_t) blockSize * nextBlockInSlab++;
+}
+
+void BlockArena::reset() {
+  currentSlab = 0;
+  nextBlockInSlab = 0;
+}
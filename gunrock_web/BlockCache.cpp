@@ -0,0 +1,174 @@
+#include <algorithm>
+#include <cstring>
+
+#include <sys/uio.h>
+
+#include "BlockCache.h"
+#include "Disk.h"
+
+using namespace std;
+
+BlockCache::BlockCache(Disk *disk, int blockSize, int capacityBlocks)
+  : data((size_t) capacityBlocks * blockSize) {
+  this->disk = disk;
+  this->blockSize = blockSize;
+  this->capacityBlocks = capacityBlocks;
+  this->frames.resize(capacityBlocks);
+  for (size_t idx = 0; idx < frames.size(); idx++) {
+    frames[idx].blockNumber = -1;
+    frames[idx].isDirty = false;
+    frames[idx].isReferenced = false;
+  }
+  this->frameOfBlock.reserve(capacityBlocks);
+  this->clockHand = 0;
+  this->dirtyBlocks = 0;
+  this->hits = 0;
+  this->misses = 0;
+  this->evictions = 0;
+  this->writeBacks = 0;
+  pthread_mutex_init(&this->lock, NULL);
+}
+
+BlockCache::~BlockCache() {
+  pthread_mutex_destroy(&this->lock);
+}
+
+unsigned char *BlockCache::frameData(int frame) {
+  return data.data() + (size_t) frame * blockSize;
+}
+
+bool BlockCache::read(int blockNumber, void *buffer) {
+  pthread_mutex_lock(&lock);
+  unordered_map<int, int>::iterator iter = frameOfBlock.find(blockNumber);
+  if (iter == frameOfBlock.end()) {
+    misses++;
+    pthread_mutex_unlock(&lock);
+    return false;
+  }
+  hits++;
+  frames[iter->second].isReferenced = true;
+  memcpy(buffer, frameData(iter->second), blockSize);
+  pthread_mutex_unlock(&lock);
+  return true;
+}
+
+void BlockCache::fill(int blockNumber, const void *buffer) {
+  pthread_mutex_lock(&lock);
+  int frame = frameFor(blockNumber);
+  memcpy(frameData(frame), buffer, blockSize);
+  pthread_mutex_unlock(&lock);
+}
+
+void BlockCache::write(int blockNumber, const void *buffer) {
+  pthread_mutex_lock(&lock);
+  int frame = frameFor(blockNumber);
+  memcpy(frameData(frame), buffer, blockSize);
+  if (!frames[frame].isDirty) {
+    frames[frame].isDirty = true;
+    dirtyBlocks++;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void BlockCache::flush() {
+  pthread_mutex_lock(&lock);
+  if (dirtyBlocks == 0) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  vector<pair<int, int> > dirtyFrames;
+  for (size_t idx = 0; idx < frames.size(); idx++) {
+    if (frames[idx].isDirty) {
+      dirtyFrames.push_back(make_pair(frames[idx].blockNumber, (int) idx));
+    }
+  }
+  sort(dirtyFrames.begin(), dirtyFrames.end());
+
+  // write adjacent dirty blocks back with one vectored write
+  vector<struct iovec> run;
+  for (size_t idx = 0; idx < dirtyFrames.size(); idx++) {
+    struct iovec buffer;
+    buffer.iov_base = frameData(dirtyFrames[idx].second);
+    buffer.iov_len = blockSize;
+    run.push_back(buffer);
+
+    bool endsRun = idx + 1 == dirtyFrames.size() ||
+      dirtyFrames[idx + 1].first != dirtyFrames[idx].first + 1;
+    if (endsRun) {
+      int firstBlockNumber = dirtyFrames[idx].first - (int) run.size() + 1;
+      disk->writeImageBlocks(firstBlockNumber, run.size(), run.data());
+      for (size_t frameIdx = idx + 1 - run.size(); frameIdx <= idx; frameIdx++) {
+        frames[dirtyFrames[frameIdx].second].isDirty = false;
+      }
+      dirtyBlocks -= run.size();
+      writeBacks += run.size();
+      run.clear();
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void BlockCache::discard(int blockNumber) {
+  pthread_mutex_lock(&lock);
+  unordered_map<int, int>::iterator iter = frameOfBlock.find(blockNumber);
+  if (iter != frameOfBlock.end()) {
+    Frame &frame = frames[iter->second];
+    if (frame.isDirty) {
+      frame.isDirty = false;
+      dirtyBlocks--;
+    }
+    frame.blockNumber = -1;
+    frame.isReferenced = false;
+    frameOfBlock.erase(iter);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+BlockCacheStats BlockCache::stats() {
+  BlockCacheStats stats;
+  pthread_mutex_lock(&lock);
+  stats.hits = hits;
+  stats.misses = misses;
+  stats.evictions = evictions;
+  stats.writeBacks = writeBacks;
+  stats.capacityBlocks = capacityBlocks;
+  stats.dirtyBlocks = dirtyBlocks;
+  pthread_mutex_unlock(&lock);
+  return stats;
+}
+
+void BlockCache::writeBack(int frame) {
+  disk->writeImageBlock(frames[frame].blockNumber, frameData(frame));
+  frames[frame].isDirty = false;
+  dirtyBlocks--;
+  writeBacks++;
+}
+
+int BlockCache::frameFor(int blockNumber) {
+  unordered_map<int, int>::iterator iter = frameOfBlock.find(blockNumber);
+  if (iter != frameOfBlock.end()) {
+    frames[iter->second].isReferenced = true;
+    return iter->second;
+  }
+
+  // Sweep the clock hand, giving every referenced frame a second chance.
+  // This terminates within two passes because each step clears a bit.
+  while (frames[clockHand].blockNumber != -1 && frames[clockHand].isReferenced) {
+    frames[clockHand].isReferenced = false;
+    clockHand = (clockHand + 1) % capacityBlocks;
+  }
+  int frame = clockHand;
+  clockHand = (clockHand + 1) % capacityBlocks;
+
+  if (frames[frame].blockNumber != -1) {
+    if (frames[frame].isDirty) {
+      writeBack(frame);
+    }
+    frameOfBlock.erase(frames[frame].blockNumber);
+    evictions++;
+  }
+  frames[frame].blockNumber = blockNumber;
+  frames[frame].isReferenced = true;
+  frameOfBlock[blockNumber] = frame;
+  return frame;
+}
@@ -0,0 +1,122 @@
+#include <iostream>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+
+#include <sys/uio.h>
+
+#include "DirectDisk.h"
+#include "AlignedBuffer.h"
+
+using namespace std;
+
+DirectDisk::DirectDisk(string imageFile, int blockSize) : FileDisk(imageFile, blockSize) {
+  this->isDirect = false;
+  if (blockSize % DIRECT_IO_ALIGNMENT != 0) {
+    cerr << "O_DIRECT needs a block size that is a multiple of " << DIRECT_IO_ALIGNMENT
+         << ", using buffered I/O for " << imageFile << endl;
+    return;
+  }
+
+  int flags = (this->isReadOnly ? O_RDONLY : O_RDWR) | O_DIRECT;
+  int directFileDescriptor = open(imageFile.c_str(), flags);
+  if (directFileDescriptor >= 0 && this->imageFileSize > 0) {
+    // Some file systems accept O_DIRECT at open and only reject the first
+    // transfer, so try one before committing to it.
+    AlignedBuffer probe(blockSize);
+    if (pread(directFileDescriptor, probe.data(), blockSize, 0) != blockSize) {
+      close(directFileDescriptor);
+      directFileDescriptor = -1;
+    }
+  }
+  if (directFileDescriptor < 0) {
+    cerr << "O_DIRECT is not supported for " << imageFile << ", using buffered I/O" << endl;
+    return;
+  }
+
+  // The base class hooks now go around the page cache.
+  close(this->imageFileDescriptor);
+  this->imageFileDescriptor = directFileDescriptor;
+  this->isDirect = true;
+}
+
+DirectDisk::~DirectDisk() {
+  // FileDisk's hooks can't take the unaligned buffers that ours bounce.
+  finishWrites();
+}
+
+void DirectDisk::readImageBlock(int blockNumber, void *buffer) {
+  if (!isDirect || AlignedBuffer::isAligned(buffer, blockSize)) {
+    FileDisk::readImageBlock(blockNumber, buffer);
+    return;
+  }
+  AlignedBuffer bounce(blockSize);
+  FileDisk::readImageBlock(blockNumber, bounce.data());
+  memcpy(buffer, bounce.data(), blockSize);
+}
+
+void DirectDisk::writeImageBlock(int blockNumber, const void *buffer) {
+  if (!isDirect || AlignedBuffer::isAligned(buffer, blockSize)) {
+    FileDisk::writeImageBlock(blockNumber, buffer);
+    return;
+  }
+  AlignedBuffer bounce(blockSize);
+  memcpy(bounce.data(), buffer, blockSize);
+  FileDisk::writeImageBlock(blockNumber, bounce.data());
+}
+
+static bool allAligned(int count, const struct iovec *buffers) {
+  for (int idx = 0; idx < count; idx++) {
+    if (!AlignedBuffer::isAligned(buffers[idx].iov_base, buffers[idx].iov_len)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// One aligned buffer for a whole run, and the per-block iovecs into it.
+static void bounceBuffers(AlignedBuffer &bounce, int count, int blockSize, vector<struct iovec> &bounced) {
+  bounced.resize(count);
+  for (int idx = 0; idx < count; idx++) {
+    bounced[idx].iov_base = bounce.data() + (size_t) idx * blockSize;
+    bounced[idx].iov_len = blockSize;
+  }
+}
+
+void DirectDisk::readImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers) {
+  if (!isDirect || allAligned(count, buffers)) {
+    FileDisk::readImageBlocks(firstBlockNumber, count, buffers);
+    return;
+  }
+  AlignedBuffer bounce((size_t) count * blockSize);
+  vector<struct iovec> bounced;
+  bounceBuffers(bounce, count, blockSize, bounced);
+  FileDisk::readImageBlocks(firstBlockNumber, count, bounced.data());
+  for (int idx = 0; idx < count; idx++) {
+    memcpy(buffers[idx].iov_base, bounced[idx].iov_base, blockSize);
+  }
+}
+
+void DirectDisk::writeImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers) {
+  if (!isDirect || allAligned(count, buffers)) {
+    FileDisk::writeImageBlocks(firstBlockNumber, count, buffers);
+    return;
+  }
+  AlignedBuffer bounce((size_t) count * blockSize);
+  vector<struct iovec> bounced;
+  bounceBuffers(bounce, count, blockSize, bounced);
+  for (int idx = 0; idx < count; idx++) {
+    memcpy(bounced[idx].iov_base, buffers[idx].iov_base, blockSize);
+  }
+  FileDisk::writeImageBlocks(firstBlockNumber, count, bounced.data());
+}
+
+void DirectDisk::prefetchImageBlocks(int firstBlockNumber, int count) {
+  // Kernel readahead only fills the page cache, which O_DIRECT skips.
+  if (!isDirect) {
+    FileDisk::prefetchImageBlocks(firstBlockNumber, count);
+  }
+}
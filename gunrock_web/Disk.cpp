@@ -1,142 +1,1139 @@
+#include <algorithm>
+#include <cstring>
+#include <atomic>
 #include <iostream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 #include <unistd.h>
+#include <limits.h>
+#include <time.h>
 
-#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include <sys/types.h>
 #include <sys/uio.h>
-#include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include "Disk.h"
+#include "DiskTrace.h"
+#include "FileDisk.h"
+#include "MmapDisk.h"
+#include "DirectDisk.h"
+#include "UringDisk.h"
+#include "RamDisk.h"
+#include "StripedDisk.h"
+#include "MirroredDisk.h"
+#include "StringUtils.h"
+#include "ufs.h"
+#include "ufs_format.h"
 #include "dthread.h"
 
 using namespace std;
 
-Disk::Disk(string imageFile, int blockSize) {
+// Blocks prefetched ahead of a sequential reader, at most. This matches
+// the kernel's default readahead of 128 KB for 4 KB blocks.
+static const int DEFAULT_READAHEAD_BLOCKS = 32;
+
+// The default stripe unit of a raid0: disk, 64 KB with 4 KB blocks.
+static const int DEFAULT_STRIPE_BLOCKS = 16;
+
+// Slots in the table of block versions. A multiple of the number of
+// stripes, so that blocks sharing a slot share a stripe.
+static const int VERSION_SLOTS = 1 << 16;
+
+// Set while openRawDisk opens a Disk, which then skips the journal.
+static thread_local bool isOpeningRawDisk = false;
+
+// The open transaction of every Disk the thread uses.
+static thread_local unordered_map<Disk *, Transaction *> currentTransactions;
+
+Disk::Disk(string imageFile, int blockSize) : blockVersions(VERSION_SLOTS), readahead(DEFAULT_READAHEAD_BLOCKS) {
   this->imageFile = imageFile;
   this->blockSize = blockSize;
-  this->isInTransaction = false;
-  
-  struct stat stat;
-  int imageFileDescriptor = open(imageFile.c_str(), O_RDONLY);
-  if (imageFileDescriptor < 0) {
-    cerr << "could not open " << imageFile << endl;
-    exit(1);
-  }
-  int ret = fstat(imageFileDescriptor, &stat);
-  if (ret != 0) {
-    cerr << "Could not stat image file" << endl;
-    exit(1);
-  }
-  close(imageFileDescriptor);
-  
-  this->imageFileSize = stat.st_size;
+  this->imageFileSize = 0;
+  this->isReadOnly = false;
+  this->hasUnsyncedWrites = false;
+  this->cache = NULL;
+  this->journal = NULL;
+  this->trace = NULL;
+  this->isDiscardEnabled = false;
+  this->durabilityPolicy = DURABILITY_ALWAYS;
+  this->durabilityIntervalMilliseconds = 0;
+  this->lastSyncMilliseconds = 0;
+  pthread_mutex_init(&this->syncLock, NULL);
+  pthread_cond_init(&this->syncDone, NULL);
+  this->groupCommitWindowMicroseconds = 0;
+  this->isSyncInProgress = false;
+  this->syncRequests = 0;
+  this->syncedRequests = 0;
+  this->blocksRead = 0;
+  this->blocksWritten = 0;
+  this->blocksDiscarded = 0;
+  this->syncCount = 0;
+  this->transactionsBegun = 0;
+  this->commitCount = 0;
+  this->rollbackCount = 0;
+  this->maxTransactionDepth = 0;
+  pthread_mutex_init(&this->transactionLock, NULL);
+  pthread_mutex_init(&this->readaheadLock, NULL);
+}
 
-  if ((this->imageFileSize % this->blockSize) != 0 || this->blockSize == 0) {
+void Disk::openImage(int imageSize) {
+  this->imageFileSize = imageSize;
+
+  if (this->blockSize == 0 || (this->imageFileSize % this->blockSize) != 0) {
     cerr << "Your disk image size must be a multiple of your block size" << endl;
     cerr << "  imageSize: " << this->imageFileSize << endl;
     cerr << "  blockSize: " << this->blockSize << endl;
-    cerr << "  imageSize % blockSize: " << this->imageFileSize % this->blockSize << endl;
+    if (this->blockSize != 0) {
+      cerr << "  imageSize % blockSize: " << this->imageFileSize % this->blockSize << endl;
+    }
     exit(1);
   }
-  
+
+  // Recovery goes through the hooks of the backend that calls this, before
+  // any backend derived from it has set up its own view of the image.
+  if (!isOpeningRawDisk) {
+    this->journal = Journal::open(this);
+  }
+  if (this->journal != NULL) {
+    this->journal->recover();
+  }
+}
+
+Disk::~Disk() {
+  delete this->trace;
+  delete this->journal;
+  delete this->cache;
+  for (size_t idx = 0; idx < this->idleTransactions.size(); idx++) {
+    delete this->idleTransactions[idx];
+  }
+  pthread_mutex_destroy(&this->readaheadLock);
+  pthread_mutex_destroy(&this->transactionLock);
+  pthread_cond_destroy(&this->syncDone);
+  pthread_mutex_destroy(&this->syncLock);
+}
+
+static long long monotonicMilliseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static unsigned long long monotonicNanoseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int Disk::getBlockSize() {
+  return this->blockSize;
 }
 
 int Disk::numberOfBlocks() {
+  if (journal != NULL) {
+    return journal->address();
+  }
   return this->imageFileSize / this->blockSize;
 }
 
-void Disk::readBlock(int blockNumber, void *buffer) {
+void Disk::checkBlockNumber(int blockNumber) {
   if (blockNumber < 0 || blockNumber >= this->numberOfBlocks()) {
     cerr << "Invalid block number " << blockNumber << endl;
     exit(1);
   }
+}
 
-  int fd = open(this->imageFile.c_str(), O_RDONLY);
-  if (fd < 0) {
-    cerr << "Could not open image file " << this->imageFile << endl;
-    exit(1);
+void Disk::readBlock(int blockNumber, void *buffer) {
+  checkBlockNumber(blockNumber);
+  unsigned long long start = monotonicNanoseconds();
+  readAhead(&blockNumber, 1);
+  if (!readDirty(blockNumber, buffer)) {
+    blockLocks.lock(blockNumber);
+    fetchBlock(blockNumber, buffer);
+    noteRead(blockNumber);
+    blockLocks.unlock(blockNumber);
   }
+  blocksRead++;
+  traceBlocks(DISK_OPERATION_READ, &blockNumber, 1);
+  latency[DISK_OPERATION_READ].record(monotonicNanoseconds() - start);
+}
 
-  int offset = blockNumber * this->blockSize;
-  int ret = lseek(fd, offset, SEEK_SET);
-  if (ret != offset) {
-    perror("read::lseek");
-    cerr << "Could not seek to file" << endl;
-    exit(1);
+void Disk::readBlocks(const int *blockNumbers, int count, const struct iovec *buffers) {
+  for (int idx = 0; idx < count; idx++) {
+    checkBlockNumber(blockNumbers[idx]);
   }
+  unsigned long long start = monotonicNanoseconds();
+  readAhead(blockNumbers, count);
 
-  ret = read(fd, buffer, this->blockSize);
-  if (ret != this->blockSize) {
-    cerr << "Could not read file" << endl;
-    exit(1);
+  vector<int> lockedStripes;
+  blockLocks.lockAll(blockNumbers, count, &lockedStripes);
+  vector<int> missedBlocks;
+  vector<struct iovec> missedBuffers;
+  for (int idx = 0; idx < count; idx++) {
+    if (readDirty(blockNumbers[idx], buffers[idx].iov_base)) {
+      continue;
+    }
+    noteRead(blockNumbers[idx]);
+    if (cache == NULL || !cache->read(blockNumbers[idx], buffers[idx].iov_base)) {
+      missedBlocks.push_back(blockNumbers[idx]);
+      missedBuffers.push_back(buffers[idx]);
+    }
+  }
+  transferRuns(missedBlocks.data(), missedBlocks.size(), missedBuffers.data(), false);
+
+  if (cache != NULL) {
+    for (size_t idx = 0; idx < missedBlocks.size(); idx++) {
+      cache->fill(missedBlocks[idx], missedBuffers[idx].iov_base);
+    }
+  }
+  blockLocks.unlockAll(lockedStripes);
+  blocksRead += count;
+  traceBlocks(DISK_OPERATION_READ, blockNumbers, count);
+  latency[DISK_OPERATION_READ].record(monotonicNanoseconds() - start);
+}
+
+void Disk::transferRuns(const int *blockNumbers, int count, const struct iovec *buffers, bool isWrite) {
+  // Visit the blocks in block order, but keep repeated block numbers in
+  // the order the caller gave them so that the last write wins.
+  vector<int> order(count);
+  for (int idx = 0; idx < count; idx++) {
+    order[idx] = idx;
+  }
+  stable_sort(order.begin(), order.end(), [blockNumbers](int a, int b) {
+    return blockNumbers[a] < blockNumbers[b];
+  });
+  if (isWrite) {
+    // Only the last write of a block matters and runs may complete in any
+    // order, so drop the earlier ones.
+    vector<int> lastWrites;
+    for (int idx = 0; idx < count; idx++) {
+      bool isRepeated = idx + 1 < count && blockNumbers[order[idx + 1]] == blockNumbers[order[idx]];
+      if (!isRepeated) {
+        lastWrites.push_back(order[idx]);
+      }
+    }
+    order.swap(lastWrites);
+  }
+
+  vector<vector<struct iovec> > runs;
+  vector<int> firstBlockNumbers;
+  for (size_t idx = 0; idx < order.size(); idx++) {
+    int blockNumber = blockNumbers[order[idx]];
+    bool extendsRun = !runs.empty() && blockNumber == firstBlockNumbers.back() + (int) runs.back().size();
+    if (!extendsRun) {
+      runs.push_back(vector<struct iovec>());
+      firstBlockNumbers.push_back(blockNumber);
+    }
+    struct iovec buffer;
+    buffer.iov_base = buffers[order[idx]].iov_base;
+    buffer.iov_len = this->blockSize;
+    runs.back().push_back(buffer);
+  }
+  if (runs.empty()) {
+    return;
+  }
+
+  // Hand every run to the backend at once and wait for all of them.
+  promise<void> allDone;
+  atomic<int> remaining(runs.size());
+  vector<BlockRequest> requests(runs.size());
+  vector<BlockRequest *> pending;
+  for (size_t idx = 0; idx < runs.size(); idx++) {
+    requests[idx].isWrite = isWrite;
+    requests[idx].firstBlockNumber = firstBlockNumbers[idx];
+    requests[idx].count = runs[idx].size();
+    requests[idx].buffers = runs[idx].data();
+    requests[idx].done = [&allDone, &remaining]() {
+      if (--remaining == 0) {
+        allDone.set_value();
+      }
+    };
+    pending.push_back(&requests[idx]);
+  }
+  future<void> finished = allDone.get_future();
+  submitImageRequests(pending);
+  finished.wait();
+}
+
+void Disk::submitImageRequests(vector<BlockRequest *> &requests) {
+  for (size_t idx = 0; idx < requests.size(); idx++) {
+    BlockRequest *request = requests[idx];
+    if (request->isWrite) {
+      writeImageBlocks(request->firstBlockNumber, request->count, request->buffers);
+    } else {
+      readImageBlocks(request->firstBlockNumber, request->count, request->buffers);
+    }
+    function<void()> done = std::move(request->done);
+    done();
+  }
+}
+
+// A single block request that frees itself once it completes.
+struct SingleBlockRequest {
+  BlockRequest request;
+  struct iovec buffer;
+};
+
+void Disk::readBlockAsync(int blockNumber, void *buffer, function<void()> done) {
+  checkBlockNumber(blockNumber);
+  unsigned long long start = monotonicNanoseconds();
+  blocksRead++;
+  traceBlocks(DISK_OPERATION_READ, &blockNumber, 1);
+  readAhead(&blockNumber, 1);
+  if (readDirty(blockNumber, buffer)) {
+    latency[DISK_OPERATION_READ].record(monotonicNanoseconds() - start);
+    done();
+    return;
+  }
+  // The block stays locked until the backend has read it.
+  blockLocks.lock(blockNumber);
+  noteRead(blockNumber);
+  if (cache != NULL && cache->read(blockNumber, buffer)) {
+    blockLocks.unlock(blockNumber);
+    latency[DISK_OPERATION_READ].record(monotonicNanoseconds() - start);
+    done();
+    return;
+  }
+
+  SingleBlockRequest *single = new SingleBlockRequest;
+  single->buffer.iov_base = buffer;
+  single->buffer.iov_len = this->blockSize;
+  single->request.isWrite = false;
+  single->request.firstBlockNumber = blockNumber;
+  single->request.count = 1;
+  single->request.buffers = &single->buffer;
+  single->request.done = [this, single, blockNumber, done, start]() {
+    delete single;
+    blockLocks.unlock(blockNumber);
+    latency[DISK_OPERATION_READ].record(monotonicNanoseconds() - start);
+    done();
+  };
+  vector<BlockRequest *> requests(1, &single->request);
+  submitImageRequests(requests);
+}
+
+void Disk::writeBlockAsync(int blockNumber, const void *buffer, function<void()> done) {
+  checkBlockNumber(blockNumber);
+  unsigned long long start = monotonicNanoseconds();
+  blocksWritten++;
+  traceBlocks(DISK_OPERATION_WRITE, &blockNumber, 1);
+  Transaction *transaction = currentTransaction();
+  if (transaction != NULL) {
+    transaction->discardedBlocks.erase(blockNumber);
+    transaction->writeDirty(blockNumber, buffer);
+    latency[DISK_OPERATION_WRITE].record(monotonicNanoseconds() - start);
+    done();
+    return;
+  }
+  // The block stays locked until the backend has written it.
+  blockLocks.lock(blockNumber);
+  checkpointBefore(blockNumber);
+  changeVersion(blockNumber);
+  if (cache != NULL) {
+    cache->write(blockNumber, buffer);
+    blockLocks.unlock(blockNumber);
+    writeCompleted(false);
+    latency[DISK_OPERATION_WRITE].record(monotonicNanoseconds() - start);
+    done();
+    return;
+  }
+
+  SingleBlockRequest *single = new SingleBlockRequest;
+  single->buffer.iov_base = (void *) buffer;
+  single->buffer.iov_len = this->blockSize;
+  single->request.isWrite = true;
+  single->request.firstBlockNumber = blockNumber;
+  single->request.count = 1;
+  single->request.buffers = &single->buffer;
+  single->request.done = [this, single, blockNumber, done, start]() {
+    delete single;
+    blockLocks.unlock(blockNumber);
+    writeCompleted(false);
+    latency[DISK_OPERATION_WRITE].record(monotonicNanoseconds() - start);
+    done();
+  };
+  vector<BlockRequest *> requests(1, &single->request);
+  submitImageRequests(requests);
+}
+
+future<void> Disk::readBlockAsync(int blockNumber, void *buffer) {
+  shared_ptr<promise<void> > finished(new promise<void>());
+  readBlockAsync(blockNumber, buffer, [finished]() {
+    finished->set_value();
+  });
+  return finished->get_future();
+}
+
+future<void> Disk::writeBlockAsync(int blockNumber, const void *buffer) {
+  shared_ptr<promise<void> > finished(new promise<void>());
+  writeBlockAsync(blockNumber, buffer, [finished]() {
+    finished->set_value();
+  });
+  return finished->get_future();
+}
+
+void Disk::fetchBlock(int blockNumber, void *buffer) {
+  if (cache == NULL) {
+    readImageBlock(blockNumber, buffer);
+    return;
+  }
+  if (!cache->read(blockNumber, buffer)) {
+    readImageBlock(blockNumber, buffer);
+    cache->fill(blockNumber, buffer);
+  }
+}
+
+void Disk::storeBlock(int blockNumber, const void *buffer) {
+  if (cache == NULL) {
+    writeImageBlock(blockNumber, buffer);
+  } else {
+    cache->write(blockNumber, buffer);
+  }
+}
+
+void Disk::readAhead(const int *blockNumbers, int count) {
+  // Every run of ascending adjacent blocks counts as one read.
+  int runStart = 0;
+  for (int idx = 1; idx <= count; idx++) {
+    if (idx < count && blockNumbers[idx] == blockNumbers[idx - 1] + 1) {
+      continue;
+    }
+    int prefetchStart;
+    pthread_mutex_lock(&readaheadLock);
+    int prefetchCount = readahead.observe(blockNumbers[runStart], idx - runStart, &prefetchStart);
+    pthread_mutex_unlock(&readaheadLock);
+    prefetchCount = min(prefetchCount, numberOfBlocks() - prefetchStart);
+    if (prefetchCount > 0) {
+      prefetchImageBlocks(prefetchStart, prefetchCount);
+    }
+    runStart = idx;
   }
+}
+
+void Disk::setReadahead(int maxBlocks) {
+  readahead.setMaxWindow(maxBlocks);
+}
 
-  close(fd);
+void Disk::getReadaheadStats(ReadaheadStats *stats) {
+  pthread_mutex_lock(&readaheadLock);
+  *stats = readahead.stats();
+  pthread_mutex_unlock(&readaheadLock);
+}
+
+void Disk::flushDirtyBlocks() {
+  if (cache != NULL) {
+    cache->flush();
+  }
+}
+
+void Disk::finishWrites() {
+  flushDirtyBlocks();
+  if (journal != NULL && !isReadOnly) {
+    journal->checkpoint();
+  }
+}
+
+void Disk::readImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers) {
+  for (int idx = 0; idx < count; idx++) {
+    readImageBlock(firstBlockNumber + idx, buffers[idx].iov_base);
+  }
+}
+
+void Disk::writeImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers) {
+  for (int idx = 0; idx < count; idx++) {
+    writeImageBlock(firstBlockNumber + idx, buffers[idx].iov_base);
+  }
+}
+
+void Disk::prefetchImageBlocks(int firstBlockNumber, int count) {
+}
+
+void Disk::discardImageBlocks(int firstBlockNumber, int count) {
+}
+
+Transaction *Disk::currentTransaction() {
+  if (currentTransactions.empty()) {
+    return NULL;
+  }
+  unordered_map<Disk *, Transaction *>::iterator iter = currentTransactions.find(this);
+  return iter == currentTransactions.end() ? NULL : iter->second;
+}
+
+void Disk::noteRead(int blockNumber) {
+  Transaction *transaction = currentTransaction();
+  if (transaction != NULL) {
+    // only the first read counts
+    transaction->readVersions.insert(make_pair(blockNumber, blockVersions[blockNumber % VERSION_SLOTS]));
+  }
+}
+
+void Disk::changeVersion(int blockNumber) {
+  blockVersions[blockNumber % VERSION_SLOTS]++;
+}
+
+bool Disk::isUnchanged(Transaction *transaction) {
+  map<int, unsigned int>::iterator iter;
+  for (iter = transaction->readVersions.begin(); iter != transaction->readVersions.end(); iter++) {
+    if (blockVersions[iter->first % VERSION_SLOTS] != iter->second) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Disk::readDirty(int blockNumber, void *buffer) {
+  Transaction *transaction = currentTransaction();
+  return transaction != NULL && transaction->readDirty(blockNumber, buffer);
+}
+
+void Disk::checkpointBefore(int blockNumber) {
+  if (journal != NULL && journal->isPending(blockNumber)) {
+    journal->checkpoint();
+  }
 }
 
 void Disk::writeBlock(int blockNumber, void *buffer) {  
-  if (blockNumber < 0 || blockNumber >= this->numberOfBlocks()) {
-    cerr << "Invalid block number " << blockNumber << endl;
-    exit(1);
+  checkBlockNumber(blockNumber);
+  unsigned long long start = monotonicNanoseconds();
+  blocksWritten++;
+  traceBlocks(DISK_OPERATION_WRITE, &blockNumber, 1);
+
+  Transaction *transaction = currentTransaction();
+  if (transaction != NULL) {
+    transaction->discardedBlocks.erase(blockNumber);
+    transaction->writeDirty(blockNumber, buffer);
+  } else {
+    blockLocks.lock(blockNumber);
+    checkpointBefore(blockNumber);
+    changeVersion(blockNumber);
+    storeBlock(blockNumber, buffer);
+    blockLocks.unlock(blockNumber);
+    writeCompleted(false);
   }
+  latency[DISK_OPERATION_WRITE].record(monotonicNanoseconds() - start);
+}
+
+void Disk::writeBlocks(const int *blockNumbers, int count, const struct iovec *buffers) {
+  for (int idx = 0; idx < count; idx++) {
+    checkBlockNumber(blockNumbers[idx]);
+  }
+  unsigned long long start = monotonicNanoseconds();
+  blocksWritten += count;
+  traceBlocks(DISK_OPERATION_WRITE, blockNumbers, count);
+
+  Transaction *transaction = currentTransaction();
+  if (transaction != NULL) {
+    for (int idx = 0; idx < count; idx++) {
+      transaction->discardedBlocks.erase(blockNumbers[idx]);
+      transaction->writeDirty(blockNumbers[idx], buffers[idx].iov_base);
+    }
+    latency[DISK_OPERATION_WRITE].record(monotonicNanoseconds() - start);
+    return;
+  }
+  vector<int> lockedStripes;
+  blockLocks.lockAll(blockNumbers, count, &lockedStripes);
+  for (int idx = 0; idx < count; idx++) {
+    checkpointBefore(blockNumbers[idx]);
+    changeVersion(blockNumbers[idx]);
+  }
+
+  if (cache == NULL) {
+    transferRuns(blockNumbers, count, buffers, true);
+  } else {
+    for (int idx = 0; idx < count; idx++) {
+      cache->write(blockNumbers[idx], buffers[idx].iov_base);
+    }
+  }
+  blockLocks.unlockAll(lockedStripes);
+  writeCompleted(false);
+  latency[DISK_OPERATION_WRITE].record(monotonicNanoseconds() - start);
+}
 
+void Disk::writeCompleted(bool isInTransaction) {
+  hasUnsyncedWrites = true;
   if (isInTransaction) {
-    struct UndoRecord undoRecord;
-    undoRecord.blockNumber = blockNumber;
-    undoRecord.blockData = new unsigned char[blockSize];
-    this->readBlock(blockNumber, undoRecord.blockData);
-    undoLog.push_front(undoRecord);
-  }
-  
-  int fd = open(this->imageFile.c_str(), O_RDWR);
-  if (fd < 0) {
-    cerr << "Could not open image file " << this->imageFile << endl;
-    exit(1);
+    return;
   }
 
-  int offset = blockNumber * this->blockSize;
-  int ret = lseek(fd, offset, SEEK_SET);
-  if (ret != offset) {
-    perror("write::lseek");
-    cerr << "Could not seek to file" << endl;
-    exit(1);
+  switch (durabilityPolicy) {
+  case DURABILITY_ALWAYS:
+    sync();
+    break;
+  case DURABILITY_INTERVAL:
+    if (monotonicMilliseconds() - lastSyncMilliseconds >= durabilityIntervalMilliseconds) {
+      sync();
+    }
+    break;
+  case DURABILITY_NONE:
+    break;
+  }
+}
+
+void Disk::sync() {
+  flushDirtyBlocks();
+  groupSync();
+  if (journal != NULL) {
+    journal->checkpoint();
+  }
+}
+
+void Disk::setDurabilityPolicy(DurabilityPolicy policy, int intervalMilliseconds) {
+  this->durabilityPolicy = policy;
+  this->durabilityIntervalMilliseconds = intervalMilliseconds;
+}
+
+void Disk::setGroupCommitWindow(int microseconds) {
+  this->groupCommitWindowMicroseconds = microseconds;
+}
+
+void Disk::setCacheSize(int megabytes) {
+  flushDirtyBlocks();
+  delete this->cache;
+  this->cache = NULL;
+
+  int capacityBlocks = (int) (((long long) megabytes * 1024 * 1024) / this->blockSize);
+  if (capacityBlocks > 0) {
+    this->cache = new BlockCache(this, this->blockSize, capacityBlocks);
   }
+}
 
-  ret = write(fd, buffer, this->blockSize);
-  if (ret != this->blockSize) {
-    cerr << "Could not write file" << endl;
+bool Disk::getCacheStats(BlockCacheStats *stats) {
+  if (cache == NULL) {
+    return false;
+  }
+  *stats = cache->stats();
+  return true;
+}
+
+void Disk::getStats(DiskStats *stats) {
+  stats->blocksRead = blocksRead;
+  stats->blocksWritten = blocksWritten;
+  stats->bytesRead = stats->blocksRead * blockSize;
+  stats->bytesWritten = stats->blocksWritten * blockSize;
+  stats->blocksDiscarded = blocksDiscarded;
+  stats->syncs = syncCount;
+  stats->transactionsBegun = transactionsBegun;
+  stats->commits = commitCount;
+  stats->rollbacks = rollbackCount;
+  Transaction *transaction = currentTransaction();
+  stats->transactionDepth = transaction != NULL ? transaction->blockCount() : 0;
+  stats->maxTransactionDepth = max((int) maxTransactionDepth, stats->transactionDepth);
+  stats->transactionBlocks = transactionBlocks.summary();
+  for (int operation = 0; operation < DISK_OPERATIONS; operation++) {
+    stats->latency[operation] = latency[operation].summary();
+  }
+}
+
+static void printLatency(ostream &out, string name, HistogramSummary &summary) {
+  out << "  " << left << setw(17) << name << right << fixed << setprecision(1)
+      << "count " << summary.count << " mean " << summary.mean / 1000
+      << " p50 " << summary.p50 / 1000.0 << " p90 " << summary.p90 / 1000.0
+      << " p99 " << summary.p99 / 1000.0 << " p99.9 " << summary.p999 / 1000.0
+      << " max " << summary.max / 1000.0 << endl;
+}
+
+void Disk::printStats(ostream &out) {
+  DiskStats stats;
+  getStats(&stats);
+  ios::fmtflags flags = out.flags();
+  streamsize precision = out.precision();
+  out << "disk stats for " << imageFile << endl;
+  out << "  blocks read      " << stats.blocksRead << " (" << stats.bytesRead << " bytes)" << endl;
+  out << "  blocks written   " << stats.blocksWritten << " (" << stats.bytesWritten << " bytes)" << endl;
+  out << "  blocks discarded " << stats.blocksDiscarded << endl;
+  out << "  syncs            " << stats.syncs << endl;
+  out << "  transactions     " << stats.transactionsBegun << " begun, " << stats.commits << " committed, "
+      << stats.rollbacks << " rolled back" << endl;
+  out << "  buffered blocks  " << stats.transactionDepth << " now, " << stats.maxTransactionDepth << " max" << endl;
+  out << "  blocks per transaction: count " << stats.transactionBlocks.count << " p50 " << stats.transactionBlocks.p50
+      << " p99 " << stats.transactionBlocks.p99 << " max " << stats.transactionBlocks.max << endl;
+  out << "latency in microseconds" << endl;
+  printLatency(out, "read", stats.latency[DISK_OPERATION_READ]);
+  printLatency(out, "write", stats.latency[DISK_OPERATION_WRITE]);
+  printLatency(out, "sync", stats.latency[DISK_OPERATION_SYNC]);
+  printLatency(out, "commit", stats.latency[DISK_OPERATION_COMMIT]);
+
+  ReadaheadStats readaheadStats;
+  getReadaheadStats(&readaheadStats);
+  out << "readahead" << endl;
+  out << "  sequential " << readaheadStats.sequentialReads << " random " << readaheadStats.randomReads
+      << " prefetched " << readaheadStats.prefetchedBlocks << " hits " << readaheadStats.hits
+      << " window " << readaheadStats.window << "/" << readaheadStats.maxWindow << endl;
+
+  BlockCacheStats cacheStats;
+  if (getCacheStats(&cacheStats)) {
+    out << "cache" << endl;
+    out << "  hits " << cacheStats.hits << " misses " << cacheStats.misses << " evictions " << cacheStats.evictions
+        << " write backs " << cacheStats.writeBacks << " dirty " << cacheStats.dirtyBlocks << "/"
+        << cacheStats.capacityBlocks << endl;
+  }
+  out.flags(flags);
+  out.precision(precision);
+}
+
+void Disk::groupSync() {
+  pthread_mutex_lock(&syncLock);
+  // Our writes were issued before we took a ticket, so any flush that
+  // starts after this point covers them.
+  unsigned long ticket = ++syncRequests;
+  while (syncedRequests < ticket) {
+    if (isSyncInProgress) {
+      pthread_cond_wait(&syncDone, &syncLock);
+      continue;
+    }
+
+    isSyncInProgress = true;
+    if (groupCommitWindowMicroseconds > 0) {
+      pthread_mutex_unlock(&syncLock);
+      usleep(groupCommitWindowMicroseconds);
+      pthread_mutex_lock(&syncLock);
+    }
+    unsigned long coveredRequests = syncRequests;
+    hasUnsyncedWrites = false;
+    pthread_mutex_unlock(&syncLock);
+
+    flushImage();
+
+    pthread_mutex_lock(&syncLock);
+    syncedRequests = coveredRequests;
+    lastSyncMilliseconds = monotonicMilliseconds();
+    isSyncInProgress = false;
+    pthread_cond_broadcast(&syncDone);
+  }
+  pthread_mutex_unlock(&syncLock);
+}
+
+void Disk::startTrace(string traceFile) {
+  if (trace != NULL) {
+    cerr << "The disk is already being traced" << endl;
     exit(1);
   }
-  fsync(fd);
-  close(fd);
+  trace = new DiskTrace(traceFile, blockSize);
 }
 
-void Disk::beginTransaction() {
-  if (isInTransaction) {
+void Disk::traceBlocks(DiskOperation operation, const int *blockNumbers, int count) {
+  if (trace == NULL) {
+    return;
+  }
+  for (int idx = 0; idx < count; idx++) {
+    trace->record(operation, blockNumbers[idx]);
+  }
+}
+
+void Disk::flushImage() {
+  unsigned long long start = monotonicNanoseconds();
+  syncImage();
+  syncCount++;
+  int noBlock = -1;
+  traceBlocks(DISK_OPERATION_SYNC, &noBlock, 1);
+  latency[DISK_OPERATION_SYNC].record(monotonicNanoseconds() - start);
+}
+
+Transaction *Disk::beginTransaction() {
+  if (currentTransaction() != NULL) {
     cerr << "You can't start a new transaction: one already exists" << endl;
     exit(1);
   }
-  isInTransaction = true;
+  Transaction *transaction = NULL;
+  pthread_mutex_lock(&transactionLock);
+  if (!idleTransactions.empty()) {
+    transaction = idleTransactions.back();
+    idleTransactions.pop_back();
+  }
+  pthread_mutex_unlock(&transactionLock);
+  if (transaction == NULL) {
+    transaction = new Transaction(blockSize);
+  }
+
+  currentTransactions[this] = transaction;
+  transactionsBegun++;
+  return transaction;
+}
+
+void Disk::finishTransaction(Transaction *transaction, bool isCommit) {
+  int depth = transaction->blockCount();
+  if (isCommit) {
+    commitCount++;
+  } else {
+    rollbackCount++;
+  }
+  transactionBlocks.record(depth);
+  int deepest = maxTransactionDepth;
+  while (depth > deepest && !maxTransactionDepth.compare_exchange_weak(deepest, depth)) {
+  }
+
+  transaction->clear();
+  currentTransactions.erase(this);
+  pthread_mutex_lock(&transactionLock);
+  idleTransactions.push_back(transaction);
+  pthread_mutex_unlock(&transactionLock);
 }
 
-void Disk::commit() {
-  isInTransaction = false;
-  deque<struct UndoRecord>::iterator iter;
-  for (iter = undoLog.begin(); iter != undoLog.end(); iter++) {
-    delete [] iter->blockData;
+bool Disk::commit() {
+  Transaction *transaction = currentTransaction();
+  if (transaction == NULL) {
+    return true;
+  }
+  unsigned long long start = monotonicNanoseconds();
+  if (journal != NULL && (int) transaction->dirtyBlocks.size() > journal->capacity()) {
+    // writing it in place wouldn't be atomic
+    rollback();
+    return false;
+  }
+  // Commits that share a block take turns, in stripe order, and the rest
+  // go ahead in parallel. The discarded blocks stay locked until they are
+  // released, so that a transaction that reuses one after this commit
+  // can't have its write discarded.
+  vector<int> blockNumbers = transaction->blockNumbers();
+  map<int, unsigned int>::iterator read;
+  for (read = transaction->readVersions.begin(); read != transaction->readVersions.end(); read++) {
+    blockNumbers.push_back(read->first);
+  }
+  vector<int> discardedBlocks(transaction->discardedBlocks.begin(), transaction->discardedBlocks.end());
+  blockNumbers.insert(blockNumbers.end(), discardedBlocks.begin(), discardedBlocks.end());
+  vector<int> lockedStripes;
+  blockLocks.lockAll(blockNumbers.data(), blockNumbers.size(), &lockedStripes);
+  if (!isUnchanged(transaction)) {
+    // another transaction changed a block this one read
+    blockLocks.unlockAll(lockedStripes);
+    rollback();
+    return false;
+  }
+  map<int, unsigned char *>::iterator iter;
+  for (iter = transaction->dirtyBlocks.begin(); iter != transaction->dirtyBlocks.end(); iter++) {
+    changeVersion(iter->first);
+  }
+  if (journal != NULL) {
+    commitRedo(transaction);
+  } else if (!transaction->dirtyBlocks.empty()) {
+    // a commit that wrote nothing has nothing to make durable
+    storeDirtyBlocks(transaction);
+    hasUnsyncedWrites = true;
+    sync();
+  }
+  releaseBlocks(discardedBlocks);
+  blockLocks.unlockAll(lockedStripes);
+
+  vector<function<void()> > actions;
+  actions.swap(transaction->finishActions);
+  finishTransaction(transaction, true);
+  latency[DISK_OPERATION_COMMIT].record(monotonicNanoseconds() - start);
+  for (size_t idx = 0; idx < actions.size(); idx++) {
+    actions[idx]();
+  }
+  return true;
+}
+
+void Disk::storeDirtyBlocks(Transaction *transaction) {
+  map<int, unsigned char *> &dirtyBlocks = transaction->dirtyBlocks;
+  map<int, unsigned char *>::iterator iter;
+  if (cache != NULL) {
+    for (iter = dirtyBlocks.begin(); iter != dirtyBlocks.end(); iter++) {
+      cache->write(iter->first, iter->second);
+    }
+    return;
+  }
+  // The blocks are in ascending order, so adjacent ones go out as a run.
+  vector<int> blockNumbers;
+  vector<struct iovec> buffers;
+  blockNumbers.reserve(dirtyBlocks.size());
+  buffers.reserve(dirtyBlocks.size());
+  for (iter = dirtyBlocks.begin(); iter != dirtyBlocks.end(); iter++) {
+    struct iovec buffer;
+    buffer.iov_base = iter->second;
+    buffer.iov_len = this->blockSize;
+    blockNumbers.push_back(iter->first);
+    buffers.push_back(buffer);
+  }
+  transferRuns(blockNumbers.data(), blockNumbers.size(), buffers.data(), true);
+}
+
+int Disk::journalCapacity() {
+  return journal == NULL ? -1 : journal->capacity();
+}
+
+void Disk::commitRedo(Transaction *transaction) {
+  map<int, unsigned char *> &dirtyBlocks = transaction->dirtyBlocks;
+  if (!dirtyBlocks.empty()) {
+    journal->append(dirtyBlocks);
+  }
+}
+
+void Disk::setDiscard(bool isEnabled) {
+  this->isDiscardEnabled = isEnabled;
+}
+
+void Disk::discardBlocks(const int *blockNumbers, int count) {
+  for (int idx = 0; idx < count; idx++) {
+    checkBlockNumber(blockNumbers[idx]);
+  }
+  if (!isDiscardEnabled || isReadOnly) {
+    return;
+  }
+  Transaction *transaction = currentTransaction();
+  if (transaction != NULL) {
+    transaction->discardedBlocks.insert(blockNumbers, blockNumbers + count);
+    return;
+  }
+  vector<int> sortedBlocks(blockNumbers, blockNumbers + count);
+  sort(sortedBlocks.begin(), sortedBlocks.end());
+  sortedBlocks.erase(unique(sortedBlocks.begin(), sortedBlocks.end()), sortedBlocks.end());
+  vector<int> lockedStripes;
+  blockLocks.lockAll(sortedBlocks.data(), sortedBlocks.size(), &lockedStripes);
+  releaseBlocks(sortedBlocks);
+  blockLocks.unlockAll(lockedStripes);
+}
+
+void Disk::releaseBlocks(const vector<int> &blockNumbers) {
+  if (blockNumbers.empty()) {
+    return;
+  }
+  blocksDiscarded += blockNumbers.size();
+  size_t runStart = 0;
+  for (size_t idx = 0; idx < blockNumbers.size(); idx++) {
+    changeVersion(blockNumbers[idx]);
+    if (cache != NULL) {
+      cache->discard(blockNumbers[idx]);
+    }
+    if (idx + 1 == blockNumbers.size() || blockNumbers[idx + 1] != blockNumbers[idx] + 1) {
+      discardImageBlocks(blockNumbers[runStart], idx + 1 - runStart);
+      runStart = idx + 1;
+    }
   }
-  undoLog.clear();
 }
 
 void Disk::rollback() {
-  isInTransaction = false;
-  deque<struct UndoRecord>::iterator iter;
-  for (iter = undoLog.begin(); iter != undoLog.end(); iter++) {
-    this->writeBlock(iter->blockNumber, iter->blockData);
-    delete [] iter->blockData;
+  Transaction *transaction = currentTransaction();
+  if (transaction == NULL) {
+    return;
+  }
+  // The writes never left the transaction, so there is nothing to undo.
+  vector<function<void()> > actions;
+  vector<function<void()> > finishActions;
+  actions.swap(transaction->rollbackActions);
+  finishActions.swap(transaction->finishActions);
+  finishTransaction(transaction, false);
+  for (size_t idx = actions.size(); idx > 0; idx--) {
+    actions[idx - 1]();
+  }
+  for (size_t idx = 0; idx < finishActions.size(); idx++) {
+    finishActions[idx]();
+  }
+}
+
+void Disk::onRollback(function<void()> action) {
+  Transaction *transaction = currentTransaction();
+  if (transaction != NULL) {
+    transaction->rollbackActions.push_back(std::move(action));
+  }
+}
+
+bool Disk::onFinish(function<void()> action) {
+  Transaction *transaction = currentTransaction();
+  if (transaction == NULL) {
+    return false;
+  }
+  transaction->finishActions.push_back(std::move(action));
+  return true;
+}
+
+// The option of a disk URI, or defaultValue when it isn't there.
+static int intOption(map<string, string> &options, string name, int defaultValue) {
+  map<string, string>::iterator iter = options.find(name);
+  if (iter == options.end()) {
+    return defaultValue;
+  }
+  int value = atoi(iter->second.c_str());
+  options.erase(iter);
+  return value;
+}
+
+// The blocksize= of a format spec, which must be one mkfs -B takes.
+static int formatBlockSize(map<string, string> &options) {
+  int blockSize = intOption(options, "blocksize", UFS_BLOCK_SIZE);
+  if (!UFS_IS_BLOCK_SIZE(blockSize)) {
+    cerr << "blocksize must be 4096, 16384 or 65536, not " << blockSize << endl;
+    exit(1);
+  }
+  return blockSize;
+}
+
+static string stringOption(map<string, string> &options, string name, string defaultValue) {
+  map<string, string>::iterator iter = options.find(name);
+  if (iter == options.end()) {
+    return defaultValue;
+  }
+  string value = iter->second;
+  options.erase(iter);
+  return value;
+}
+
+static bool flagOption(map<string, string> &options, string name) {
+  return options.erase(name) != 0;
+}
+
+// Splits spec into its scheme, path and options.
+static void parseDiskSpec(string spec, string *scheme, string *path, map<string, string> *options) {
+  static const char *schemes[] = { "file", "mmap", "uring", "direct", "ram", "raid0", "raid1" };
+  *scheme = "file";
+  *path = spec;
+  size_t colon = spec.find(':');
+  if (colon != string::npos &&
+      find(schemes, schemes + sizeof(schemes) / sizeof(schemes[0]), spec.substr(0, colon)) !=
+        schemes + sizeof(schemes) / sizeof(schemes[0])) {
+    // Only URIs have options, so a bare file name may hold a '?'.
+    *scheme = spec.substr(0, colon);
+    *path = spec.substr(colon + 1);
+    size_t query = path->find('?');
+    if (query != string::npos) {
+      vector<string> pairs = StringUtils::split(path->substr(query + 1), '&');
+      for (size_t idx = 0; idx < pairs.size(); idx++) {
+        size_t equals = pairs[idx].find('=');
+        if (equals == string::npos) {
+          (*options)[pairs[idx]] = "";
+        } else {
+          (*options)[pairs[idx].substr(0, equals)] = pairs[idx].substr(equals + 1);
+        }
+      }
+      *path = path->substr(0, query);
+    }
+    if (path->compare(0, 2, "//") == 0) {
+      *path = path->substr(2);
+    }
+  }
+}
+
+Disk *openDisk(string spec, int blockSize) {
+  string scheme;
+  string path;
+  map<string, string> options;
+  parseDiskSpec(spec, &scheme, &path, &options);
+
+  bool isSnapshotOnClose = false;
+  bool isFormat = false;
+  int numInodes = 32;
+  int numData = 32;
+  int numJournal = 0;
+  int inodeFormat = UFS_INODE_DIRECT;
+  int stripeBlocks = DEFAULT_STRIPE_BLOCKS;
+  if (scheme == "ram") {
+    isSnapshotOnClose = flagOption(options, "snapshot");
+    isFormat = flagOption(options, "format");
+  } else if (scheme == "raid0") {
+    stripeBlocks = intOption(options, "unit", stripeBlocks);
+    isFormat = flagOption(options, "format");
+  }
+  if (isFormat) {
+    if (formatBlockSize(options) != blockSize) {
+      cerr << "Could not format " << spec << " with " << blockSize << " byte blocks" << endl;
+      exit(1);
+    }
+    numInodes = intOption(options, "inodes", numInodes);
+    numData = intOption(options, "data", numData);
+    numJournal = intOption(options, "journal", numJournal);
+    string inodeFormatName = stringOption(options, "inodeformat", ufs_inode_format_name(inodeFormat));
+    inodeFormat = ufs_inode_format(inodeFormatName.c_str());
+    if (inodeFormat < 0) {
+      cerr << "unknown inode format " << inodeFormatName << endl;
+      exit(1);
+    }
+  }
+  bool isDiscard = flagOption(options, "discard");
+  if (!options.empty()) {
+    cerr << "unknown option " << options.begin()->first << " for " << scheme << ": disks" << endl;
+    exit(1);
+  }
+
+  Disk *disk;
+  if (scheme == "mmap") {
+    disk = new MmapDisk(path, blockSize);
+  } else if (scheme == "uring") {
+    disk = new UringDisk(path, blockSize);
+  } else if (scheme == "direct") {
+    disk = new DirectDisk(path, blockSize);
+  } else if (scheme == "ram" && isFormat) {
+    disk = new RamDisk(path, blockSize, numInodes, numData, numJournal, inodeFormat, isSnapshotOnClose);
+  } else if (scheme == "ram") {
+    disk = new RamDisk(path, blockSize, isSnapshotOnClose);
+  } else if (scheme == "raid0" && isFormat) {
+    disk = new StripedDisk(StringUtils::split(path, ','), blockSize, stripeBlocks, numInodes, numData, numJournal, inodeFormat);
+  } else if (scheme == "raid0") {
+    disk = new StripedDisk(StringUtils::split(path, ','), blockSize, stripeBlocks);
+  } else if (scheme == "raid1") {
+    disk = new MirroredDisk(StringUtils::split(path, ','), blockSize);
+  } else {
+    disk = new FileDisk(path, blockSize);
+  }
+  disk->setDiscard(isDiscard);
+  return disk;
+}
+
+string diskImagePath(string spec) {
+  string scheme;
+  string path;
+  map<string, string> options;
+  parseDiskSpec(spec, &scheme, &path, &options);
+  return path;
+}
+
+int imageBlockSize(string spec) {
+  string scheme;
+  string path;
+  map<string, string> options;
+  parseDiskSpec(spec, &scheme, &path, &options);
+  if (options.count("format") != 0) {
+    return formatBlockSize(options);
+  }
+  if (scheme == "raid0" || scheme == "raid1") {
+    // Block 0 is at the start of the first member, and of every replica
+    // that has been synced.
+    vector<string> memberSpecs = StringUtils::split(path, ',');
+    for (size_t idx = 0; idx < memberSpecs.size(); idx++) {
+      int blockSize = imageBlockSize(memberSpecs[idx]);
+      if (blockSize != UFS_BLOCK_SIZE || scheme == "raid0") {
+        return blockSize;
+      }
+    }
+    return UFS_BLOCK_SIZE;
+  }
+
+  super_t super;
+  int fileDescriptor = open(path.c_str(), O_RDONLY);
+  if (fileDescriptor < 0) {
+    // the backend reports the error
+    return UFS_BLOCK_SIZE;
+  }
+  ssize_t bytes = pread(fileDescriptor, &super, sizeof(super), 0);
+  close(fileDescriptor);
+  if (bytes != sizeof(super) || super.block_size == 0) {
+    return UFS_BLOCK_SIZE;
+  }
+  if (!UFS_IS_BLOCK_SIZE(super.block_size)) {
+    cerr << "Image " << path << " has an invalid block size of " << super.block_size << endl;
+    exit(1);
+  }
+  return super.block_size;
+}
+
+Disk *openRawDisk(string spec, int blockSize, long long createSize) {
+  if (createSize > 0) {
+    string path = diskImagePath(spec);
+    int fileDescriptor = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fileDescriptor < 0 || ftruncate(fileDescriptor, createSize) != 0 || close(fileDescriptor) != 0) {
+      perror("create");
+      cerr << "Could not create image file " << path << endl;
+      exit(1);
+    }
   }
-  undoLog.clear();
+  isOpeningRawDisk = true;
+  Disk *disk = openDisk(spec, blockSize);
+  isOpeningRawDisk = false;
+  return disk;
 }
@@ -0,0 +1,128 @@
+#include <atomic>
+#include <iostream>
+#include <cstring>
+#include <unistd.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+
+#include <sys/stat.h>
+
+#include "DiskTrace.h"
+
+using namespace std;
+
+// "DS3T"
+static const unsigned int DISK_TRACE_MAGIC = 0x54335344;
+static const unsigned int DISK_TRACE_VERSION = 1;
+// Records kept in memory before they are written out, 64 KB worth.
+static const size_t BUFFERED_RECORDS = 4096;
+
+static atomic<int> nextThreadNumber(0);
+static thread_local int threadNumber = -1;
+
+static unsigned long long monotonicNanoseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void writeFully(int fileDescriptor, const void *data, size_t length, string traceFile) {
+  const unsigned char *bytes = (const unsigned char *) data;
+  while (length > 0) {
+    ssize_t ret = write(fileDescriptor, bytes, length);
+    if (ret <= 0) {
+      perror("write");
+      cerr << "Could not write trace file " << traceFile << endl;
+      exit(1);
+    }
+    bytes += ret;
+    length -= ret;
+  }
+}
+
+DiskTrace::DiskTrace(string traceFile, int blockSize) {
+  this->traceFile = traceFile;
+  this->fileDescriptor = open(traceFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (this->fileDescriptor < 0) {
+    cerr << "could not open " << traceFile << endl;
+    exit(1);
+  }
+  DiskTraceHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = DISK_TRACE_MAGIC;
+  header.version = DISK_TRACE_VERSION;
+  header.blockSize = blockSize;
+  writeFully(this->fileDescriptor, &header, sizeof(header), traceFile);
+
+  this->startNanoseconds = monotonicNanoseconds();
+  this->buffer.reserve(BUFFERED_RECORDS);
+  pthread_mutex_init(&this->lock, NULL);
+}
+
+DiskTrace::~DiskTrace() {
+  pthread_mutex_lock(&lock);
+  flush();
+  pthread_mutex_unlock(&lock);
+  close(fileDescriptor);
+  pthread_mutex_destroy(&lock);
+}
+
+void DiskTrace::record(DiskOperation operation, int blockNumber) {
+  if (threadNumber < 0) {
+    threadNumber = nextThreadNumber++;
+  }
+  DiskTraceRecord record;
+  record.timestamp = monotonicNanoseconds() - startNanoseconds;
+  record.blockNumber = blockNumber;
+  record.thread = threadNumber;
+  record.operation = operation;
+  record.reserved = 0;
+
+  pthread_mutex_lock(&lock);
+  buffer.push_back(record);
+  if (buffer.size() == BUFFERED_RECORDS) {
+    flush();
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void DiskTrace::flush() {
+  writeFully(fileDescriptor, buffer.data(), buffer.size() * sizeof(DiskTraceRecord), traceFile);
+  buffer.clear();
+}
+
+void DiskTrace::load(string traceFile, int *blockSize, vector<DiskTraceRecord> *records) {
+  int fileDescriptor = open(traceFile.c_str(), O_RDONLY);
+  if (fileDescriptor < 0) {
+    cerr << "could not open " << traceFile << endl;
+    exit(1);
+  }
+  struct stat stat;
+  DiskTraceHeader header;
+  if (fstat(fileDescriptor, &stat) != 0 ||
+      read(fileDescriptor, &header, sizeof(header)) != sizeof(header) ||
+      header.magic != DISK_TRACE_MAGIC || header.version != DISK_TRACE_VERSION) {
+    cerr << traceFile << " is not a disk trace" << endl;
+    exit(1);
+  }
+  *blockSize = header.blockSize;
+
+  // A trace cut short by a crash ends in a partial record, which is dropped.
+  size_t count = (stat.st_size - sizeof(header)) / sizeof(DiskTraceRecord);
+  records->resize(count);
+  size_t length = count * sizeof(DiskTraceRecord);
+  unsigned char *data = (unsigned char *) records->data();
+  size_t offset = 0;
+  while (offset < length) {
+    ssize_t ret = read(fileDescriptor, data + offset, length - offset);
+    if (ret <= 0) {
+      perror("read");
+      cerr << "Could not read trace file " << traceFile << endl;
+      exit(1);
+    }
+    offset += ret;
+  }
+  close(fileDescriptor);
+}
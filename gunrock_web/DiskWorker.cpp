@@ -0,0 +1,99 @@
+#include <atomic>
+#include <iostream>
+#include <memory>
+
+#include <stdlib.h>
+
+#include "DiskWorker.h"
+
+using namespace std;
+
+DiskWorker::DiskWorker(Disk *disk) {
+  this->disk = disk;
+  this->isStopping = false;
+  pthread_mutex_init(&this->lock, NULL);
+  pthread_cond_init(&this->jobQueued, NULL);
+  if (pthread_create(&this->thread, NULL, run, this) != 0) {
+    cerr << "Could not start a thread for " << disk->imageFile << endl;
+    exit(1);
+  }
+}
+
+DiskWorker::~DiskWorker() {
+  pthread_mutex_lock(&this->lock);
+  this->isStopping = true;
+  pthread_cond_signal(&this->jobQueued);
+  pthread_mutex_unlock(&this->lock);
+  pthread_join(this->thread, NULL);
+  pthread_cond_destroy(&this->jobQueued);
+  pthread_mutex_destroy(&this->lock);
+}
+
+void DiskWorker::queueTransfer(bool isWrite, int firstBlockNumber, vector<struct iovec> buffers,
+                               function<void()> done) {
+  Job *job = new Job;
+  job->isSync = false;
+  job->isWrite = isWrite;
+  job->firstBlockNumber = firstBlockNumber;
+  job->buffers = std::move(buffers);
+  job->done = std::move(done);
+  queue(job);
+}
+
+void DiskWorker::queueSync(function<void()> done) {
+  Job *job = new Job;
+  job->isSync = true;
+  job->isWrite = false;
+  job->firstBlockNumber = 0;
+  job->done = std::move(done);
+  queue(job);
+}
+
+function<void()> DiskWorker::joinCallbacks(int count, function<void()> done) {
+  shared_ptr<atomic<int> > remaining = make_shared<atomic<int> >(count);
+  shared_ptr<function<void()> > joined = make_shared<function<void()> >(std::move(done));
+  return [remaining, joined]() {
+    if (--*remaining == 0) {
+      function<void()> done = std::move(*joined);
+      done();
+    }
+  };
+}
+
+void DiskWorker::queue(Job *job) {
+  pthread_mutex_lock(&this->lock);
+  this->jobs.push_back(job);
+  pthread_cond_signal(&this->jobQueued);
+  pthread_mutex_unlock(&this->lock);
+}
+
+void *DiskWorker::run(void *arg) {
+  DiskWorker *worker = (DiskWorker *) arg;
+  pthread_mutex_lock(&worker->lock);
+  while (true) {
+    while (worker->jobs.empty() && !worker->isStopping) {
+      pthread_cond_wait(&worker->jobQueued, &worker->lock);
+    }
+    if (worker->jobs.empty()) {
+      break;
+    }
+    Job *job = worker->jobs.front();
+    worker->jobs.pop_front();
+    pthread_mutex_unlock(&worker->lock);
+
+    if (job->isSync) {
+      worker->disk->syncImage();
+    } else if (job->isWrite) {
+      worker->disk->writeImageBlocks(job->firstBlockNumber, job->buffers.size(), job->buffers.data());
+    } else {
+      worker->disk->readImageBlocks(job->firstBlockNumber, job->buffers.size(), job->buffers.data());
+    }
+    function<void()> done = std::move(job->done);
+    delete job;
+    done();
+
+    pthread_mutex_lock(&worker->lock);
+  }
+  pthread_mutex_unlock(&worker->lock);
+  return NULL;
+}
@@ -15,8 +15,8 @@
 
 using namespace std;
 
-DistributedFileSystemService::DistributedFileSystemService(string diskFile) : HttpService("/ds3/") {
-  this->fileSystem = new LocalFileSystem(new Disk(diskFile, UFS_BLOCK_SIZE));
+DistributedFileSystemService::DistributedFileSystemService(Disk *disk) : HttpService("/ds3/") {
+  this->fileSystem = new LocalFileSystem(disk);
 }  
 
 void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *response) {
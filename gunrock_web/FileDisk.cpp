@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <iostream>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include "FileDisk.h"
+
+using namespace std;
+
+FileDisk::FileDisk(string imageFile, int blockSize) : Disk(imageFile, blockSize) {
+  struct stat stat;
+  // Fall back to a read-only descriptor so that images we can't write to
+  // still work with the read-only utilities.
+  this->imageFileDescriptor = open(imageFile.c_str(), O_RDWR);
+  if (this->imageFileDescriptor < 0) {
+    this->imageFileDescriptor = open(imageFile.c_str(), O_RDONLY);
+    this->isReadOnly = true;
+  }
+  if (this->imageFileDescriptor < 0) {
+    cerr << "could not open " << imageFile << endl;
+    exit(1);
+  }
+  int ret = fstat(this->imageFileDescriptor, &stat);
+  if (ret != 0) {
+    cerr << "Could not stat image file" << endl;
+    exit(1);
+  }
+
+  openImage(stat.st_size);
+}
+
+FileDisk::~FileDisk() {
+  finishWrites();
+  if (this->imageFileDescriptor >= 0) {
+    if (this->hasUnsyncedWrites) {
+      fsync(this->imageFileDescriptor);
+    }
+    close(this->imageFileDescriptor);
+    this->imageFileDescriptor = -1;
+  }
+}
+
+void FileDisk::readImageBlock(int blockNumber, void *buffer) {
+  off_t offset = (off_t) blockNumber * this->blockSize;
+  ssize_t ret = pread(this->imageFileDescriptor, buffer, this->blockSize, offset);
+  if (ret != this->blockSize) {
+    perror("read::pread");
+    cerr << "Could not read file" << endl;
+    exit(1);
+  }
+}
+
+void FileDisk::readImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers) {
+  off_t offset = (off_t) firstBlockNumber * this->blockSize;
+  while (count > 0) {
+    int batch = min(count, IOV_MAX);
+    ssize_t expected = (ssize_t) batch * this->blockSize;
+    ssize_t ret = preadv(this->imageFileDescriptor, buffers, batch, offset);
+    if (ret != expected) {
+      perror("read::preadv");
+      cerr << "Could not read file" << endl;
+      exit(1);
+    }
+    offset += expected;
+    buffers += batch;
+    count -= batch;
+  }
+}
+
+void FileDisk::writeImageBlock(int blockNumber, const void *buffer) {
+  off_t offset = (off_t) blockNumber * this->blockSize;
+  ssize_t ret = pwrite(this->imageFileDescriptor, buffer, this->blockSize, offset);
+  if (ret != this->blockSize) {
+    perror("write::pwrite");
+    cerr << "Could not write file" << endl;
+    exit(1);
+  }
+}
+
+void FileDisk::writeImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers) {
+  off_t offset = (off_t) firstBlockNumber * this->blockSize;
+  while (count > 0) {
+    int batch = min(count, IOV_MAX);
+    ssize_t expected = (ssize_t) batch * this->blockSize;
+    ssize_t ret = pwritev(this->imageFileDescriptor, buffers, batch, offset);
+    if (ret != expected) {
+      perror("write::pwritev");
+      cerr << "Could not write file" << endl;
+      exit(1);
+    }
+    offset += expected;
+    buffers += batch;
+    count -= batch;
+  }
+}
+
+void FileDisk::syncImage() {
+  if (fsync(this->imageFileDescriptor) != 0) {
+    perror("fsync");
+    cerr << "Could not sync image file " << this->imageFile << endl;
+    exit(1);
+  }
+}
+
+void FileDisk::prefetchImageBlocks(int firstBlockNumber, int count) {
+  posix_fadvise(this->imageFileDescriptor, (off_t) firstBlockNumber * this->blockSize,
+                (off_t) count * this->blockSize, POSIX_FADV_WILLNEED);
+}
+
+void FileDisk::discardImageBlocks(int firstBlockNumber, int count) {
+  // The file keeps its size, so the image stays the same number of blocks.
+  if (fallocate(this->imageFileDescriptor, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                (off_t) firstBlockNumber * this->blockSize, (off_t) count * this->blockSize) != 0 &&
+      errno != EOPNOTSUPP) {
+    perror("fallocate");
+    cerr << "Could not discard blocks of image file " << this->imageFile << endl;
+    exit(1);
+  }
+}
@@ -0,0 +1,91 @@
+#include "Histogram.h"
+
+using namespace std;
+
+Histogram::Histogram() {
+  for (int idx = 0; idx < NUMBER_OF_BUCKETS; idx++) {
+    buckets[idx] = 0;
+  }
+  total = 0;
+  sum = 0;
+  largest = 0;
+}
+
+int Histogram::bucketFor(unsigned long long value) {
+  if (value < (unsigned long long) SUB_BUCKETS) {
+    return value;
+  }
+  // magnitude is at least 4, and the 4 bits below the leading one pick
+  // the sub-bucket
+  int magnitude = 63 - __builtin_clzll(value);
+  int subBucket = (value >> (magnitude - 4)) & (SUB_BUCKETS - 1);
+  return (magnitude - 3) * SUB_BUCKETS + subBucket;
+}
+
+unsigned long long Histogram::highestValueIn(int bucket) {
+  if (bucket < SUB_BUCKETS) {
+    return bucket;
+  }
+  int magnitude = bucket / SUB_BUCKETS + 3;
+  unsigned long long subBucket = bucket % SUB_BUCKETS;
+  unsigned long long lowest = (SUB_BUCKETS + subBucket) << (magnitude - 4);
+  return lowest + (1ULL << (magnitude - 4)) - 1;
+}
+
+void Histogram::record(unsigned long long value) {
+  buckets[bucketFor(value)].fetch_add(1, memory_order_relaxed);
+  total.fetch_add(1, memory_order_relaxed);
+  sum.fetch_add(value, memory_order_relaxed);
+  unsigned long long seen = largest.load(memory_order_relaxed);
+  while (value > seen && !largest.compare_exchange_weak(seen, value, memory_order_relaxed)) {
+  }
+}
+
+unsigned long long Histogram::count() {
+  return total.load(memory_order_relaxed);
+}
+
+unsigned long long Histogram::max() {
+  return largest.load(memory_order_relaxed);
+}
+
+double Histogram::mean() {
+  unsigned long long recorded = count();
+  if (recorded == 0) {
+    return 0;
+  }
+  return (double) sum.load(memory_order_relaxed) / recorded;
+}
+
+unsigned long long Histogram::percentile(double percentile) {
+  unsigned long long recorded = count();
+  if (recorded == 0) {
+    return 0;
+  }
+  // the rank of the value we want, counting from 1
+  unsigned long long rank = (unsigned long long) (percentile / 100.0 * recorded + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  unsigned long long seen = 0;
+  for (int idx = 0; idx < NUMBER_OF_BUCKETS; idx++) {
+    seen += buckets[idx].load(memory_order_relaxed);
+    if (seen >= rank) {
+      unsigned long long highest = highestValueIn(idx);
+      return highest < max() ? highest : max();
+    }
+  }
+  return max();
+}
+
+HistogramSummary Histogram::summary() {
+  HistogramSummary summary;
+  summary.count = count();
+  summary.mean = mean();
+  summary.p50 = percentile(50);
+  summary.p90 = percentile(90);
+  summary.p99 = percentile(99);
+  summary.p999 = percentile(99.9);
+  summary.max = max();
+  return summary;
+}
@@ -0,0 +1,285 @@
+#include <algorithm>
+#include <iostream>
+#include <cstring>
+#include <vector>
+
+#include <sys/uio.h>
+
+#include "Journal.h"
+#include "AlignedBuffer.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+Journal *Journal::open(Disk *disk) {
+  int imageBlocks = disk->imageFileSize / disk->blockSize;
+  if (imageBlocks < 1 || disk->blockSize < (int) sizeof(journal_header_t)) {
+    return NULL;
+  }
+
+  vector<unsigned char> block(disk->blockSize);
+  disk->readImageBlock(imageBlocks - 1, block.data());
+  journal_header_t header;
+  memcpy(&header, block.data(), sizeof(header));
+  if (header.magic != UFS_JOURNAL_MAGIC) {
+    return NULL;
+  }
+  if (header.journal_addr <= 0 || header.journal_len < 3 ||
+      (long long) header.journal_addr + header.journal_len + 1 != imageBlocks) {
+    cerr << "Ignoring corrupt journal header in " << disk->imageFile << endl;
+    return NULL;
+  }
+  return new Journal(disk, header.journal_addr, header.journal_len, header.checkpointed_sequence);
+}
+
+Journal::Journal(Disk *disk, int journalAddress, int journalLength, unsigned int checkpointedSequence) {
+  this->disk = disk;
+  this->journalAddress = journalAddress;
+  this->journalLength = journalLength;
+  this->checkpointedSequence = checkpointedSequence;
+  this->lastSequence = checkpointedSequence;
+  this->head = 0;
+  this->inFlight = 0;
+  pthread_mutex_init(&this->lock, NULL);
+  pthread_cond_init(&this->appendsDone, NULL);
+
+  // A transaction needs a descriptor in front of every descriptorCapacity
+  // data blocks and one commit block after them.
+  this->descriptorCapacity = (disk->blockSize - sizeof(journal_descriptor_t)) / sizeof(int);
+  int recordBlocks = journalLength - 1;
+  this->maxBlocksPerTransaction = recordBlocks - (recordBlocks + descriptorCapacity) / (descriptorCapacity + 1);
+}
+
+Journal::~Journal() {
+  pthread_cond_destroy(&this->appendsDone);
+  pthread_mutex_destroy(&this->lock);
+}
+
+int Journal::address() {
+  return journalAddress;
+}
+
+int Journal::capacity() {
+  return maxBlocksPerTransaction;
+}
+
+int Journal::recordLength(int count) {
+  return count + (count + descriptorCapacity - 1) / descriptorCapacity + 1;
+}
+
+unsigned long long Journal::checksum(const unsigned char *data, int length, unsigned long long hash) {
+  for (int idx = 0; idx < length; idx++) {
+    hash ^= data[idx];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static const unsigned long long CHECKSUM_SEED = 14695981039346656037ULL;
+
+void Journal::recover() {
+  int blockSize = disk->blockSize;
+  vector<unsigned char> descriptorBlock(blockSize);
+  vector<unsigned char> commitBlock(blockSize);
+  vector<vector<unsigned char> > dataBlocks;
+  vector<int> homeBlocks;
+  unsigned int sequence = checkpointedSequence + 1;
+  int position = 0;
+  int replayed = 0;
+
+  while (position + 2 <= journalLength) {
+    // A transaction is one or more descriptors, each followed by its data
+    // blocks, and then the commit block. It is replayed only when all of
+    // them are intact.
+    unsigned long long hash = CHECKSUM_SEED;
+    int recordPosition = position;
+    bool isComplete = false;
+    dataBlocks.clear();
+    homeBlocks.clear();
+    while (recordPosition + 2 <= journalLength) {
+      disk->readImageBlock(journalAddress + recordPosition, descriptorBlock.data());
+      journal_descriptor_t descriptor;
+      memcpy(&descriptor, descriptorBlock.data(), sizeof(descriptor));
+      if (descriptor.magic != UFS_JOURNAL_DESCRIPTOR_MAGIC || descriptor.sequence != sequence ||
+          descriptor.num_blocks < 1 || descriptor.num_blocks > descriptorCapacity ||
+          recordPosition + descriptor.num_blocks + 2 > journalLength) {
+        break;
+      }
+      const int *descriptorHomes = (const int *) (descriptorBlock.data() + sizeof(journal_descriptor_t));
+      homeBlocks.insert(homeBlocks.end(), descriptorHomes, descriptorHomes + descriptor.num_blocks);
+
+      hash = checksum(descriptorBlock.data(), blockSize, hash);
+      for (int idx = 0; idx < descriptor.num_blocks; idx++) {
+        dataBlocks.push_back(vector<unsigned char>(blockSize));
+        disk->readImageBlock(journalAddress + recordPosition + 1 + idx, dataBlocks.back().data());
+        hash = checksum(dataBlocks.back().data(), blockSize, hash);
+      }
+      recordPosition += descriptor.num_blocks + 1;
+
+      disk->readImageBlock(journalAddress + recordPosition, commitBlock.data());
+      journal_commit_t commitRecord;
+      memcpy(&commitRecord, commitBlock.data(), sizeof(commitRecord));
+      if (commitRecord.magic == UFS_JOURNAL_COMMIT_MAGIC) {
+        isComplete = commitRecord.sequence == sequence && commitRecord.checksum == hash;
+        recordPosition++;
+        break;
+      }
+      // otherwise the transaction continues with another descriptor
+    }
+    if (!isComplete) {
+      // the transaction never committed
+      break;
+    }
+
+    bool isValid = true;
+    for (size_t idx = 0; idx < homeBlocks.size(); idx++) {
+      if (homeBlocks[idx] < 0 || homeBlocks[idx] >= journalAddress) {
+        isValid = false;
+      }
+    }
+    if (!isValid) {
+      cerr << "Journal transaction " << sequence << " has an invalid block number" << endl;
+      break;
+    }
+
+    if (disk->isReadOnly) {
+      cerr << "Could not replay the journal of " << disk->imageFile << ": the image is read-only" << endl;
+      return;
+    }
+    for (size_t idx = 0; idx < homeBlocks.size(); idx++) {
+      disk->writeImageBlock(homeBlocks[idx], dataBlocks[idx].data());
+    }
+    position = recordPosition;
+    sequence++;
+    replayed++;
+  }
+
+  if (replayed > 0) {
+    disk->flushImage();
+    checkpointedSequence = sequence - 1;
+    lastSequence = checkpointedSequence;
+    writeHeader();
+    disk->flushImage();
+  }
+}
+
+void Journal::append(map<int, unsigned char *> &blocks) {
+  int blockSize = disk->blockSize;
+  int count = blocks.size();
+  int length = recordLength(count);
+  int descriptorCount = length - count - 1;
+  AlignedBuffer descriptorBlocks(descriptorCount * blockSize);
+  AlignedBuffer commitBlock(blockSize);
+
+  pthread_mutex_lock(&lock);
+  if (head + length > journalLength) {
+    checkpointLocked();
+  }
+  unsigned int sequence = lastSequence + 1;
+
+  // Every descriptor lists the home block numbers of the data blocks that
+  // follow it, and the checksum in the commit block covers them all.
+  vector<struct iovec> buffers(length);
+  unsigned long long hash = CHECKSUM_SEED;
+  map<int, unsigned char *>::iterator iter = blocks.begin();
+  int position = 0;
+  for (int descriptorIdx = 0; descriptorIdx < descriptorCount; descriptorIdx++) {
+    unsigned char *descriptorBlock = descriptorBlocks.data() + descriptorIdx * blockSize;
+    journal_descriptor_t descriptor;
+    descriptor.magic = UFS_JOURNAL_DESCRIPTOR_MAGIC;
+    descriptor.sequence = sequence;
+    descriptor.num_blocks = min(descriptorCapacity, count - descriptorIdx * descriptorCapacity);
+    memcpy(descriptorBlock, &descriptor, sizeof(descriptor));
+    int *homeBlocks = (int *) (descriptorBlock + sizeof(journal_descriptor_t));
+    buffers[position].iov_base = descriptorBlock;
+    buffers[position].iov_len = blockSize;
+    position++;
+    for (int idx = 0; idx < descriptor.num_blocks; idx++, iter++) {
+      homeBlocks[idx] = iter->first;
+      buffers[position].iov_base = iter->second;
+      buffers[position].iov_len = blockSize;
+      position++;
+    }
+    // the block numbers are in place now
+    hash = checksum(descriptorBlock, blockSize, hash);
+    for (int idx = descriptor.num_blocks; idx > 0; idx--) {
+      hash = checksum((const unsigned char *) buffers[position - idx].iov_base, blockSize, hash);
+    }
+  }
+
+  journal_commit_t commitRecord;
+  commitRecord.magic = UFS_JOURNAL_COMMIT_MAGIC;
+  commitRecord.sequence = sequence;
+  commitRecord.checksum = hash;
+  memcpy(commitBlock.data(), &commitRecord, sizeof(commitRecord));
+  buffers[position].iov_base = commitBlock.data();
+  buffers[position].iov_len = blockSize;
+
+  // The whole transaction goes to the journal with one write and is
+  // durable after one flush. The records are written in sequence order,
+  // so the flush also covers every earlier transaction. The home copies
+  // are only flushed at the next checkpoint: until then recovery can redo
+  // them from the journal.
+  disk->writeImageBlocks(journalAddress + head, length, buffers.data());
+  head += length;
+  lastSequence = sequence;
+  inFlight++;
+  pthread_mutex_unlock(&lock);
+
+  disk->groupSync();
+  for (iter = blocks.begin(); iter != blocks.end(); iter++) {
+    disk->storeBlock(iter->first, iter->second);
+  }
+
+  pthread_mutex_lock(&lock);
+  for (iter = blocks.begin(); iter != blocks.end(); iter++) {
+    pendingBlocks.insert(iter->first);
+  }
+  inFlight--;
+  if (inFlight == 0) {
+    pthread_cond_broadcast(&appendsDone);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+bool Journal::isPending(int blockNumber) {
+  pthread_mutex_lock(&lock);
+  bool isPending = pendingBlocks.count(blockNumber) != 0;
+  pthread_mutex_unlock(&lock);
+  return isPending;
+}
+
+void Journal::checkpoint() {
+  pthread_mutex_lock(&lock);
+  checkpointLocked();
+  pthread_mutex_unlock(&lock);
+}
+
+void Journal::checkpointLocked() {
+  // an append in flight has not stored its home copies yet
+  while (inFlight > 0) {
+    pthread_cond_wait(&appendsDone, &lock);
+  }
+  if (head == 0) {
+    return;
+  }
+  disk->flushDirtyBlocks();
+  disk->groupSync();
+  checkpointedSequence = lastSequence;
+  writeHeader();
+  disk->flushImage();
+  head = 0;
+  pendingBlocks.clear();
+}
+
+void Journal::writeHeader() {
+  AlignedBuffer block(disk->blockSize);
+  journal_header_t header;
+  header.magic = UFS_JOURNAL_MAGIC;
+  header.journal_addr = journalAddress;
+  header.journal_len = journalLength;
+  header.checkpointed_sequence = checkpointedSequence;
+  memcpy(block.data(), &header, sizeof(header));
+  disk->writeImageBlock(journalAddress + journalLength, block.data());
+}
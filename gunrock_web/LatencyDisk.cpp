@@ -0,0 +1,174 @@
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <random>
+#include <errno.h>
+#include <time.h>
+
+#include <stdlib.h>
+
+#include "LatencyDisk.h"
+#include "StringUtils.h"
+
+using namespace std;
+
+static long long monotonicNanoseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void sleepUntil(long long deadlineNanoseconds) {
+  struct timespec deadline;
+  deadline.tv_sec = deadlineNanoseconds / 1000000000LL;
+  deadline.tv_nsec = deadlineNanoseconds % 1000000000LL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+  }
+}
+
+LatencyDisk::LatencyDisk(Disk *inner, string spec) : Disk(inner->imageFile, inner->blockSize) {
+  if (inner->journal != NULL) {
+    cerr << "A LatencyDisk must wrap a Disk opened with openRawDisk" << endl;
+    exit(1);
+  }
+  this->inner = inner;
+  this->isReadOnly = inner->isReadOnly;
+  this->bytesPerSecond = 0;
+  this->linkFreeNanoseconds = 0;
+  pthread_mutex_init(&this->linkLock, NULL);
+  LatencyModel *models[] = { &readLatency, &writeLatency, &syncLatency };
+  for (int idx = 0; idx < 3; idx++) {
+    models[idx]->kind = LATENCY_NONE;
+    models[idx]->meanMicroseconds = 0;
+    models[idx]->deviationMicroseconds = 0;
+    models[idx]->nextTraceEntry = 0;
+  }
+
+  vector<string> settings = StringUtils::split(spec, ',');
+  for (size_t idx = 0; idx < settings.size(); idx++) {
+    size_t equals = settings[idx].find('=');
+    string name = settings[idx].substr(0, equals);
+    string value = equals == string::npos ? "" : settings[idx].substr(equals + 1);
+    if (name == "read") {
+      parseModel(&readLatency, value);
+    } else if (name == "write") {
+      parseModel(&writeLatency, value);
+    } else if (name == "sync") {
+      parseModel(&syncLatency, value);
+    } else if (name == "bandwidth" && atoll(value.c_str()) > 0) {
+      bytesPerSecond = atoll(value.c_str()) * 1024 * 1024;
+    } else {
+      cerr << "unknown latency setting " << settings[idx] << endl;
+      exit(1);
+    }
+  }
+
+  // Keep the wrapped backend's idea of when to flush and whether to
+  // release freed blocks. The journal is
+  // found and replayed here, through the slowed down hooks.
+  setDurabilityPolicy(inner->durabilityPolicy, inner->durabilityIntervalMilliseconds);
+  setDiscard(inner->isDiscardEnabled);
+  openImage(inner->imageFileSize);
+}
+
+LatencyDisk::~LatencyDisk() {
+  finishWrites();
+  if (this->hasUnsyncedWrites && !this->isReadOnly) {
+    inner->syncImage();
+  }
+  delete inner;
+  pthread_mutex_destroy(&this->linkLock);
+}
+
+void LatencyDisk::parseModel(LatencyModel *model, string spec) {
+  vector<string> fields = StringUtils::split(spec, ':');
+  if (fields.size() == 2 && fields[0] == "fixed") {
+    model->kind = LATENCY_FIXED;
+    model->meanMicroseconds = atoll(fields[1].c_str());
+  } else if (fields.size() == 3 && fields[0] == "normal") {
+    model->kind = LATENCY_NORMAL;
+    model->meanMicroseconds = atoll(fields[1].c_str());
+    model->deviationMicroseconds = atoll(fields[2].c_str());
+  } else if (fields.size() == 2 && fields[0] == "trace") {
+    ifstream traceFile(fields[1].c_str());
+    long long latency;
+    while (traceFile >> latency) {
+      model->trace.push_back(max(latency, 0LL));
+    }
+    if (model->trace.empty()) {
+      cerr << "could not read latencies from " << fields[1] << endl;
+      exit(1);
+    }
+    model->kind = LATENCY_TRACE;
+  } else {
+    cerr << "unknown latency model " << spec << endl;
+    exit(1);
+  }
+}
+
+long long LatencyDisk::sampleMicroseconds(LatencyModel *model) {
+  switch (model->kind) {
+  case LATENCY_FIXED:
+    return model->meanMicroseconds;
+  case LATENCY_NORMAL: {
+    static thread_local mt19937_64 generator(random_device{}());
+    normal_distribution<double> distribution(model->meanMicroseconds, model->deviationMicroseconds);
+    return max((long long) distribution(generator), 0LL);
+  }
+  case LATENCY_TRACE:
+    return model->trace[model->nextTraceEntry++ % model->trace.size()];
+  case LATENCY_NONE:
+    break;
+  }
+  return 0;
+}
+
+void LatencyDisk::delay(LatencyModel *model, long long bytes) {
+  long long latency = sampleMicroseconds(model) * 1000;
+  if (latency == 0 && (bytesPerSecond == 0 || bytes == 0)) {
+    return;
+  }
+  long long deadline = monotonicNanoseconds() + latency;
+  if (bytesPerSecond > 0 && bytes > 0) {
+    // Transfers cross the link one after another, each starting once its
+    // latency has passed and the link is free.
+    pthread_mutex_lock(&linkLock);
+    deadline = max(deadline, linkFreeNanoseconds) + bytes * 1000000000LL / bytesPerSecond;
+    linkFreeNanoseconds = deadline;
+    pthread_mutex_unlock(&linkLock);
+  }
+  sleepUntil(deadline);
+}
+
+void LatencyDisk::readImageBlock(int blockNumber, void *buffer) {
+  delay(&readLatency, blockSize);
+  inner->readImageBlock(blockNumber, buffer);
+}
+
+void LatencyDisk::writeImageBlock(int blockNumber, const void *buffer) {
+  delay(&writeLatency, blockSize);
+  inner->writeImageBlock(blockNumber, buffer);
+}
+
+void LatencyDisk::syncImage() {
+  delay(&syncLatency, 0);
+  inner->syncImage();
+}
+
+void LatencyDisk::readImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers) {
+  delay(&readLatency, (long long) count * blockSize);
+  inner->readImageBlocks(firstBlockNumber, count, buffers);
+}
+
+void LatencyDisk::writeImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers) {
+  delay(&writeLatency, (long long) count * blockSize);
+  inner->writeImageBlocks(firstBlockNumber, count, buffers);
+}
+
+void LatencyDisk::prefetchImageBlocks(int firstBlockNumber, int count) {
+  inner->prefetchImageBlocks(firstBlockNumber, count);
+}
+
+void LatencyDisk::discardImageBlocks(int firstBlockNumber, int count) {
+  inner->discardImageBlocks(firstBlockNumber, count);
+}
@@ -4,45 +4,513 @@
 #include <assert.h>
 #include <cstring>
 #include <cmath>
+#include <limits.h>
+#include <sys/uio.h>
 #include "LocalFileSystem.h"
+#include "AlignedBuffer.h"
 #include "ufs.h"
 
 using namespace std;
 
+// The most memory the indirect blocks cached by a LocalFileSystem take.
+static const int POINTER_CACHE_BYTES = 4 * 1024 * 1024;
+
+// Calls operation with the BlockGeometry of blockSize, so that it runs the
+// code compiled for that size.
+template <typename Operation>
+static auto withGeometry(int blockSize, Operation operation) {
+  switch(blockSize) {
+  case 16384:
+    return operation(BlockGeometry<16384>());
+  case 65536:
+    return operation(BlockGeometry<65536>());
+  default:
+    return operation(BlockGeometry<UFS_BLOCK_SIZE>());
+  }
+}
+
+// Reads `length` consecutive blocks starting at `address` with one
+// vectored disk call.
+static void readRegion(Disk *disk, int address, int length, unsigned char *data) {
+  int blockSize = disk->getBlockSize();
+  vector<int> blockNumbers(length);
+  vector<struct iovec> buffers(length);
+  for(int i = 0; i < length; i++) {
+    blockNumbers[i] = address + i;
+    buffers[i].iov_base = data + (size_t) i * blockSize;
+    buffers[i].iov_len = blockSize;
+  }
+  disk->readBlocks(blockNumbers.data(), length, buffers.data());
+}
 
 LocalFileSystem::LocalFileSystem(Disk *disk) {
   this->disk = disk;
+  this->blockSize = disk->getBlockSize();
+  pthread_mutexattr_t lockAttributes;
+  pthread_mutexattr_init(&lockAttributes);
+  pthread_mutexattr_settype(&lockAttributes, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&this->fileSystemLock, &lockAttributes);
+  pthread_mutexattr_destroy(&lockAttributes);
+  this->isLockedForTransaction = false;
+  // Mount: the super block and the bitmaps are read once, and from then on
+  // the copies here are the ones that count.
+  AlignedBuffer superBlock(blockSize);
+  disk->readBlock(0, superBlock.data());
+  memcpy(&mountedSuper, superBlock.data(), sizeof(super_t));
+  int formattedBlockSize = mountedSuper.block_size == 0 ? UFS_BLOCK_SIZE : mountedSuper.block_size;
+  if(formattedBlockSize != blockSize) {
+    cerr << "The file system has " << formattedBlockSize << " byte blocks but the disk has " << blockSize << endl;
+    exit(1);
+  }
+  inodeFormat = mountedSuper.inode_format;
+  if(inodeFormat != UFS_INODE_DIRECT && inodeFormat != UFS_INODE_INDIRECT && inodeFormat != UFS_INODE_EXTENT) {
+    cerr << "The file system has inode format " << inodeFormat << ", which isn't supported" << endl;
+    exit(1);
+  }
+  directPointers = inodeFormat == UFS_INODE_INDIRECT ? INDIRECT_DIRECT_PTRS : DIRECT_PTRS;
+  long long maxBlocks = directPointers;
+  if(inodeFormat == UFS_INODE_INDIRECT) {
+    long long pointersPerBlock = blockSize / sizeof(unsigned int);
+    maxBlocks += pointersPerBlock + pointersPerBlock * pointersPerBlock;
+  } else if(inodeFormat == UFS_INODE_EXTENT) {
+    // An extent can be as long as the data region, so what limits a file
+    // is how fragmented the free space is, which write deals with.
+    directPointers = 0;
+    maxBlocks = INT_MAX;
+  }
+  maxFileSize = (int) min((long long) INT_MAX, maxBlocks * blockSize);
+  mountedInodeBitmap.resize((size_t) mountedSuper.inode_bitmap_len * blockSize);
+  readRegion(disk, mountedSuper.inode_bitmap_addr, mountedSuper.inode_bitmap_len, mountedInodeBitmap.data());
+  inodeBitmapOnDisk = mountedInodeBitmap;
+  mountedDataBitmap.resize((size_t) mountedSuper.data_bitmap_len * blockSize);
+  readRegion(disk, mountedSuper.data_bitmap_addr, mountedSuper.data_bitmap_len, mountedDataBitmap.data());
+  dataBitmapOnDisk = mountedDataBitmap;
+  inodeAllocator.attach(&mountedInodeBitmap, mountedSuper.num_inodes);
+  dataAllocator.attach(&mountedDataBitmap, mountedSuper.num_data);
+}
+
+LocalFileSystem::~LocalFileSystem() {
+  pthread_mutex_destroy(&fileSystemLock);
+}
+
+void LocalFileSystem::lock() {
+  pthread_mutex_lock(&fileSystemLock);
+  if(isLockedForTransaction) {
+    return;
+  }
+  // Only this thread can have begun the transaction that holds the lock,
+  // so once it has been taken for one, it stays until that one ends.
+  pthread_mutex_lock(&fileSystemLock);
+  bool isInTransaction = disk->onFinish([this]() {
+    isLockedForTransaction = false;
+    pthread_mutex_unlock(&fileSystemLock);
+  });
+  if(isInTransaction) {
+    isLockedForTransaction = true;
+  } else {
+    pthread_mutex_unlock(&fileSystemLock);
+  }
+}
+
+void LocalFileSystem::unlock() {
+  pthread_mutex_unlock(&fileSystemLock);
 }
 
 void LocalFileSystem::readSuperBlock(super_t *super) {
   if(super == nullptr) {
     return;
   }
-  char buffer[UFS_BLOCK_SIZE];
-  disk->readBlock(0, buffer);
-  memcpy(super, buffer, sizeof(super_t));
+  lock();
+  *super = mountedSuper;
+  unlock();
 }
 
 void LocalFileSystem::readInodeBitmap(super_t *super, unsigned char *inodeBitmap) {
   if(super == nullptr || inodeBitmap == nullptr) {
     return;
   }
-  disk->readBlock(super->inode_bitmap_addr, (char*)inodeBitmap);
+  lock();
+  memcpy(inodeBitmap, mountedInodeBitmap.data(), mountedInodeBitmap.size());
+  unlock();
 }
 
-void LocalFileSystem::writeInodeBitmap(super_t *super, unsigned char *inodeBitmap) {
+void LocalFileSystem::writeBitmap(int address, vector<unsigned char> &bitmap, vector<unsigned char> &onDisk,
+                                  BitmapAllocator &allocator) {
+  vector<int> blockNumbers;
+  vector<struct iovec> buffers;
+  vector<unsigned char> oldBlocks;
+  for(size_t offset = 0; offset < bitmap.size(); offset += blockSize) {
+    if(memcmp(&bitmap[offset], &onDisk[offset], blockSize) == 0) {
+      continue;
+    }
+    struct iovec buffer;
+    buffer.iov_base = &bitmap[offset];
+    buffer.iov_len = blockSize;
+    blockNumbers.push_back(address + offset / blockSize);
+    buffers.push_back(buffer);
+    oldBlocks.insert(oldBlocks.end(), &onDisk[offset], &onDisk[offset] + blockSize);
+    memcpy(&onDisk[offset], &bitmap[offset], blockSize);
+  }
+  if(blockNumbers.empty()) {
+    return;
+  }
+  disk->writeBlocks(blockNumbers.data(), blockNumbers.size(), buffers.data());
+  // A rollback takes the blocks back to what they were before, on disk and
+  // so here too.
+  disk->onRollback([this, address, &bitmap, &onDisk, &allocator, blockNumbers, oldBlocks]() {
+    for(size_t i = 0; i < blockNumbers.size(); i++) {
+      size_t offset = (size_t) (blockNumbers[i] - address) * blockSize;
+      memcpy(&bitmap[offset], &oldBlocks[i * blockSize], blockSize);
+      memcpy(&onDisk[offset], &oldBlocks[i * blockSize], blockSize);
+      allocator.rewind(offset * 8);
+    }
+  });
+}
 
+void LocalFileSystem::writeInodeBitmap(super_t *super, unsigned char *inodeBitmap) {
+  if(super == nullptr || inodeBitmap == nullptr) {
+    return;
+  }
+  lock();
+  if(inodeBitmap != mountedInodeBitmap.data()) {
+    memcpy(mountedInodeBitmap.data(), inodeBitmap, mountedInodeBitmap.size());
+    inodeAllocator.rewind(0);
+  }
+  writeBitmap(mountedSuper.inode_bitmap_addr, mountedInodeBitmap, inodeBitmapOnDisk, inodeAllocator);
+  unlock();
 }
 
 void LocalFileSystem::readDataBitmap(super_t *super, unsigned char *dataBitmap) {
   if(super == nullptr || dataBitmap == nullptr) {
     return;
   }
-  disk->readBlock(super->data_bitmap_addr, (char*)dataBitmap);
+  lock();
+  memcpy(dataBitmap, mountedDataBitmap.data(), mountedDataBitmap.size());
+  unlock();
 }
 
 void LocalFileSystem::writeDataBitmap(super_t *super, unsigned char *dataBitmap) {
+  if(super == nullptr || dataBitmap == nullptr) {
+    return;
+  }
+  lock();
+  if(dataBitmap != mountedDataBitmap.data()) {
+    memcpy(mountedDataBitmap.data(), dataBitmap, mountedDataBitmap.size());
+    dataAllocator.rewind(0);
+  }
+  writeBitmap(mountedSuper.data_bitmap_addr, mountedDataBitmap, dataBitmapOnDisk, dataAllocator);
+  unlock();
+}
+
+// The runs of consecutive blocks in blocks, as extents.
+static vector<extent_t> toExtents(const vector<int> &blocks) {
+  vector<extent_t> extents;
+  for(size_t i = 0; i < blocks.size(); i++) {
+    if(!extents.empty() && extents.back().start + extents.back().length == (unsigned int) blocks[i]) {
+      extents.back().length++;
+    } else {
+      extent_t extent = { (unsigned int) blocks[i], 1 };
+      extents.push_back(extent);
+    }
+  }
+  return extents;
+}
+
+int LocalFileSystem::extentsPerTreeBlock() {
+  return (blockSize - sizeof(extent_header_t)) / sizeof(extent_t);
+}
+
+int LocalFileSystem::pointerBlocksFor(const vector<int> &blocks) {
+  int count = blocks.size();
+  if(inodeFormat == UFS_INODE_EXTENT) {
+    int extents = toExtents(blocks).size();
+    int perBlock = extentsPerTreeBlock();
+    if(extents <= INODE_EXTENTS) {
+      return 0;
+    }
+    extents -= INODE_EXTENTS;
+    if(extents <= perBlock) {
+      return 1;
+    }
+    int leaves = (extents + perBlock - 1) / perBlock;
+    return leaves <= perBlock ? 1 + leaves : -1;
+  }
+  int pointersPerBlock = blockSize / sizeof(unsigned int);
+  if(count <= directPointers) {
+    return 0;
+  }
+  if(inodeFormat != UFS_INODE_INDIRECT) {
+    return -1;
+  }
+  count -= directPointers;
+  if(count <= pointersPerBlock) {
+    return 1;
+  }
+  count -= pointersPerBlock;
+  return 2 + (count + pointersPerBlock - 1) / pointersPerBlock;
+}
+
+bool LocalFileSystem::isDataBlock(unsigned int blockNumber) {
+  return blockNumber >= (unsigned int) mountedSuper.data_region_addr &&
+         blockNumber < (unsigned int) (mountedSuper.data_region_addr + mountedSuper.data_region_len);
+}
+
+bool LocalFileSystem::areDataBlocks(const unsigned int *blockNumbers, int count) {
+  for(int i = 0; i < count; i++) {
+    if(!isDataBlock(blockNumbers[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int LocalFileSystem::mapBlocks(const inode_t &inode, int count, vector<int> &blocks, vector<int> *pointerBlocks) {
+  if(inodeFormat == UFS_INODE_EXTENT) {
+    vector<extent_t> extents;
+    if(readExtents(inode, extents, pointerBlocks) != 0) {
+      return -EINVALIDINODE;
+    }
+    for(size_t i = 0; i < extents.size() && count > 0; i++) {
+      for(unsigned int j = 0; j < extents[i].length && count > 0; j++, count--) {
+        blocks.push_back(extents[i].start + j);
+      }
+    }
+    // the extents end before the file does
+    return count > 0 ? -EINVALIDINODE : 0;
+  }
+  int pointersPerBlock = blockSize / sizeof(unsigned int);
+  // more blocks than the inode can point to, or a pointer outside the
+  // data region, means the inode is corrupt
+  int maxBlocks = directPointers;
+  if(inodeFormat == UFS_INODE_INDIRECT) {
+    maxBlocks += pointersPerBlock + pointersPerBlock * pointersPerBlock;
+  }
+  if(count < 0 || count > maxBlocks) {
+    return -EINVALIDINODE;
+  }
+  if(!areDataBlocks((const unsigned int *) inode.direct, min(count, directPointers))) {
+    return -EINVALIDINODE;
+  }
+  for(int i = 0; i < min(count, directPointers); i++) {
+    blocks.push_back(inode.direct[i]);
+  }
+  if(count <= directPointers) {
+    return 0;
+  }
+  count -= directPointers;
+  if(!isDataBlock(inode.direct[INDIRECT_PTR])) {
+    return -EINVALIDINODE;
+  }
+  if(pointerBlocks != nullptr) {
+    pointerBlocks->push_back(inode.direct[INDIRECT_PTR]);
+  }
+  const unsigned int *pointers = readPointerBlock(inode.direct[INDIRECT_PTR]);
+  if(!areDataBlocks(pointers, min(count, pointersPerBlock))) {
+    return -EINVALIDINODE;
+  }
+  blocks.insert(blocks.end(), pointers, pointers + min(count, pointersPerBlock));
+  if(count <= pointersPerBlock) {
+    return 0;
+  }
+  count -= pointersPerBlock;
+  if(!isDataBlock(inode.direct[DOUBLE_INDIRECT_PTR])) {
+    return -EINVALIDINODE;
+  }
+  if(pointerBlocks != nullptr) {
+    pointerBlocks->push_back(inode.direct[DOUBLE_INDIRECT_PTR]);
+  }
+  // copied, since reading the blocks it points to may evict it
+  pointers = readPointerBlock(inode.direct[DOUBLE_INDIRECT_PTR]);
+  vector<unsigned int> indirectBlocks(pointers, pointers + (count + pointersPerBlock - 1) / pointersPerBlock);
+  if(!areDataBlocks(indirectBlocks.data(), indirectBlocks.size())) {
+    return -EINVALIDINODE;
+  }
+  for(size_t i = 0; i < indirectBlocks.size(); i++) {
+    if(pointerBlocks != nullptr) {
+      pointerBlocks->push_back(indirectBlocks[i]);
+    }
+    pointers = readPointerBlock(indirectBlocks[i]);
+    if(!areDataBlocks(pointers, min(count, pointersPerBlock))) {
+      return -EINVALIDINODE;
+    }
+    blocks.insert(blocks.end(), pointers, pointers + min(count, pointersPerBlock));
+    count -= pointersPerBlock;
+  }
+  return 0;
+}
+
+bool LocalFileSystem::isTreeBlock(const extent_header_t *header, int depth) {
+  return header->magic == UFS_EXTENT_TREE_MAGIC && header->depth == depth && header->num_entries >= 1 &&
+         header->num_entries <= extentsPerTreeBlock();
+}
+
+bool LocalFileSystem::areDataExtents(const extent_t *extents, int count) {
+  for(int i = 0; i < count; i++) {
+    if(extents[i].length == 0 || !isDataBlock(extents[i].start) ||
+       !isDataBlock(extents[i].start + extents[i].length - 1) || extents[i].start + extents[i].length < extents[i].start) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int LocalFileSystem::readExtents(const inode_t &inode, vector<extent_t> &extents, vector<int> *treeBlocks) {
+  const extent_t *inodeExtents = (const extent_t *) inode.direct;
+  int inodeCount = 0;
+  while(inodeCount < INODE_EXTENTS && inodeExtents[inodeCount].length != 0) {
+    inodeCount++;
+  }
+  if(!areDataExtents(inodeExtents, inodeCount)) {
+    return -EINVALIDINODE;
+  }
+  extents.insert(extents.end(), inodeExtents, inodeExtents + inodeCount);
+  if(inode.direct[EXTENT_TREE_PTR] == 0) {
+    return 0;
+  }
+  if(!isDataBlock(inode.direct[EXTENT_TREE_PTR])) {
+    return -EINVALIDINODE;
+  }
+  if(treeBlocks != nullptr) {
+    treeBlocks->push_back(inode.direct[EXTENT_TREE_PTR]);
+  }
+  const extent_header_t *header = (const extent_header_t *) readPointerBlock(inode.direct[EXTENT_TREE_PTR]);
+  if(!isTreeBlock(header, 0) && !isTreeBlock(header, 1)) {
+    return -EINVALIDINODE;
+  }
+  const extent_t *entries = (const extent_t *) (header + 1);
+  if(header->depth == 0) {
+    if(!areDataExtents(entries, header->num_entries)) {
+      return -EINVALIDINODE;
+    }
+    extents.insert(extents.end(), entries, entries + header->num_entries);
+    return 0;
+  }
+  // copied, since reading the leaves may evict it
+  vector<extent_t> leaves(entries, entries + header->num_entries);
+  for(size_t i = 0; i < leaves.size(); i++) {
+    if(!isDataBlock(leaves[i].start)) {
+      return -EINVALIDINODE;
+    }
+    if(treeBlocks != nullptr) {
+      treeBlocks->push_back(leaves[i].start);
+    }
+    header = (const extent_header_t *) readPointerBlock(leaves[i].start);
+    if(!isTreeBlock(header, 0) || header->num_entries != (int) leaves[i].length) {
+      return -EINVALIDINODE;
+    }
+    entries = (const extent_t *) (header + 1);
+    if(!areDataExtents(entries, header->num_entries)) {
+      return -EINVALIDINODE;
+    }
+    extents.insert(extents.end(), entries, entries + header->num_entries);
+  }
+  return 0;
+}
+
+void LocalFileSystem::writePointers(inode_t &inode, const vector<int> &blocks, const vector<int> &pointerBlocks) {
+  if(inodeFormat == UFS_INODE_EXTENT) {
+    writeExtents(inode, blocks, pointerBlocks);
+    return;
+  }
+  int count = blocks.size();
+  for(int i = 0; i < min(count, directPointers); i++) {
+    inode.direct[i] = blocks[i];
+  }
+  if(inodeFormat != UFS_INODE_INDIRECT) {
+    return;
+  }
+  inode.direct[INDIRECT_PTR] = pointerBlocks.size() > 0 ? pointerBlocks[0] : 0;
+  inode.direct[DOUBLE_INDIRECT_PTR] = pointerBlocks.size() > 1 ? pointerBlocks[1] : 0;
+  if(pointerBlocks.empty()) {
+    return;
+  }
+  int pointersPerBlock = blockSize / sizeof(unsigned int);
+  vector<vector<unsigned int> > contents(pointerBlocks.size(), vector<unsigned int>(pointersPerBlock, 0));
+  for(int i = directPointers; i < count; i++) {
+    int index = i - directPointers;
+    if(index < pointersPerBlock) {
+      contents[0][index] = blocks[i];
+    } else {
+      index -= pointersPerBlock;
+      contents[2 + index / pointersPerBlock][index % pointersPerBlock] = blocks[i];
+    }
+  }
+  for(size_t i = 2; i < pointerBlocks.size(); i++) {
+    contents[1][i - 2] = pointerBlocks[i];
+  }
+  writePointerBlocks(pointerBlocks, contents);
+}
+
+void LocalFileSystem::writeExtents(inode_t &inode, const vector<int> &blocks, const vector<int> &treeBlocks) {
+  vector<extent_t> extents = toExtents(blocks);
+  memset(inode.direct, 0, sizeof(inode.direct));
+  int inodeExtents = min((int) extents.size(), INODE_EXTENTS);
+  memcpy(inode.direct, extents.data(), inodeExtents * sizeof(extent_t));
+  if(treeBlocks.empty()) {
+    return;
+  }
+  inode.direct[EXTENT_TREE_PTR] = treeBlocks[0];
+  // A single block is a leaf, more are a root and the leaves under it.
+  int perBlock = extentsPerTreeBlock();
+  vector<vector<unsigned int> > contents(treeBlocks.size(), vector<unsigned int>(blockSize / sizeof(unsigned int), 0));
+  size_t firstLeaf = treeBlocks.size() == 1 ? 0 : 1;
+  for(size_t i = firstLeaf; i < treeBlocks.size(); i++) {
+    size_t first = inodeExtents + (i - firstLeaf) * perBlock;
+    size_t last = min(extents.size(), first + perBlock);
+    extent_header_t *header = (extent_header_t *) contents[i].data();
+    header->magic = UFS_EXTENT_TREE_MAGIC;
+    header->depth = 0;
+    header->num_entries = last - first;
+    memcpy(header + 1, &extents[first], (last - first) * sizeof(extent_t));
+  }
+  if(firstLeaf == 1) {
+    extent_header_t *header = (extent_header_t *) contents[0].data();
+    header->magic = UFS_EXTENT_TREE_MAGIC;
+    header->depth = 1;
+    header->num_entries = treeBlocks.size() - 1;
+    extent_t *entries = (extent_t *) (header + 1);
+    for(size_t i = 1; i < treeBlocks.size(); i++) {
+      entries[i - 1].start = treeBlocks[i];
+      entries[i - 1].length = ((extent_header_t *) contents[i].data())->num_entries;
+    }
+  }
+  writePointerBlocks(treeBlocks, contents);
+}
+
+void LocalFileSystem::writePointerBlocks(const vector<int> &blockNumbers, vector<vector<unsigned int> > &contents) {
+  vector<struct iovec> buffers(blockNumbers.size());
+  for(size_t i = 0; i < blockNumbers.size(); i++) {
+    buffers[i].iov_base = contents[i].data();
+    buffers[i].iov_len = blockSize;
+  }
+  disk->writeBlocks(blockNumbers.data(), blockNumbers.size(), buffers.data());
+  for(size_t i = 0; i < blockNumbers.size(); i++) {
+    cachePointerBlock(blockNumbers[i], contents[i]);
+  }
+  // The blocks go back to what they were on disk, so forget them here.
+  disk->onRollback([this]() {
+    pointerBlockCache.clear();
+  });
+}
 
+const unsigned int *LocalFileSystem::readPointerBlock(int blockNumber) {
+  map<int, vector<unsigned int> >::iterator cached = pointerBlockCache.find(blockNumber);
+  if(cached != pointerBlockCache.end()) {
+    return cached->second.data();
+  }
+  vector<unsigned int> pointers(blockSize / sizeof(unsigned int));
+  disk->readBlock(blockNumber, pointers.data());
+  return cachePointerBlock(blockNumber, pointers);
+}
+
+const unsigned int *LocalFileSystem::cachePointerBlock(int blockNumber, vector<unsigned int> &pointers) {
+  if(pointerBlockCache.size() >= (size_t) (POINTER_CACHE_BYTES / blockSize) &&
+     pointerBlockCache.find(blockNumber) == pointerBlockCache.end()) {
+    pointerBlockCache.erase(pointerBlockCache.begin());
+  }
+  vector<unsigned int> &cached = pointerBlockCache[blockNumber];
+  cached.swap(pointers);
+  return cached.data();
 }
 
 void LocalFileSystem::readInodeRegion(super_t *super, inode_t *inodes) {
@@ -54,22 +522,94 @@ void LocalFileSystem::writeInodeRegion(super_t *super, inode_t *inodes) {
 }
 
 int LocalFileSystem::lookup(int parentInodeNumber, string name) {
+  lock();
+  int result = withGeometry(blockSize, [&](auto geometry) {
+    return lookup(geometry, parentInodeNumber, name);
+  });
+  unlock();
+  return result;
+}
+
+int LocalFileSystem::stat(int inodeNumber, inode_t *inode) {
+  lock();
+  int result = withGeometry(blockSize, [&](auto geometry) {
+    return stat(geometry, inodeNumber, inode);
+  });
+  unlock();
+  return result;
+}
+
+int LocalFileSystem::read(int inodeNumber, void *buffer, int size) {
+  lock();
+  int result = withGeometry(blockSize, [&](auto geometry) {
+    return read(geometry, inodeNumber, buffer, size);
+  });
+  unlock();
+  return result;
+}
+
+int LocalFileSystem::listBlocks(int inodeNumber, vector<int> &blockNumbers) {
+  lock();
+  inode_t inode;
+  if(stat(inodeNumber, &inode) != 0) {
+    unlock();
+    return -EINVALIDINODE;
+  }
+  blockNumbers.clear();
+  int result = mapBlocks(inode, (inode.size + blockSize - 1) / blockSize, blockNumbers, nullptr);
+  unlock();
+  return result;
+}
+
+int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
+  lock();
+  int result = withGeometry(blockSize, [&](auto geometry) {
+    return create(geometry, parentInodeNumber, type, name);
+  });
+  unlock();
+  return result;
+}
+
+int LocalFileSystem::write(int inodeNumber, const void *buffer, int size) {
+  lock();
+  int result = withGeometry(blockSize, [&](auto geometry) {
+    return write(geometry, inodeNumber, buffer, size);
+  });
+  unlock();
+  return result;
+}
+
+int LocalFileSystem::unlink(int parentInodeNumber, string name) {
+  lock();
+  int result = withGeometry(blockSize, [&](auto geometry) {
+    return unlink(geometry, parentInodeNumber, name);
+  });
+  unlock();
+  return result;
+}
+
+template <int BlockSize>
+int LocalFileSystem::lookup(BlockGeometry<BlockSize> geometry, int parentInodeNumber, string name) {
   inode_t parentInode;
-  if(stat(parentInodeNumber, &parentInode) != 0) {
+  if(stat(geometry, parentInodeNumber, &parentInode) != 0) {
     return -EINVALIDINODE;
   }
   if(parentInode.type != UFS_DIRECTORY) {
     return -EINVALIDTYPE;
   }
-  char block[UFS_BLOCK_SIZE];
-  int numBlocks = (parentInode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  AlignedBuffer block(geometry.blockSize);
+  int numBlocks = (parentInode.size + geometry.blockSize - 1) / geometry.blockSize;
+  vector<int> parentBlocks;
+  if(mapBlocks(parentInode, numBlocks, parentBlocks, nullptr) != 0) {
+    return -EINVALIDINODE;
+  }
   for(int i = 0; i < numBlocks; i++) {
-    if(parentInode.direct[i] == 0) {
+    if(parentBlocks[i] == 0) {
       continue;
     }
-    disk->readBlock(parentInode.direct[i], block);
-    dir_ent_t* entries = (dir_ent_t*)block;
-    for(size_t j = 0; j < UFS_BLOCK_SIZE / sizeof(dir_ent_t); j++) {
+    disk->readBlock(parentBlocks[i], block.data());
+    dir_ent_t* entries = (dir_ent_t*)block.data();
+    for(size_t j = 0; j < geometry.entriesPerBlock; j++) {
       if(entries[j].inum != -1 && name == entries[j].name) {
         return entries[j].inum;
       }
@@ -78,49 +618,72 @@ int LocalFileSystem::lookup(int parentInodeNumber, string name) {
   return -ENOTFOUND;
 }
 
-int LocalFileSystem::stat(int inodeNumber, inode_t *inode) {
+template <int BlockSize>
+int LocalFileSystem::stat(BlockGeometry<BlockSize> geometry, int inodeNumber, inode_t *inode) {
   if(inode == nullptr || inodeNumber < 0) {
     return -1;
   }
-  super_t superBlock;
-  readSuperBlock(&superBlock);
+  const super_t &superBlock = mountedSuper;
   if(inodeNumber >= superBlock.num_inodes) {
     return -1;
   }
-  int inodesPerBlock = UFS_BLOCK_SIZE / sizeof(inode_t);
+  int inodesPerBlock = geometry.inodesPerBlock;
   int blockNumber = superBlock.inode_region_addr + (inodeNumber / inodesPerBlock);
   int inodeOffset = (inodeNumber % inodesPerBlock) * sizeof(inode_t);
-  char block[UFS_BLOCK_SIZE];
-  disk->readBlock(blockNumber, block);
-  memcpy(inode, block + inodeOffset, sizeof(inode_t));
+  AlignedBuffer block(geometry.blockSize);
+  disk->readBlock(blockNumber, block.data());
+  memcpy(inode, block.data() + inodeOffset, sizeof(inode_t));
   return 0;
 }
 
-int LocalFileSystem::read(int inodeNumber, void *buffer, int size) {
+template <int BlockSize>
+int LocalFileSystem::read(BlockGeometry<BlockSize> geometry, int inodeNumber, void *buffer, int size) {
   inode_t inode;
-  if(size < 0 || size > MAX_FILE_SIZE) {
+  if(size < 0 || size > maxFileSize) {
     return -EINVALIDSIZE;
   }
-  if(stat(inodeNumber, &inode) != 0) {
+  if(stat(geometry, inodeNumber, &inode) != 0) {
     return -EINVALIDINODE;
   } 
   size = min(size, inode.size);
   int bytesRead = 0;
-  int numBlocks = (size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
-  char block[UFS_BLOCK_SIZE];
+  int numBlocks = (size + geometry.blockSize - 1) / geometry.blockSize;
+  // Whole blocks go straight into the caller's buffer, a trailing partial
+  // block is read into tailBlock and copied.
+  vector<int> fileBlocks;
+  if(mapBlocks(inode, numBlocks, fileBlocks, nullptr) != 0) {
+    return -EINVALIDINODE;
+  }
+  vector<int> blockNumbers;
+  vector<struct iovec> buffers;
+  AlignedBuffer tailBlock(geometry.blockSize);
+  int tailBytes = 0;
   for(int i = 0; i < numBlocks && bytesRead < size; i++) {
-    if(inode.direct[i] == 0) {
+    if(fileBlocks[i] == 0) {
       continue;
     }
-    int numBytesToRead = min(UFS_BLOCK_SIZE, size - bytesRead);
-    disk->readBlock(inode.direct[i], block);
-    memcpy((char*)buffer + bytesRead, block, numBytesToRead);
+    int numBytesToRead = min(geometry.blockSize, size - bytesRead);
+    struct iovec blockBuffer;
+    blockBuffer.iov_len = geometry.blockSize;
+    if(numBytesToRead == geometry.blockSize) {
+      blockBuffer.iov_base = (char*)buffer + bytesRead;
+    } else {
+      blockBuffer.iov_base = tailBlock.data();
+      tailBytes = numBytesToRead;
+    }
+    blockNumbers.push_back(fileBlocks[i]);
+    buffers.push_back(blockBuffer);
     bytesRead += numBytesToRead;
   }
+  disk->readBlocks(blockNumbers.data(), blockNumbers.size(), buffers.data());
+  if(tailBytes > 0) {
+    memcpy((char*)buffer + bytesRead - tailBytes, tailBlock.data(), tailBytes);
+  }
   return bytesRead;
 }
 
-int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
+template <int BlockSize>
+int LocalFileSystem::create(BlockGeometry<BlockSize> geometry, int parentInodeNumber, int type, string name) {
   if(parentInodeNumber < 0) {
     return -EINVALIDINODE;
   }
@@ -130,28 +693,20 @@ int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
   if(name.length() > DIR_ENT_NAME_SIZE) {
     return -EINVALIDNAME;
   }
-  int existingInodeNumber = lookup(parentInodeNumber, name);
+  int existingInodeNumber = lookup(geometry, parentInodeNumber, name);
   inode_t existingInode;
   if(existingInodeNumber != -ENOTFOUND) {
-    if(stat(existingInodeNumber, &existingInode) == 0 && existingInode.type == type) {
+    if(stat(geometry, existingInodeNumber, &existingInode) == 0 && existingInode.type == type) {
       return existingInodeNumber;
     }
     return -EINVALIDTYPE;
   }
+  // The bits are only set once nothing can fail, so that the mounted
+  // bitmaps never hold an allocation that didn't happen.
   int newInodeNumber = -1;
-  super_t super;
-  readSuperBlock(&super);
-  vector<u_int8_t> inodeBitmap(super.inode_bitmap_len * UFS_BLOCK_SIZE);
-  readInodeBitmap(&super, inodeBitmap.data());
-  vector<u_int8_t> dataBitmap(super.data_bitmap_len * UFS_BLOCK_SIZE);
-  readDataBitmap(&super, dataBitmap.data());
-  for(int i = 0; i < super.num_inodes; i++) {
-    if(!(inodeBitmap.at(i / 8) & (1 << (i % 8)))) {
-      inodeBitmap.at(i / 8) = inodeBitmap.at(i / 8) | (1 << (i % 8));
-      newInodeNumber = i;
-      break;
-    }
-  }
+  int newDirBlock = -1;
+  super_t &super = mountedSuper;
+  newInodeNumber = inodeAllocator.findFree(0);
   if(newInodeNumber == -1) {
     return -ENOTENOUGHSPACE;
   }
@@ -163,34 +718,52 @@ int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
     newInode.size = 2 * sizeof(dir_ent_t);
   }
   if(type == UFS_DIRECTORY) {
-    int newDirBlock = -1;
-    for(int i = 0; i < super.num_data; i++) {
-      if(!(dataBitmap.at(i / 8) & (1 << (i % 8)))) {
-        dataBitmap.at(i / 8) = dataBitmap.at(i / 8) | (1 << (i % 8));
-        newDirBlock = super.data_region_addr + i;
-        break;
-      }
-    }
-    if(newDirBlock == -1) {
+    int dataBlockIndex = dataAllocator.findFree(0);
+    if(dataBlockIndex == -1) {
       return -ENOTENOUGHSPACE;
     }
-    dir_ent_t entries[2] = { {".", newInodeNumber}, {"..", parentInodeNumber} };
+    newDirBlock = super.data_region_addr + dataBlockIndex;
+    // a whole block, with unused entries marked like mkfs does
+    AlignedBuffer dirBlock(geometry.blockSize);
+    dir_ent_t *entries = (dir_ent_t*)dirBlock.data();
+    strcpy(entries[0].name, ".");
+    entries[0].inum = newInodeNumber;
+    strcpy(entries[1].name, "..");
+    entries[1].inum = parentInodeNumber;
+    for(size_t i = 2; i < geometry.entriesPerBlock; i++) {
+      entries[i].inum = -1;
+    }
     disk->writeBlock(newDirBlock, entries);
-    newInode.direct[0] = newDirBlock;
+    writePointers(newInode, vector<int>(1, newDirBlock), vector<int>());
   }
-  int inodeBlockNumber = super.inode_region_addr + (newInodeNumber / (UFS_BLOCK_SIZE / sizeof(inode_t)));
-  char inodeBlock[UFS_BLOCK_SIZE];
-  disk->readBlock(inodeBlockNumber, inodeBlock);
-  memcpy(inodeBlock + (newInodeNumber % (UFS_BLOCK_SIZE / sizeof(inode_t))) * sizeof(inode_t), &newInode, sizeof(inode_t));
-  disk->writeBlock(inodeBlockNumber, inodeBlock);
+  int inodeBlockNumber = super.inode_region_addr + (newInodeNumber / geometry.inodesPerBlock);
+  AlignedBuffer inodeBlock(geometry.blockSize);
+  disk->readBlock(inodeBlockNumber, inodeBlock.data());
+  memcpy(inodeBlock.data() + (newInodeNumber % geometry.inodesPerBlock) * sizeof(inode_t), &newInode, sizeof(inode_t));
+  disk->writeBlock(inodeBlockNumber, inodeBlock.data());
   inode_t parentInode;
-  if(stat(parentInodeNumber, &parentInode) != 0 || parentInode.type != UFS_DIRECTORY) {
+  if(stat(geometry, parentInodeNumber, &parentInode) != 0 || parentInode.type != UFS_DIRECTORY) {
     return -EINVALIDINODE;
   }
-  vector<dir_ent_t> parentEntries(parentInode.size / sizeof(dir_ent_t) + 1);
-  read(parentInodeNumber, parentEntries.data(), parentInode.size);
+  // Work on whole directory blocks, plus room for one more, so that the
+  // blocks can be written back as they are.
+  int entriesPerBlock = geometry.entriesPerBlock;
+  int parentBlocks = (parentInode.size + geometry.blockSize - 1) / geometry.blockSize;
+  AlignedBuffer parentEntriesBuffer((parentBlocks + 1) * geometry.blockSize);
+  dir_ent_t *parentEntries = (dir_ent_t*)parentEntriesBuffer.data();
+  vector<int> parentBlockNumbers;
+  if(mapBlocks(parentInode, parentBlocks, parentBlockNumbers, nullptr) != 0) {
+    return -EINVALIDINODE;
+  }
+  vector<struct iovec> parentBuffers(parentBlocks);
+  for(int i = 0; i < parentBlocks; i++) {
+    parentBuffers[i].iov_base = &parentEntries[i * entriesPerBlock];
+    parentBuffers[i].iov_len = geometry.blockSize;
+  }
+  disk->readBlocks(parentBlockNumbers.data(), parentBlocks, parentBuffers.data());
   bool entryAdded = false;
-  for(auto& entry : parentEntries) {
+  for(size_t i = 0; i < parentInode.size / sizeof(dir_ent_t); i++) {
+    dir_ent_t& entry = parentEntries[i];
     if(entry.inum == -1) {
       entryAdded = true;
       strncpy(entry.name, name.c_str(), sizeof(entry.name));
@@ -199,91 +772,205 @@ int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
       break;
     }
   }
+  int newParentBlock = -1;
+  if(!entryAdded && parentInode.size % geometry.blockSize == 0) {
+    // The entry starts a new block, which has to be mapped without
+    // indirect or extent tree blocks.
+    int dataBlockIndex = dataAllocator.findFree(newDirBlock == -1 ? 0 : newDirBlock - super.data_region_addr + 1);
+    if(dataBlockIndex == -1) {
+      return -ENOTENOUGHSPACE;
+    }
+    newParentBlock = super.data_region_addr + dataBlockIndex;
+    parentBlockNumbers.push_back(newParentBlock);
+    if(pointerBlocksFor(parentBlockNumbers) != 0) {
+      return -ENOTENOUGHSPACE;
+    }
+    writePointers(parentInode, parentBlockNumbers, vector<int>());
+    for(int i = 0; i < entriesPerBlock; i++) {
+      parentEntries[parentBlocks * entriesPerBlock + i].inum = -1;
+    }
+  }
   if(!entryAdded) {
-    parentEntries.at(parentInode.size / sizeof(dir_ent_t)).inum = newInodeNumber;
-    strncpy(parentEntries.at(parentInode.size / sizeof(dir_ent_t)).name, name.c_str(), sizeof(dir_ent_t::name));
+    parentEntries[parentInode.size / sizeof(dir_ent_t)].inum = newInodeNumber;
+    strncpy(parentEntries[parentInode.size / sizeof(dir_ent_t)].name, name.c_str(), sizeof(dir_ent_t::name));
     parentInode.size += sizeof(dir_ent_t);
   }
-  int numBlocks = (parentInode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
-  int offset = 0;
+  int numBlocks = (parentInode.size + geometry.blockSize - 1) / geometry.blockSize;
+  parentBuffers.resize(numBlocks);
   for(int i = 0; i < numBlocks; i++) {
-    disk->writeBlock(parentInode.direct[i], &parentEntries.at(offset));
-    offset += UFS_BLOCK_SIZE / sizeof(dir_ent_t);
-  }
-  int parentInodeBlockNumber = super.inode_region_addr + (parentInodeNumber / (UFS_BLOCK_SIZE / sizeof(inode_t)));
-  char parentBlock[UFS_BLOCK_SIZE];
-  disk->readBlock(parentInodeBlockNumber, parentBlock);
-  memcpy(parentBlock +(parentInodeNumber % (UFS_BLOCK_SIZE / sizeof(inode_t))) * sizeof(inode_t), &parentInode, sizeof(inode_t));
-  disk->writeBlock(parentInodeBlockNumber, parentBlock);
-  for(int i = 0; i < super.inode_bitmap_len; i++) {
-    disk->writeBlock(super.inode_bitmap_addr + i, &inodeBitmap.at(i * UFS_BLOCK_SIZE));
+    parentBuffers[i].iov_base = &parentEntries[i * entriesPerBlock];
+    parentBuffers[i].iov_len = geometry.blockSize;
   }
-  for(int i = 0; i < super.data_bitmap_len; i++) {
-    disk->writeBlock(super.data_bitmap_addr + i, &dataBitmap.at(i * UFS_BLOCK_SIZE));
+  disk->writeBlocks(parentBlockNumbers.data(), numBlocks, parentBuffers.data());
+  int parentInodeBlockNumber = super.inode_region_addr + (parentInodeNumber / geometry.inodesPerBlock);
+  AlignedBuffer parentBlock(geometry.blockSize);
+  disk->readBlock(parentInodeBlockNumber, parentBlock.data());
+  memcpy(parentBlock.data() +(parentInodeNumber % geometry.inodesPerBlock) * sizeof(inode_t), &parentInode, sizeof(inode_t));
+  disk->writeBlock(parentInodeBlockNumber, parentBlock.data());
+  inodeAllocator.set(newInodeNumber);
+  writeInodeBitmap(&super, mountedInodeBitmap.data());
+  if(newDirBlock != -1 || newParentBlock != -1) {
+    if(newDirBlock != -1) {
+      dataAllocator.set(newDirBlock - super.data_region_addr);
+    }
+    if(newParentBlock != -1) {
+      dataAllocator.set(newParentBlock - super.data_region_addr);
+    }
+    writeDataBitmap(&super, mountedDataBitmap.data());
   }
   return newInodeNumber;
 }
 
-int LocalFileSystem::write(int inodeNumber, const void *buffer, int size) {
+template <int BlockSize>
+int LocalFileSystem::write(BlockGeometry<BlockSize> geometry, int inodeNumber, const void *buffer, int size) {
   inode_t inode;
-  if (stat(inodeNumber, &inode)) {
+  if (stat(geometry, inodeNumber, &inode)) {
     return -EINVALIDINODE;
   }
-  if (size > MAX_FILE_SIZE) {
+  if (size < 0 || size > maxFileSize) {
     return -EINVALIDSIZE;
   }
   if (inode.type != UFS_REGULAR_FILE) {
     return -EINVALIDTYPE;
   }
-  super_t super;
-  readSuperBlock(&super);
-  unsigned char dataBitmap[UFS_BLOCK_SIZE];
-  readDataBitmap(&super, dataBitmap);
-  int requiredBlocks = (size + (UFS_BLOCK_SIZE - 1)) / UFS_BLOCK_SIZE;
-  requiredBlocks = min(requiredBlocks, (int)(sizeof(inode.direct) / sizeof(inode.direct[0])));
-  vector<int> allocatedBlocks;
-  for (int i = 0; i < super.num_data && allocatedBlocks.size() < (size_t)requiredBlocks; i++) {
-    if (!(dataBitmap[i >> 3] & (1 << (i & 7)))) {
-      allocatedBlocks.push_back(super.data_region_addr + i);
+  super_t &super = mountedSuper;
+  int requiredBlocks = (size + (geometry.blockSize - 1)) / geometry.blockSize;
+  // The file keeps the blocks it already has, in order, gets new ones for
+  // the rest and frees the ones it no longer needs. The same goes for the
+  // indirect or extent tree blocks that map them.
+  int currentBlocks = (inode.size + (geometry.blockSize - 1)) / geometry.blockSize;
+  vector<int> currentBlockNumbers;
+  vector<int> currentPointerBlocks;
+  if(mapBlocks(inode, currentBlocks, currentBlockNumbers, &currentPointerBlocks) != 0) {
+    return -EINVALIDINODE;
+  }
+  int keptBlocks = min(currentBlocks, requiredBlocks);
+  vector<int> allocatedBlocks(currentBlockNumbers.begin(), currentBlockNumbers.begin() + keptBlocks);
+  vector<int> freedBlocks(currentBlockNumbers.begin() + keptBlocks, currentBlockNumbers.end());
+  for (size_t i = 0; i < freedBlocks.size(); i++) {
+    dataAllocator.clear(freedBlocks[i] - super.data_region_addr);
+  }
+  // The new blocks come from as few free extents as possible, ideally
+  // one run, so that the file can be read with large transfers. How many
+  // blocks it takes to map them can depend on where they are, so those
+  // come after.
+  vector<int> newBits;
+  bool hasRoom = dataAllocator.findExtents(requiredBlocks - keptBlocks, newBits);
+  for (size_t i = 0; i < newBits.size(); i++) {
+    allocatedBlocks.push_back(super.data_region_addr + newBits[i]);
+    dataAllocator.set(newBits[i]);
+  }
+  int neededPointerBlocks = hasRoom ? pointerBlocksFor(allocatedBlocks) : -1;
+  hasRoom = neededPointerBlocks >= 0;
+  int keptPointerBlocks = hasRoom ? min((int) currentPointerBlocks.size(), neededPointerBlocks) : 0;
+  vector<int> pointerBlocks(currentPointerBlocks.begin(), currentPointerBlocks.begin() + keptPointerBlocks);
+  for (size_t i = keptPointerBlocks; i < currentPointerBlocks.size(); i++) {
+    freedBlocks.push_back(currentPointerBlocks[i]);
+    pointerBlockCache.erase(currentPointerBlocks[i]);
+    dataAllocator.clear(currentPointerBlocks[i] - super.data_region_addr);
+  }
+  vector<int> newPointerBits;
+  if (hasRoom && !dataAllocator.findExtents(neededPointerBlocks - keptPointerBlocks, newPointerBits)) {
+    hasRoom = false;
+    for (int i = 0; i < keptPointerBlocks; i++) {
+      freedBlocks.push_back(pointerBlocks[i]);
+      pointerBlockCache.erase(pointerBlocks[i]);
+      dataAllocator.clear(pointerBlocks[i] - super.data_region_addr);
+    }
+    pointerBlocks.clear();
+  }
+  if (!hasRoom) {
+    // Not enough room: the file gets as many blocks as what is left
+    // holds along with the blocks that map them, in order.
+    for (size_t i = 0; i < newBits.size(); i++) {
+      dataAllocator.clear(newBits[i]);
+    }
+    allocatedBlocks.resize(keptBlocks);
+    vector<int> freeBits;
+    for (int i = dataAllocator.findFree(0); i != -1; i = dataAllocator.findFree(i + 1)) {
+      freeBits.push_back(i);
+    }
+    // Mapping more blocks never takes fewer, so search for the most.
+    int fewest = 0;
+    int most = min(requiredBlocks - keptBlocks, (int) freeBits.size());
+    while (fewest < most) {
+      int count = (fewest + most + 1) / 2;
+      vector<int> blocks(allocatedBlocks);
+      for (int i = 0; i < count; i++) {
+        blocks.push_back(super.data_region_addr + freeBits[i]);
+      }
+      int mappingBlocks = pointerBlocksFor(blocks);
+      if (mappingBlocks >= 0 && count + mappingBlocks <= (int) freeBits.size()) {
+        fewest = count;
+      } else {
+        most = count - 1;
+      }
+    }
+    newBits.assign(freeBits.begin(), freeBits.begin() + fewest);
+    for (size_t i = 0; i < newBits.size(); i++) {
+      allocatedBlocks.push_back(super.data_region_addr + newBits[i]);
+      dataAllocator.set(newBits[i]);
     }
+    requiredBlocks = allocatedBlocks.size();
+    newPointerBits.assign(freeBits.begin() + fewest, freeBits.begin() + fewest + pointerBlocksFor(allocatedBlocks));
   }
-  char tempBlock[UFS_BLOCK_SIZE];
+  for (size_t i = 0; i < newPointerBits.size(); i++) {
+    pointerBlocks.push_back(super.data_region_addr + newPointerBits[i]);
+    dataAllocator.set(newPointerBits[i]);
+  }
+  // Blocks freed here may have been given out again.
+  vector<int> discardedBlocks;
+  for (size_t i = 0; i < freedBlocks.size(); i++) {
+    if (!dataAllocator.isSet(freedBlocks[i] - super.data_region_addr)) {
+      discardedBlocks.push_back(freedBlocks[i]);
+    }
+  }
+  // Whole blocks are written straight from the caller's buffer, a
+  // trailing partial block is padded with zeros in tailBlock.
+  AlignedBuffer tailBlock(geometry.blockSize);
+  vector<struct iovec> buffers(allocatedBlocks.size());
   int totalWritten = 0;
   int chunkSize;
   for (size_t i = 0; i < allocatedBlocks.size(); i++) {
-    chunkSize = min((int)UFS_BLOCK_SIZE, size - totalWritten);
-    memcpy(tempBlock, (char*)(buffer) + totalWritten, chunkSize);
-    disk->writeBlock(allocatedBlocks.at(i), tempBlock);
-    inode.direct[i] = allocatedBlocks.at(i);
-    dataBitmap[(allocatedBlocks.at(i) - super.data_region_addr) >> 3] |= 1 << ((allocatedBlocks.at(i) - super.data_region_addr) & 7);
+    chunkSize = min(geometry.blockSize, size - totalWritten);
+    if (chunkSize == geometry.blockSize) {
+      buffers[i].iov_base = (char*)(buffer) + totalWritten;
+    } else {
+      memcpy(tailBlock.data(), (char*)(buffer) + totalWritten, chunkSize);
+      buffers[i].iov_base = tailBlock.data();
+    }
+    buffers[i].iov_len = geometry.blockSize;
     totalWritten += chunkSize;
   }
+  disk->writeBlocks(allocatedBlocks.data(), allocatedBlocks.size(), buffers.data());
+  writePointers(inode, allocatedBlocks, pointerBlocks);
   inode.size = totalWritten;
-  int blockIdx = super.inode_region_addr + (inodeNumber / (UFS_BLOCK_SIZE / sizeof(inode_t)));
-  int offset = (inodeNumber & ((UFS_BLOCK_SIZE / sizeof(inode_t)) - 1)) * sizeof(inode_t);
-  disk->readBlock(blockIdx, tempBlock);
-  memcpy(tempBlock + offset, &inode, sizeof(inode_t));
-  disk->writeBlock(blockIdx, tempBlock);
-  for (int i = 0; i < super.data_bitmap_len; i++) {
-    disk->writeBlock(super.data_bitmap_addr + i, &dataBitmap[i * UFS_BLOCK_SIZE]);
-  }
+  int blockIdx = super.inode_region_addr + (inodeNumber / geometry.inodesPerBlock);
+  int offset = (inodeNumber & (geometry.inodesPerBlock - 1)) * sizeof(inode_t);
+  AlignedBuffer inodeBlock(geometry.blockSize);
+  disk->readBlock(blockIdx, inodeBlock.data());
+  memcpy(inodeBlock.data() + offset, &inode, sizeof(inode_t));
+  disk->writeBlock(blockIdx, inodeBlock.data());
+  writeDataBitmap(&super, mountedDataBitmap.data());
+  disk->discardBlocks(discardedBlocks.data(), discardedBlocks.size());
   return totalWritten;
 }
 
-int LocalFileSystem::unlink(int parentInodeNumber, string name) {
+template <int BlockSize>
+int LocalFileSystem::unlink(BlockGeometry<BlockSize> geometry, int parentInodeNumber, string name) {
   inode_t parentInode;
-  if(stat(parentInodeNumber, &parentInode) != 0) {
+  if(stat(geometry, parentInodeNumber, &parentInode) != 0) {
     return -EINVALIDINODE;
   }
   if(parentInode.type != UFS_DIRECTORY) {
     return -EINVALIDTYPE;
   }
-  int childInodeNumber = lookup(parentInodeNumber, name);
+  int childInodeNumber = lookup(geometry, parentInodeNumber, name);
   if(childInodeNumber < 0) {
     return childInodeNumber;
   }
   inode_t childInode;
-  if(stat(childInodeNumber, &childInode) != 0) {
+  if(stat(geometry, childInodeNumber, &childInode) != 0) {
     return -EINVALIDINODE;
   }
   if(childInode.type == UFS_DIRECTORY) {
@@ -292,39 +979,70 @@ int LocalFileSystem::unlink(int parentInodeNumber, string name) {
       return -ENOTEMPTY;
     }
     dir_ent_t entries[2];
-    if(read(childInodeNumber, entries, sizeof(entries)) != sizeof(entries)) {
+    if(read(geometry, childInodeNumber, entries, sizeof(entries)) != sizeof(entries)) {
       return -EINVALIDINODE;
     }
     if(strcmp(entries[0].name, ".") != 0 || entries[0].inum != childInodeNumber || strcmp(entries[1].name, "..") != 0 || entries[1].inum != parentInodeNumber) {
       return -ENOTEMPTY;
     }
   }
+  // the child's blocks are mapped before anything changes
+  int numDataBlocks = (childInode.size + geometry.blockSize - 1) / geometry.blockSize;
+  vector<int> childBlocks;
+  vector<int> pointerBlocks;
+  if(mapBlocks(childInode, numDataBlocks, childBlocks, &pointerBlocks) != 0) {
+    return -EINVALIDINODE;
+  }
   bool found = false;
-  char block[UFS_BLOCK_SIZE];
-  int numBlocks = (parentInode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  int emptiedBlock = 0;
+  AlignedBuffer block(geometry.blockSize);
+  int numBlocks = (parentInode.size + geometry.blockSize - 1) / geometry.blockSize;
+  vector<int> parentBlocks;
+  if(mapBlocks(parentInode, numBlocks, parentBlocks, nullptr) != 0) {
+    return -EINVALIDINODE;
+  }
   for(int i = 0; i < numBlocks; i++) {
-    if(parentInode.direct[i] == 0) {
+    if(parentBlocks[i] == 0) {
       continue;
     }
-    disk->readBlock(parentInode.direct[i], block);
-    dir_ent_t *entries = (dir_ent_t*)block;
-    int entriesPerBlock = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
+    disk->readBlock(parentBlocks[i], block.data());
+    dir_ent_t *entries = (dir_ent_t*)block.data();
+    int entriesPerBlock = geometry.entriesPerBlock;
     for(int j = 0; j < entriesPerBlock; j++) {
       if(entries[j].inum == childInodeNumber && strcmp(entries[j].name, name.c_str()) == 0) {
         for(int k = j; k < entriesPerBlock - 1; k++) {
           entries[k] = entries[k + 1];
         }
         memset(&entries[entriesPerBlock - 1], 0, sizeof(dir_ent_t));
+        // The entries in later blocks move down one too, so that they all
+        // stay within the directory's size.
+        int current = i;
+        for(int next = i + 1; next < numBlocks; next++) {
+          AlignedBuffer nextBlock(geometry.blockSize);
+          disk->readBlock(parentBlocks[next], nextBlock.data());
+          entries[entriesPerBlock - 1] = ((dir_ent_t*)nextBlock.data())[0];
+          disk->writeBlock(parentBlocks[current], block.data());
+          memcpy(block.data(), nextBlock.data(), geometry.blockSize);
+          for(int k = 0; k < entriesPerBlock - 1; k++) {
+            entries[k] = entries[k + 1];
+          }
+          memset(&entries[entriesPerBlock - 1], 0, sizeof(dir_ent_t));
+          current = next;
+        }
         parentInode.size -= sizeof(dir_ent_t);
-        disk->writeBlock(parentInode.direct[i], block);
-        super_t super;
-        readSuperBlock(&super);
-        int parentBlockNumber = super.inode_region_addr + (parentInodeNumber /(UFS_BLOCK_SIZE / sizeof(inode_t)));
-        char parentInodeBlock[UFS_BLOCK_SIZE];
-        disk->readBlock(parentBlockNumber, parentInodeBlock);
-        inode_t *parent = (inode_t*)(parentInodeBlock + (parentInodeNumber % (UFS_BLOCK_SIZE / sizeof(inode_t))) * sizeof(inode_t));
+        disk->writeBlock(parentBlocks[current], block.data());
+        if((int) (parentInode.size + geometry.blockSize - 1) / geometry.blockSize < numBlocks) {
+          // the last block is empty now
+          emptiedBlock = parentBlocks.back();
+          parentBlocks.pop_back();
+          writePointers(parentInode, parentBlocks, vector<int>());
+        }
+        int parentBlockNumber = mountedSuper.inode_region_addr + (parentInodeNumber /geometry.inodesPerBlock);
+        AlignedBuffer parentInodeBlock(geometry.blockSize);
+        disk->readBlock(parentBlockNumber, parentInodeBlock.data());
+        inode_t *parent = (inode_t*)(parentInodeBlock.data() + (parentInodeNumber % geometry.inodesPerBlock) * sizeof(inode_t));
         *parent = parentInode;
-        disk->writeBlock(parentBlockNumber, parentInodeBlock);
+        disk->writeBlock(parentBlockNumber, parentInodeBlock.data());
         found = true;
         break;
       }
@@ -336,24 +1054,22 @@ int LocalFileSystem::unlink(int parentInodeNumber, string name) {
   if(!found) {
     return -ENOTFOUND;
   }
-  super_t super;
-  readSuperBlock(&super);
-  unsigned char inodeBitmap[super.inode_bitmap_len * UFS_BLOCK_SIZE];
-  readInodeBitmap(&super, inodeBitmap);
-  inodeBitmap[childInodeNumber / 8] &= ~(1 << (childInodeNumber % 8));
-  unsigned char dataBitmap[super.data_bitmap_len * UFS_BLOCK_SIZE];
-  readDataBitmap(&super, dataBitmap);
-  int numDataBlocks = (childInode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
-  for(int i = 0; i < numDataBlocks; i++) {
-    if(childInode.direct[i] == 0) continue;
-    int dataBlockIndex = childInode.direct[i] - super.data_region_addr;
-    dataBitmap[dataBlockIndex / 8] &= ~(1 << (dataBlockIndex % 8));
-  }
-  for(int i = 0; i < super.inode_bitmap_len; i++) {
-    disk->writeBlock(super.inode_bitmap_addr + i, &inodeBitmap[i * UFS_BLOCK_SIZE]);
-  }
-  for(int i = 0; i < super.data_bitmap_len; i++) {
-    disk->writeBlock(super.data_bitmap_addr + i, &dataBitmap[i * UFS_BLOCK_SIZE]);
+  super_t &super = mountedSuper;
+  inodeAllocator.clear(childInodeNumber);
+  for(size_t i = 0; i < pointerBlocks.size(); i++) {
+    pointerBlockCache.erase(pointerBlocks[i]);
+  }
+  childBlocks.insert(childBlocks.end(), pointerBlocks.begin(), pointerBlocks.end());
+  childBlocks.push_back(emptiedBlock);
+  vector<int> freedBlocks;
+  for(size_t i = 0; i < childBlocks.size(); i++) {
+    if(childBlocks[i] == 0) continue;
+    int dataBlockIndex = childBlocks[i] - super.data_region_addr;
+    dataAllocator.clear(dataBlockIndex);
+    freedBlocks.push_back(childBlocks[i]);
   }
+  writeInodeBitmap(&super, mountedInodeBitmap.data());
+  writeDataBitmap(&super, mountedDataBitmap.data());
+  disk->discardBlocks(freedBlocks.data(), freedBlocks.size());
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,329 @@
+#include <algorithm>
+#include <iostream>
+#include <future>
+#include <unistd.h>
+#include <stdio.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+
+#include <sys/stat.h>
+
+#include "MirroredDisk.h"
+
+using namespace std;
+
+// Blocks the resync copies at a time, while writes wait.
+static const int RESYNC_BLOCKS = 256;
+
+static string joinSpecs(const vector<string> &replicaSpecs) {
+  string joined;
+  for (size_t idx = 0; idx < replicaSpecs.size(); idx++) {
+    joined += (idx == 0 ? "" : ",") + replicaSpecs[idx];
+  }
+  return joined;
+}
+
+static string markerFile(string spec) {
+  return diskImagePath(spec) + ".resync";
+}
+
+static bool fileExists(string file, long long *size) {
+  struct stat stat;
+  if (::stat(file.c_str(), &stat) != 0) {
+    return false;
+  }
+  *size = stat.st_size;
+  return true;
+}
+
+MirroredDisk::MirroredDisk(vector<string> replicaSpecs, int blockSize) : Disk(joinSpecs(replicaSpecs), blockSize) {
+  this->readTurn = 0;
+  this->writesInFlight = 0;
+  this->isCopying = false;
+  this->isResyncing = false;
+  this->isClosing = false;
+  pthread_mutex_init(&this->resyncLock, NULL);
+  pthread_cond_init(&this->resyncTurn, NULL);
+
+  // A replica is current if it exists, has no resync left to finish and
+  // is as large as the largest such replica.
+  vector<long long> sizes(replicaSpecs.size(), -1);
+  long long imageSize = -1;
+  for (size_t idx = 0; idx < replicaSpecs.size(); idx++) {
+    long long markerSize;
+    if (!fileExists(diskImagePath(replicaSpecs[idx]), &sizes[idx]) ||
+        fileExists(markerFile(replicaSpecs[idx]), &markerSize)) {
+      sizes[idx] = -1;
+    }
+    imageSize = max(imageSize, sizes[idx]);
+  }
+  if (imageSize <= 0) {
+    cerr << "None of the replicas of " << this->imageFile << " is current" << endl;
+    exit(1);
+  }
+
+  for (size_t idx = 0; idx < replicaSpecs.size(); idx++) {
+    Replica *replica = new Replica;
+    replica->spec = replicaSpecs[idx];
+    replica->isCurrent = sizes[idx] == imageSize;
+    replica->outstandingReads = 0;
+    replica->nextReadBlockNumber = -1;
+    if (replica->isCurrent) {
+      replica->disk = openRawDisk(replica->spec, blockSize);
+    } else {
+      // Mark the replica before touching it, so a crash during the resync
+      // can't leave it looking current.
+      string marker = markerFile(replica->spec);
+      int fileDescriptor = open(marker.c_str(), O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+      if (fileDescriptor < 0 || fsync(fileDescriptor) != 0 || close(fileDescriptor) != 0) {
+        perror("open");
+        cerr << "Could not create " << marker << endl;
+        exit(1);
+      }
+      long long size;
+      bool hasImage = fileExists(diskImagePath(replica->spec), &size) && size == imageSize;
+      replica->disk = openRawDisk(replica->spec, blockSize, hasImage ? 0 : imageSize);
+      cerr << "Replica " << replica->spec << " is stale, resyncing it" << endl;
+    }
+    replica->worker = new DiskWorker(replica->disk);
+    this->isReadOnly = this->isReadOnly || replica->disk->isReadOnly;
+    replicas.push_back(replica);
+  }
+  // Flush when the replicas would have.
+  setDurabilityPolicy(replicas[0]->disk->durabilityPolicy, replicas[0]->disk->durabilityIntervalMilliseconds);
+
+  openImage(imageSize);
+  if (staleReplicas() > 0 && !this->isReadOnly) {
+    if (pthread_create(&this->resyncThread, NULL, resync, this) != 0) {
+      cerr << "Could not start the resync of " << this->imageFile << endl;
+      exit(1);
+    }
+    this->isResyncing = true;
+  }
+}
+
+MirroredDisk::~MirroredDisk() {
+  // An unfinished resync starts over on the next open.
+  this->isClosing = true;
+  if (this->isResyncing) {
+    pthread_join(this->resyncThread, NULL);
+  }
+  finishWrites();
+  if (this->hasUnsyncedWrites && !this->isReadOnly) {
+    syncImage();
+  }
+  for (size_t idx = 0; idx < replicas.size(); idx++) {
+    delete replicas[idx]->worker;
+    delete replicas[idx]->disk;
+    delete replicas[idx];
+  }
+  pthread_cond_destroy(&this->resyncTurn);
+  pthread_mutex_destroy(&this->resyncLock);
+}
+
+int MirroredDisk::staleReplicas() {
+  int stale = 0;
+  for (size_t idx = 0; idx < replicas.size(); idx++) {
+    if (!replicas[idx]->isCurrent) {
+      stale++;
+    }
+  }
+  return stale;
+}
+
+MirroredDisk::Replica *MirroredDisk::chooseReplica(int firstBlockNumber, int count, bool isPrefetch) {
+  // Stay with the replica a sequential stream is reading from, otherwise
+  // take the least busy one.
+  Replica *chosen = NULL;
+  unsigned int turn = readTurn++;
+  for (size_t idx = 0; idx < replicas.size(); idx++) {
+    Replica *replica = replicas[(turn + idx) % replicas.size()];
+    if (!replica->isCurrent) {
+      continue;
+    }
+    if (replica->nextReadBlockNumber == firstBlockNumber) {
+      chosen = replica;
+      break;
+    }
+    if (chosen == NULL || replica->outstandingReads < chosen->outstandingReads) {
+      chosen = replica;
+    }
+  }
+  if (!isPrefetch) {
+    chosen->nextReadBlockNumber = firstBlockNumber + count;
+  }
+  return chosen;
+}
+
+void MirroredDisk::read(int firstBlockNumber, int count, const struct iovec *buffers) {
+  Replica *replica = chooseReplica(firstBlockNumber, count, false);
+  replica->outstandingReads++;
+  replica->disk->readImageBlocks(firstBlockNumber, count, buffers);
+  replica->outstandingReads--;
+}
+
+void MirroredDisk::write(int firstBlockNumber, int count, const struct iovec *buffers) {
+  beginWrite();
+  promise<void> finished;
+  function<void()> done = DiskWorker::joinCallbacks(replicas.size() - 1, [&finished]() {
+    finished.set_value();
+  });
+  for (size_t idx = 1; idx < replicas.size(); idx++) {
+    replicas[idx]->worker->queueTransfer(true, firstBlockNumber, vector<struct iovec>(buffers, buffers + count), done);
+  }
+  // The calling thread writes the first replica meanwhile.
+  replicas[0]->disk->writeImageBlocks(firstBlockNumber, count, buffers);
+  if (replicas.size() > 1) {
+    finished.get_future().wait();
+  }
+  endWrite();
+}
+
+void MirroredDisk::beginWrite() {
+  pthread_mutex_lock(&this->resyncLock);
+  while (this->isCopying) {
+    pthread_cond_wait(&this->resyncTurn, &this->resyncLock);
+  }
+  this->writesInFlight++;
+  pthread_mutex_unlock(&this->resyncLock);
+}
+
+void MirroredDisk::endWrite() {
+  pthread_mutex_lock(&this->resyncLock);
+  if (--this->writesInFlight == 0) {
+    pthread_cond_broadcast(&this->resyncTurn);
+  }
+  pthread_mutex_unlock(&this->resyncLock);
+}
+
+void MirroredDisk::readImageBlock(int blockNumber, void *buffer) {
+  struct iovec buffers = { buffer, (size_t) this->blockSize };
+  read(blockNumber, 1, &buffers);
+}
+
+void MirroredDisk::writeImageBlock(int blockNumber, const void *buffer) {
+  struct iovec buffers = { (void *) buffer, (size_t) this->blockSize };
+  write(blockNumber, 1, &buffers);
+}
+
+void MirroredDisk::readImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers) {
+  read(firstBlockNumber, count, buffers);
+}
+
+void MirroredDisk::writeImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers) {
+  write(firstBlockNumber, count, buffers);
+}
+
+void MirroredDisk::syncImage() {
+  promise<void> finished;
+  function<void()> done = DiskWorker::joinCallbacks(replicas.size() - 1, [&finished]() {
+    finished.set_value();
+  });
+  for (size_t idx = 1; idx < replicas.size(); idx++) {
+    replicas[idx]->worker->queueSync(done);
+  }
+  replicas[0]->disk->syncImage();
+  if (replicas.size() > 1) {
+    finished.get_future().wait();
+  }
+}
+
+void MirroredDisk::submitImageRequests(vector<BlockRequest *> &requests) {
+  for (size_t idx = 0; idx < requests.size(); idx++) {
+    BlockRequest *request = requests[idx];
+    vector<struct iovec> buffers(request->buffers, request->buffers + request->count);
+    function<void()> requestDone = std::move(request->done);
+    if (request->isWrite) {
+      beginWrite();
+      function<void()> done = DiskWorker::joinCallbacks(replicas.size(), [this, requestDone]() {
+        endWrite();
+        requestDone();
+      });
+      for (size_t replica = 0; replica < replicas.size(); replica++) {
+        replicas[replica]->worker->queueTransfer(true, request->firstBlockNumber, buffers, done);
+      }
+    } else {
+      Replica *replica = chooseReplica(request->firstBlockNumber, request->count, false);
+      replica->outstandingReads++;
+      replica->worker->queueTransfer(false, request->firstBlockNumber, std::move(buffers), [replica, requestDone]() {
+        replica->outstandingReads--;
+        requestDone();
+      });
+    }
+  }
+}
+
+void MirroredDisk::prefetchImageBlocks(int firstBlockNumber, int count) {
+  chooseReplica(firstBlockNumber, count, true)->disk->prefetchImageBlocks(firstBlockNumber, count);
+}
+
+void MirroredDisk::discardImageBlocks(int firstBlockNumber, int count) {
+  beginWrite();
+  for (size_t idx = 0; idx < replicas.size(); idx++) {
+    replicas[idx]->disk->discardImageBlocks(firstBlockNumber, count);
+  }
+  endWrite();
+}
+
+void *MirroredDisk::resync(void *arg) {
+  MirroredDisk *disk = (MirroredDisk *) arg;
+  Disk *source = NULL;
+  for (size_t idx = 0; idx < disk->replicas.size() && source == NULL; idx++) {
+    if (disk->replicas[idx]->isCurrent) {
+      source = disk->replicas[idx]->disk;
+    }
+  }
+
+  int imageBlocks = disk->imageFileSize / disk->blockSize;
+  vector<unsigned char> blocks((size_t) RESYNC_BLOCKS * disk->blockSize);
+  vector<struct iovec> buffers(RESYNC_BLOCKS);
+  for (int idx = 0; idx < RESYNC_BLOCKS; idx++) {
+    buffers[idx].iov_base = blocks.data() + (size_t) idx * disk->blockSize;
+    buffers[idx].iov_len = disk->blockSize;
+  }
+  for (size_t idx = 0; idx < disk->replicas.size(); idx++) {
+    Replica *replica = disk->replicas[idx];
+    if (replica->isCurrent) {
+      continue;
+    }
+    for (int first = 0; first < imageBlocks; first += RESYNC_BLOCKS) {
+      if (disk->isClosing) {
+        return NULL;
+      }
+      int count = min(imageBlocks - first, RESYNC_BLOCKS);
+      // Wait out the writes in flight and hold off new ones, which go to
+      // the stale replica too, until the range is copied.
+      pthread_mutex_lock(&disk->resyncLock);
+      disk->isCopying = true;
+      while (disk->writesInFlight > 0) {
+        pthread_cond_wait(&disk->resyncTurn, &disk->resyncLock);
+      }
+      pthread_mutex_unlock(&disk->resyncLock);
+
+      // Ranges of zeros, like the holes of a sparse image, become holes.
+      source->readImageBlocks(first, count, buffers.data());
+      if (all_of(blocks.begin(), blocks.begin() + (size_t) count * disk->blockSize,
+                 [](unsigned char byte) { return byte == 0; })) {
+        replica->disk->discardImageBlocks(first, count);
+      } else {
+        replica->disk->writeImageBlocks(first, count, buffers.data());
+      }
+
+      pthread_mutex_lock(&disk->resyncLock);
+      disk->isCopying = false;
+      pthread_cond_broadcast(&disk->resyncTurn);
+      pthread_mutex_unlock(&disk->resyncLock);
+    }
+    replica->disk->syncImage();
+    string marker = markerFile(replica->spec);
+    if (unlink(marker.c_str()) != 0) {
+      perror("unlink");
+      cerr << "Could not remove " << marker << endl;
+      exit(1);
+    }
+    replica->isCurrent = true;
+    cerr << "Replica " << replica->spec << " is current" << endl;
+  }
+  return NULL;
+}
@@ -0,0 +1,89 @@
+#include <iostream>
+#include <cstring>
+#include <unistd.h>
+
+#include <stdlib.h>
+
+#include <sys/mman.h>
+
+#include "MmapDisk.h"
+
+using namespace std;
+
+MmapDisk::MmapDisk(string imageFile, int blockSize) : FileDisk(imageFile, blockSize) {
+  this->image = NULL;
+  setDurabilityPolicy(DURABILITY_NONE);
+  if (this->imageFileSize == 0) {
+    return;
+  }
+
+  int protection = PROT_READ;
+  if (!this->isReadOnly) {
+    protection |= PROT_WRITE;
+  }
+  void *mapping = mmap(NULL, this->imageFileSize, protection, MAP_SHARED, this->imageFileDescriptor, 0);
+  if (mapping == MAP_FAILED) {
+    perror("mmap");
+    cerr << "Could not map image file " << imageFile << endl;
+    exit(1);
+  }
+  this->image = (unsigned char *) mapping;
+}
+
+MmapDisk::~MmapDisk() {
+  finishWrites();
+  if (this->image != NULL) {
+    if (!this->isReadOnly) {
+      msync(this->image, this->imageFileSize, MS_SYNC);
+    }
+    this->hasUnsyncedWrites = false;
+    munmap(this->image, this->imageFileSize);
+    this->image = NULL;
+  }
+}
+
+void MmapDisk::readImageBlock(int blockNumber, void *buffer) {
+  memcpy(buffer, this->image + (size_t) blockNumber * this->blockSize, this->blockSize);
+}
+
+void MmapDisk::writeImageBlock(int blockNumber, const void *buffer) {
+  if (this->isReadOnly) {
+    cerr << "Could not write file" << endl;
+    exit(1);
+  }
+  memcpy(this->image + (size_t) blockNumber * this->blockSize, buffer, this->blockSize);
+}
+
+void MmapDisk::readImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers) {
+  for (int idx = 0; idx < count; idx++) {
+    readImageBlock(firstBlockNumber + idx, buffers[idx].iov_base);
+  }
+}
+
+void MmapDisk::writeImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers) {
+  for (int idx = 0; idx < count; idx++) {
+    writeImageBlock(firstBlockNumber + idx, buffers[idx].iov_base);
+  }
+}
+
+void MmapDisk::syncImage() {
+  if (this->image == NULL || this->isReadOnly) {
+    return;
+  }
+  if (msync(this->image, this->imageFileSize, MS_SYNC) != 0) {
+    perror("msync");
+    cerr << "Could not sync image file " << this->imageFile << endl;
+    exit(1);
+  }
+}
+
+void MmapDisk::prefetchImageBlocks(int firstBlockNumber, int count) {
+  if (this->image == NULL) {
+    return;
+  }
+  // madvise needs a page aligned start.
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  size_t offset = (size_t) firstBlockNumber * this->blockSize;
+  size_t alignedOffset = offset - offset % pageSize;
+  madvise(this->image + alignedOffset, offset - alignedOffset + (size_t) count * this->blockSize, MADV_WILLNEED);
+}
@@ -0,0 +1,123 @@
+#include <iostream>
+#include <cstring>
+#include <unistd.h>
+#include <stdio.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "RamDisk.h"
+#include "ufs_format.h"
+
+using namespace std;
+
+RamDisk::RamDisk(string imageFile, int blockSize, bool isSnapshotOnClose) : Disk(imageFile, blockSize) {
+  this->isSnapshotOnClose = isSnapshotOnClose;
+  int fileDescriptor = open(imageFile.c_str(), O_RDONLY);
+  if (fileDescriptor < 0) {
+    cerr << "could not open " << imageFile << endl;
+    exit(1);
+  }
+  load(fileDescriptor);
+  close(fileDescriptor);
+  openImage(image.size());
+}
+
+RamDisk::RamDisk(string imageFile, int blockSize, int numInodes, int numData, int numJournal,
+                 int inodeFormat, bool isSnapshotOnClose) : Disk(imageFile, blockSize) {
+  this->isSnapshotOnClose = isSnapshotOnClose;
+  if (isSnapshotOnClose && imageFile.empty()) {
+    cerr << "A RAM disk needs a file name to snapshot to" << endl;
+    exit(1);
+  }
+  if (!UFS_IS_BLOCK_SIZE(blockSize)) {
+    cerr << "RAM disks can't be formatted with " << blockSize << " byte blocks" << endl;
+    exit(1);
+  }
+  if (numInodes < 32 || numData < 32 || (numJournal != 0 && numJournal < 3)) {
+    cerr << "A RAM disk needs at least 32 inodes, 32 data blocks and a journal of 0 or at least 3 blocks" << endl;
+    exit(1);
+  }
+
+  // Format through a memory backed file so that the layout comes from the
+  // same code as mkfs.
+  int fileDescriptor = memfd_create("ramdisk", 0);
+  if (fileDescriptor < 0) {
+    perror("memfd_create");
+    cerr << "Could not format a RAM disk" << endl;
+    exit(1);
+  }
+  super_t super;
+  ufs_format(fileDescriptor, blockSize, inodeFormat, numInodes, numData, numJournal, &super);
+  load(fileDescriptor);
+  close(fileDescriptor);
+  openImage(image.size());
+}
+
+RamDisk::~RamDisk() {
+  finishWrites();
+  if (isSnapshotOnClose) {
+    writeSnapshot();
+  }
+}
+
+void RamDisk::load(int fileDescriptor) {
+  struct stat stat;
+  if (fstat(fileDescriptor, &stat) != 0) {
+    cerr << "Could not stat image file" << endl;
+    exit(1);
+  }
+  image.resize(stat.st_size);
+  size_t offset = 0;
+  while (offset < image.size()) {
+    ssize_t ret = pread(fileDescriptor, image.data() + offset, image.size() - offset, offset);
+    if (ret <= 0) {
+      perror("read::pread");
+      cerr << "Could not read file" << endl;
+      exit(1);
+    }
+    offset += ret;
+  }
+}
+
+void RamDisk::writeSnapshot() {
+  // Write a copy next to the image and rename it over the image, so a
+  // crash during the snapshot leaves the previous one intact.
+  string snapshotFile = imageFile + ".snapshot";
+  int fileDescriptor = open(snapshotFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fileDescriptor < 0) {
+    cerr << "could not open " << snapshotFile << endl;
+    exit(1);
+  }
+  size_t offset = 0;
+  while (offset < image.size()) {
+    ssize_t ret = pwrite(fileDescriptor, image.data() + offset, image.size() - offset, offset);
+    if (ret <= 0) {
+      perror("write::pwrite");
+      cerr << "Could not write file" << endl;
+      exit(1);
+    }
+    offset += ret;
+  }
+  if (fsync(fileDescriptor) != 0 || close(fileDescriptor) != 0 ||
+      rename(snapshotFile.c_str(), imageFile.c_str()) != 0) {
+    perror("snapshot");
+    cerr << "Could not snapshot the RAM disk to " << imageFile << endl;
+    exit(1);
+  }
+}
+
+void RamDisk::readImageBlock(int blockNumber, void *buffer) {
+  memcpy(buffer, image.data() + (size_t) blockNumber * blockSize, blockSize);
+}
+
+void RamDisk::writeImageBlock(int blockNumber, const void *buffer) {
+  memcpy(image.data() + (size_t) blockNumber * blockSize, buffer, blockSize);
+}
+
+void RamDisk::syncImage() {
+  // memory is as durable as this Disk gets
+}
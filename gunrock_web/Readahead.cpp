@@ -0,0 +1,80 @@
+#include <algorithm>
+
+#include "Readahead.h"
+
+using namespace std;
+
+// The first window of a new sequential stream.
+static const int MIN_WINDOW = 4;
+
+Readahead::Readahead(int maxWindow) {
+  this->maxWindow = maxWindow;
+  this->window = 0;
+  this->nextBlockNumber = -1;
+  this->prefetchedFrom = 0;
+  this->prefetchedTo = 0;
+  this->sequentialReads = 0;
+  this->randomReads = 0;
+  this->prefetchedBlocks = 0;
+  this->hits = 0;
+}
+
+void Readahead::setMaxWindow(int maxWindow) {
+  this->maxWindow = maxWindow;
+  this->window = min(this->window, maxWindow);
+}
+
+int Readahead::observe(int firstBlockNumber, int count, int *prefetchStart) {
+  if (firstBlockNumber >= prefetchedFrom && firstBlockNumber < prefetchedTo) {
+    hits++;
+  }
+
+  if (firstBlockNumber == nextBlockNumber) {
+    sequentialReads++;
+    window = min(max(window * 2, MIN_WINDOW), maxWindow);
+  } else {
+    randomReads++;
+    window /= 2;
+    // a new stream, if any, prefetches afresh
+    prefetchedFrom = 0;
+    prefetchedTo = 0;
+  }
+  int end = firstBlockNumber + count;
+  nextBlockNumber = end;
+  if (window == 0 || maxWindow == 0) {
+    return 0;
+  }
+
+  // Only ask for what isn't already on its way, and only once the reader
+  // is half way through it, so that each prefetch covers half a window or
+  // more instead of costing a call per read.
+  int start = end;
+  if (start >= prefetchedFrom && start < prefetchedTo) {
+    if (prefetchedTo - end >= window / 2) {
+      return 0;
+    }
+    start = prefetchedTo;
+  }
+  int prefetchCount = end + window - start;
+  if (prefetchCount <= 0) {
+    return 0;
+  }
+  if (start != prefetchedTo) {
+    prefetchedFrom = start;
+  }
+  prefetchedTo = start + prefetchCount;
+  prefetchedBlocks += prefetchCount;
+  *prefetchStart = start;
+  return prefetchCount;
+}
+
+ReadaheadStats Readahead::stats() {
+  ReadaheadStats stats;
+  stats.sequentialReads = sequentialReads;
+  stats.randomReads = randomReads;
+  stats.prefetchedBlocks = prefetchedBlocks;
+  stats.hits = hits;
+  stats.window = window;
+  stats.maxWindow = maxWindow;
+  return stats;
+}
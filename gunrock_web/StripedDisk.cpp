@@ -0,0 +1,271 @@
+#include <algorithm>
+#include <iostream>
+#include <future>
+#include <unistd.h>
+#include <limits.h>
+#include <stdio.h>
+
+#include <stdlib.h>
+
+#include <sys/mman.h>
+
+#include "StripedDisk.h"
+#include "ufs_format.h"
+
+using namespace std;
+
+// Blocks copied to the members at a time while formatting.
+static const int FORMAT_COPY_BLOCKS = 256;
+
+static string joinSpecs(const vector<string> &memberSpecs) {
+  string joined;
+  for (size_t idx = 0; idx < memberSpecs.size(); idx++) {
+    joined += (idx == 0 ? "" : ",") + memberSpecs[idx];
+  }
+  return joined;
+}
+
+StripedDisk::StripedDisk(vector<string> memberSpecs, int blockSize, int stripeBlocks)
+  : Disk(joinSpecs(memberSpecs), blockSize) {
+  this->stripeBlocks = stripeBlocks;
+  openMembers(memberSpecs, 0);
+  openImage(stripedImageSize());
+}
+
+StripedDisk::StripedDisk(vector<string> memberSpecs, int blockSize, int stripeBlocks, int numInodes,
+                         int numData, int numJournal, int inodeFormat)
+  : Disk(joinSpecs(memberSpecs), blockSize) {
+  this->stripeBlocks = stripeBlocks;
+  if (!UFS_IS_BLOCK_SIZE(blockSize)) {
+    cerr << "Striped disks can't be formatted with " << blockSize << " byte blocks" << endl;
+    exit(1);
+  }
+  if (numInodes < 32 || numData < 32 || (numJournal != 0 && numJournal < 3)) {
+    cerr << "A striped disk needs at least 32 inodes, 32 data blocks and a journal of 0 or at least 3 blocks" << endl;
+    exit(1);
+  }
+  if (memberSpecs.empty() || stripeBlocks <= 0) {
+    cerr << "A striped disk needs at least one member and a stripe unit of at least one block" << endl;
+    exit(1);
+  }
+
+  // Format through a memory backed file so that the layout comes from the
+  // same code as mkfs, growing the data region until the image ends on a
+  // stripe boundary, where the journal header has to be.
+  int fileDescriptor = memfd_create("stripeddisk", 0);
+  if (fileDescriptor < 0) {
+    perror("memfd_create");
+    cerr << "Could not format a striped disk" << endl;
+    exit(1);
+  }
+  int stripeWidth = (int) memberSpecs.size() * stripeBlocks;
+  super_t super;
+  int totalBlocks = ufs_format(fileDescriptor, blockSize, inodeFormat, numInodes, numData, numJournal, &super);
+  while (totalBlocks % stripeWidth != 0) {
+    numData += stripeWidth - totalBlocks % stripeWidth;
+    if (ftruncate(fileDescriptor, 0) != 0) {
+      perror("ftruncate");
+      exit(1);
+    }
+    totalBlocks = ufs_format(fileDescriptor, blockSize, inodeFormat, numInodes, numData, numJournal, &super);
+  }
+
+  openMembers(memberSpecs, (long long) totalBlocks / memberSpecs.size() * blockSize);
+  vector<unsigned char> blocks((size_t) FORMAT_COPY_BLOCKS * blockSize);
+  vector<struct iovec> buffers(FORMAT_COPY_BLOCKS);
+  for (int first = 0; first < totalBlocks; first += FORMAT_COPY_BLOCKS) {
+    int count = min(totalBlocks - first, FORMAT_COPY_BLOCKS);
+    ssize_t bytes = (ssize_t) count * blockSize;
+    if (pread(fileDescriptor, blocks.data(), bytes, (off_t) first * blockSize) != bytes) {
+      perror("read::pread");
+      cerr << "Could not read the formatted image" << endl;
+      exit(1);
+    }
+    // The new member files are sparse and already read as zeros.
+    if (all_of(blocks.begin(), blocks.begin() + bytes, [](unsigned char byte) { return byte == 0; })) {
+      continue;
+    }
+    for (int idx = 0; idx < count; idx++) {
+      buffers[idx].iov_base = blocks.data() + (size_t) idx * blockSize;
+      buffers[idx].iov_len = blockSize;
+    }
+    writeImageBlocks(first, count, buffers.data());
+  }
+  close(fileDescriptor);
+  syncImage();
+  openImage(stripedImageSize());
+}
+
+StripedDisk::~StripedDisk() {
+  finishWrites();
+  if (this->hasUnsyncedWrites && !this->isReadOnly) {
+    syncImage();
+  }
+  for (size_t idx = 0; idx < members.size(); idx++) {
+    delete workers[idx];
+    delete members[idx];
+  }
+}
+
+void StripedDisk::openMembers(const vector<string> &memberSpecs, long long memberSize) {
+  for (size_t idx = 0; idx < memberSpecs.size(); idx++) {
+    Disk *member = openRawDisk(memberSpecs[idx], this->blockSize, memberSize);
+    this->isReadOnly = this->isReadOnly || member->isReadOnly;
+    members.push_back(member);
+    workers.push_back(new DiskWorker(member));
+  }
+  // Flush when the members would have.
+  setDurabilityPolicy(members[0]->durabilityPolicy, members[0]->durabilityIntervalMilliseconds);
+}
+
+long long StripedDisk::stripedImageSize() {
+  int memberBlocks = INT_MAX;
+  for (size_t idx = 0; idx < members.size(); idx++) {
+    memberBlocks = min(memberBlocks, members[idx]->imageFileSize / this->blockSize);
+  }
+  long long size = (long long) (memberBlocks / stripeBlocks) * stripeBlocks * members.size() * this->blockSize;
+  if (size > INT_MAX) {
+    cerr << "A striped disk can't be larger than " << INT_MAX << " bytes" << endl;
+    exit(1);
+  }
+  return size;
+}
+
+int StripedDisk::locate(int blockNumber, int *memberBlockNumber) {
+  int stripe = blockNumber / stripeBlocks;
+  int row = stripe / (int) members.size();
+  *memberBlockNumber = row * stripeBlocks + blockNumber % stripeBlocks;
+  return stripe % (int) members.size();
+}
+
+void StripedDisk::readImageBlock(int blockNumber, void *buffer) {
+  int memberBlockNumber;
+  int member = locate(blockNumber, &memberBlockNumber);
+  members[member]->readImageBlock(memberBlockNumber, buffer);
+}
+
+void StripedDisk::writeImageBlock(int blockNumber, const void *buffer) {
+  int memberBlockNumber;
+  int member = locate(blockNumber, &memberBlockNumber);
+  members[member]->writeImageBlock(memberBlockNumber, buffer);
+}
+
+void StripedDisk::syncImage() {
+  if (members.size() == 1) {
+    members[0]->syncImage();
+    return;
+  }
+  // Flush every member at once, the slowest one sets the pace.
+  promise<void> finished;
+  function<void()> done = DiskWorker::joinCallbacks(members.size(), [&finished]() {
+    finished.set_value();
+  });
+  for (size_t idx = 0; idx < members.size(); idx++) {
+    workers[idx]->queueSync(done);
+  }
+  finished.get_future().wait();
+}
+
+void StripedDisk::readImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers) {
+  transfer(false, firstBlockNumber, count, buffers);
+}
+
+void StripedDisk::writeImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers) {
+  transfer(true, firstBlockNumber, count, buffers);
+}
+
+void StripedDisk::transfer(bool isWrite, int firstBlockNumber, int count, const struct iovec *buffers) {
+  int lastBlockNumber = firstBlockNumber + count - 1;
+  if (firstBlockNumber / stripeBlocks == lastBlockNumber / stripeBlocks) {
+    // A single member holds the whole run, so there is nothing to overlap.
+    int memberBlockNumber;
+    Disk *disk = members[locate(firstBlockNumber, &memberBlockNumber)];
+    if (isWrite) {
+      disk->writeImageBlocks(memberBlockNumber, count, buffers);
+    } else {
+      disk->readImageBlocks(memberBlockNumber, count, buffers);
+    }
+    return;
+  }
+
+  promise<void> finished;
+  BlockRequest request;
+  request.isWrite = isWrite;
+  request.firstBlockNumber = firstBlockNumber;
+  request.count = count;
+  request.buffers = buffers;
+  request.done = [&finished]() {
+    finished.set_value();
+  };
+  future<void> done = finished.get_future();
+  vector<BlockRequest *> requests(1, &request);
+  submitImageRequests(requests);
+  done.wait();
+}
+
+void StripedDisk::submitImageRequests(vector<BlockRequest *> &requests) {
+  for (size_t idx = 0; idx < requests.size(); idx++) {
+    BlockRequest *request = requests[idx];
+    // The blocks of a run that land on one member are adjacent there,
+    // since consecutive stripe units of a member follow each other.
+    vector<int> memberFirst(members.size(), -1);
+    vector<vector<struct iovec> > memberBuffers(members.size());
+    int pieces = 0;
+    for (int block = 0; block < request->count; block++) {
+      int memberBlockNumber;
+      int member = locate(request->firstBlockNumber + block, &memberBlockNumber);
+      if (memberFirst[member] < 0) {
+        memberFirst[member] = memberBlockNumber;
+        pieces++;
+      }
+      memberBuffers[member].push_back(request->buffers[block]);
+    }
+
+    if (pieces == 0) {
+      function<void()> done = std::move(request->done);
+      done();
+      continue;
+    }
+    function<void()> done = DiskWorker::joinCallbacks(pieces, std::move(request->done));
+    for (size_t member = 0; member < members.size(); member++) {
+      if (memberFirst[member] >= 0) {
+        workers[member]->queueTransfer(request->isWrite, memberFirst[member], std::move(memberBuffers[member]), done);
+      }
+    }
+  }
+}
+
+void StripedDisk::splitRun(int firstBlockNumber, int count, vector<int> &memberFirst, vector<int> &memberCount) {
+  memberFirst.assign(members.size(), -1);
+  memberCount.assign(members.size(), 0);
+  for (int idx = 0; idx < count; idx++) {
+    int memberBlockNumber;
+    int member = locate(firstBlockNumber + idx, &memberBlockNumber);
+    if (memberFirst[member] < 0) {
+      memberFirst[member] = memberBlockNumber;
+    }
+    memberCount[member]++;
+  }
+}
+
+void StripedDisk::prefetchImageBlocks(int firstBlockNumber, int count) {
+  vector<int> memberFirst;
+  vector<int> memberCount;
+  splitRun(firstBlockNumber, count, memberFirst, memberCount);
+  for (size_t member = 0; member < members.size(); member++) {
+    if (memberCount[member] > 0) {
+      members[member]->prefetchImageBlocks(memberFirst[member], memberCount[member]);
+    }
+  }
+}
+
+void StripedDisk::discardImageBlocks(int firstBlockNumber, int count) {
+  vector<int> memberFirst;
+  vector<int> memberCount;
+  splitRun(firstBlockNumber, count, memberFirst, memberCount);
+  for (size_t member = 0; member < members.size(); member++) {
+    if (memberCount[member] > 0) {
+      members[member]->discardImageBlocks(memberFirst[member], memberCount[member]);
+    }
+  }
+}
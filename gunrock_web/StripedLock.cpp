@@ -0,0 +1,72 @@
+#include <algorithm>
+
+#include "StripedLock.h"
+
+using namespace std;
+
+StripedLock::StripedLock(int stripes) {
+  this->stripeCount = stripes;
+  this->stripes = new Stripe[stripes];
+  for (int stripe = 0; stripe < stripes; stripe++) {
+    pthread_mutex_init(&this->stripes[stripe].mutex, NULL);
+    pthread_cond_init(&this->stripes[stripe].released, NULL);
+    this->stripes[stripe].isLocked = false;
+  }
+}
+
+StripedLock::~StripedLock() {
+  for (int stripe = 0; stripe < stripeCount; stripe++) {
+    pthread_cond_destroy(&stripes[stripe].released);
+    pthread_mutex_destroy(&stripes[stripe].mutex);
+  }
+  delete [] stripes;
+}
+
+int StripedLock::stripeOf(int blockNumber) {
+  return blockNumber % stripeCount;
+}
+
+void StripedLock::lockStripe(int stripe) {
+  Stripe *current = &stripes[stripe];
+  pthread_mutex_lock(&current->mutex);
+  while (current->isLocked) {
+    pthread_cond_wait(&current->released, &current->mutex);
+  }
+  current->isLocked = true;
+  pthread_mutex_unlock(&current->mutex);
+}
+
+void StripedLock::unlockStripe(int stripe) {
+  Stripe *current = &stripes[stripe];
+  pthread_mutex_lock(&current->mutex);
+  current->isLocked = false;
+  pthread_cond_signal(&current->released);
+  pthread_mutex_unlock(&current->mutex);
+}
+
+void StripedLock::lock(int blockNumber) {
+  lockStripe(stripeOf(blockNumber));
+}
+
+void StripedLock::unlock(int blockNumber) {
+  unlockStripe(stripeOf(blockNumber));
+}
+
+void StripedLock::lockAll(const int *blockNumbers, int count, vector<int> *stripes) {
+  stripes->clear();
+  for (int idx = 0; idx < count; idx++) {
+    stripes->push_back(stripeOf(blockNumbers[idx]));
+  }
+  sort(stripes->begin(), stripes->end());
+  stripes->erase(unique(stripes->begin(), stripes->end()), stripes->end());
+
+  for (size_t idx = 0; idx < stripes->size(); idx++) {
+    lockStripe((*stripes)[idx]);
+  }
+}
+
+void StripedLock::unlockAll(const vector<int> &stripes) {
+  for (size_t idx = 0; idx < stripes.size(); idx++) {
+    unlockStripe(stripes[idx]);
+  }
+}
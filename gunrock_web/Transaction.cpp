@@ -0,0 +1,52 @@
+#include <cstring>
+
+#include "Transaction.h"
+
+using namespace std;
+
+Transaction::Transaction(int blockSize) : dirtyArena(blockSize) {
+  this->blockSize = blockSize;
+}
+
+int Transaction::blockCount() {
+  return dirtyBlocks.size();
+}
+
+void Transaction::clear() {
+  dirtyBlocks.clear();
+  dirtyArena.reset();
+  readVersions.clear();
+  discardedBlocks.clear();
+  rollbackActions.clear();
+  finishActions.clear();
+}
+
+void Transaction::writeDirty(int blockNumber, const void *buffer) {
+  unsigned char *&data = dirtyBlocks[blockNumber];
+  if (data == NULL) {
+    data = dirtyArena.allocate();
+  }
+  memcpy(data, buffer, blockSize);
+}
+
+bool Transaction::readDirty(int blockNumber, void *buffer) {
+  if (dirtyBlocks.empty()) {
+    return false;
+  }
+  map<int, unsigned char *>::iterator iter = dirtyBlocks.find(blockNumber);
+  if (iter == dirtyBlocks.end()) {
+    return false;
+  }
+  memcpy(buffer, iter->second, blockSize);
+  return true;
+}
+
+vector<int> Transaction::blockNumbers() {
+  vector<int> blocks;
+  blocks.reserve(dirtyBlocks.size());
+  map<int, unsigned char *>::iterator iter;
+  for (iter = dirtyBlocks.begin(); iter != dirtyBlocks.end(); iter++) {
+    blocks.push_back(iter->first);
+  }
+  return blocks;
+}
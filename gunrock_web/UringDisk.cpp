@@ -0,0 +1,295 @@
+#include <iostream>
+#include <cstring>
+#include <future>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+
+#include <stdlib.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "UringDisk.h"
+
+using namespace std;
+
+// One submission queue entry. A run longer than IOV_MAX is split over
+// several entries that all point at the same pending request.
+struct UringPendingRequest {
+  BlockRequest *request;
+  int remainingEntries;
+};
+
+struct UringEntry {
+  UringPendingRequest *pending;
+  long long expectedBytes;
+};
+
+static int ioUringSetup(unsigned int entries, struct io_uring_params *params) {
+  return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ioUringEnter(int ringFileDescriptor, unsigned int toSubmit, unsigned int minComplete, unsigned int flags) {
+  return (int) syscall(__NR_io_uring_enter, ringFileDescriptor, toSubmit, minComplete, flags, NULL, 0);
+}
+
+UringDisk::UringDisk(string imageFile, int blockSize, int queueDepth) : FileDisk(imageFile, blockSize) {
+  this->hasRing = false;
+  this->inFlight = 0;
+  this->queued = 0;
+  pthread_mutex_init(&this->submitLock, NULL);
+  pthread_cond_init(&this->entryFreed, NULL);
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  this->ringFileDescriptor = ioUringSetup(queueDepth, &params);
+  if (this->ringFileDescriptor < 0) {
+    perror("io_uring_setup");
+    cerr << "io_uring is not available, using pread/pwrite for " << imageFile << endl;
+    return;
+  }
+
+  this->submissionEntries = params.sq_entries;
+  this->submissionRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  this->completionRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool isSingleMapping = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (isSingleMapping && this->completionRingSize > this->submissionRingSize) {
+    this->submissionRingSize = this->completionRingSize;
+  }
+
+  this->submissionRing = mmap(NULL, this->submissionRingSize, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, this->ringFileDescriptor, IORING_OFF_SQ_RING);
+  if (this->submissionRing == MAP_FAILED) {
+    perror("mmap");
+    cerr << "Could not map the io_uring submission queue" << endl;
+    exit(1);
+  }
+  if (isSingleMapping) {
+    this->completionRing = this->submissionRing;
+  } else {
+    this->completionRing = mmap(NULL, this->completionRingSize, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, this->ringFileDescriptor, IORING_OFF_CQ_RING);
+    if (this->completionRing == MAP_FAILED) {
+      perror("mmap");
+      cerr << "Could not map the io_uring completion queue" << endl;
+      exit(1);
+    }
+  }
+  void *entryMapping = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, this->ringFileDescriptor, IORING_OFF_SQES);
+  if (entryMapping == MAP_FAILED) {
+    perror("mmap");
+    cerr << "Could not map the io_uring submission entries" << endl;
+    exit(1);
+  }
+  this->entries = (struct io_uring_sqe *) entryMapping;
+
+  unsigned char *submission = (unsigned char *) this->submissionRing;
+  this->submissionTail = (unsigned int *) (submission + params.sq_off.tail);
+  this->submissionMask = (unsigned int *) (submission + params.sq_off.ring_mask);
+  this->submissionArray = (unsigned int *) (submission + params.sq_off.array);
+  unsigned char *completion = (unsigned char *) this->completionRing;
+  this->completionHead = (unsigned int *) (completion + params.cq_off.head);
+  this->completionTail = (unsigned int *) (completion + params.cq_off.tail);
+  this->completionMask = (unsigned int *) (completion + params.cq_off.ring_mask);
+  this->completions = (struct io_uring_cqe *) (completion + params.cq_off.cqes);
+
+  this->hasRing = true;
+  if (pthread_create(&this->reaper, NULL, reapCompletions, this) != 0) {
+    cerr << "Could not start the io_uring completion thread" << endl;
+    exit(1);
+  }
+}
+
+UringDisk::~UringDisk() {
+  finishWrites();
+  if (!this->hasRing) {
+    return;
+  }
+
+  // A no-op with no request attached tells the completion thread to exit.
+  pthread_mutex_lock(&submitLock);
+  while (inFlight + queued >= submissionEntries) {
+    pthread_cond_wait(&entryFreed, &submitLock);
+  }
+  queueEntry(IORING_OP_NOP, 0, NULL, 0, NULL);
+  enterQueuedEntries();
+  pthread_mutex_unlock(&submitLock);
+  pthread_join(this->reaper, NULL);
+
+  munmap(this->entries, this->submissionEntries * sizeof(struct io_uring_sqe));
+  if (this->completionRing != this->submissionRing) {
+    munmap(this->completionRing, this->completionRingSize);
+  }
+  munmap(this->submissionRing, this->submissionRingSize);
+  close(this->ringFileDescriptor);
+  pthread_cond_destroy(&this->entryFreed);
+  pthread_mutex_destroy(&this->submitLock);
+}
+
+void UringDisk::readImageBlock(int blockNumber, void *buffer) {
+  struct iovec blockBuffer;
+  blockBuffer.iov_base = buffer;
+  blockBuffer.iov_len = this->blockSize;
+  readImageBlocks(blockNumber, 1, &blockBuffer);
+}
+
+void UringDisk::writeImageBlock(int blockNumber, const void *buffer) {
+  struct iovec blockBuffer;
+  blockBuffer.iov_base = (void *) buffer;
+  blockBuffer.iov_len = this->blockSize;
+  writeImageBlocks(blockNumber, 1, &blockBuffer);
+}
+
+void UringDisk::readImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers) {
+  if (!this->hasRing) {
+    FileDisk::readImageBlocks(firstBlockNumber, count, buffers);
+    return;
+  }
+  transfer(false, firstBlockNumber, count, buffers);
+}
+
+void UringDisk::writeImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers) {
+  if (!this->hasRing) {
+    FileDisk::writeImageBlocks(firstBlockNumber, count, buffers);
+    return;
+  }
+  transfer(true, firstBlockNumber, count, buffers);
+}
+
+void UringDisk::transfer(bool isWrite, int firstBlockNumber, int count, const struct iovec *buffers) {
+  promise<void> finished;
+  BlockRequest request;
+  request.isWrite = isWrite;
+  request.firstBlockNumber = firstBlockNumber;
+  request.count = count;
+  request.buffers = buffers;
+  request.done = [&finished]() {
+    finished.set_value();
+  };
+  future<void> done = finished.get_future();
+  vector<BlockRequest *> requests(1, &request);
+  submitImageRequests(requests);
+  done.wait();
+}
+
+void UringDisk::submitImageRequests(vector<BlockRequest *> &requests) {
+  if (!this->hasRing) {
+    Disk::submitImageRequests(requests);
+    return;
+  }
+
+  pthread_mutex_lock(&submitLock);
+  for (size_t idx = 0; idx < requests.size(); idx++) {
+    BlockRequest *request = requests[idx];
+    UringPendingRequest *pending = new UringPendingRequest;
+    pending->request = request;
+    pending->remainingEntries = (request->count + IOV_MAX - 1) / IOV_MAX;
+
+    unsigned long long offset = (unsigned long long) request->firstBlockNumber * this->blockSize;
+    for (int first = 0; first < request->count; first += IOV_MAX) {
+      int batch = min(request->count - first, IOV_MAX);
+      // Keep no more entries outstanding than the completion queue can hold.
+      while (inFlight + queued >= submissionEntries) {
+        if (queued > 0) {
+          enterQueuedEntries();
+        } else {
+          pthread_cond_wait(&entryFreed, &submitLock);
+        }
+      }
+      UringEntry *entry = new UringEntry;
+      entry->pending = pending;
+      entry->expectedBytes = (long long) batch * this->blockSize;
+      queueEntry(request->isWrite ? IORING_OP_WRITEV : IORING_OP_READV, offset, request->buffers + first, batch, entry);
+      offset += entry->expectedBytes;
+    }
+  }
+  enterQueuedEntries();
+  pthread_mutex_unlock(&submitLock);
+}
+
+// Called with submitLock held.
+void UringDisk::queueEntry(int opcode, unsigned long long offset, const struct iovec *buffers, int count, void *userData) {
+  unsigned int tail = *submissionTail;
+  unsigned int index = tail & *submissionMask;
+  struct io_uring_sqe *entry = &entries[index];
+  memset(entry, 0, sizeof(*entry));
+  entry->opcode = opcode;
+  entry->fd = this->imageFileDescriptor;
+  entry->off = offset;
+  entry->addr = (unsigned long long) buffers;
+  entry->len = count;
+  entry->user_data = (unsigned long long) userData;
+  submissionArray[index] = index;
+  __atomic_store_n(submissionTail, tail + 1, __ATOMIC_RELEASE);
+  queued++;
+}
+
+// Called with submitLock held.
+void UringDisk::enterQueuedEntries() {
+  while (queued > 0) {
+    int ret = ioUringEnter(ringFileDescriptor, queued, 0, 0);
+    if (ret < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+        continue;
+      }
+      perror("io_uring_enter");
+      cerr << "Could not submit block I/O" << endl;
+      exit(1);
+    }
+    queued -= ret;
+    inFlight += ret;
+  }
+}
+
+void *UringDisk::reapCompletions(void *arg) {
+  UringDisk *disk = (UringDisk *) arg;
+  bool isStopping = false;
+  while (!isStopping) {
+    int ret = ioUringEnter(disk->ringFileDescriptor, 0, 1, IORING_ENTER_GETEVENTS);
+    if (ret < 0 && errno != EINTR) {
+      perror("io_uring_enter");
+      cerr << "Could not reap block I/O" << endl;
+      exit(1);
+    }
+
+    // We are the only consumer of the completion queue.
+    unsigned int head = *disk->completionHead;
+    unsigned int tail = __atomic_load_n(disk->completionTail, __ATOMIC_ACQUIRE);
+    vector<BlockRequest *> finished;
+    unsigned int reaped = 0;
+    for (; head != tail; head++, reaped++) {
+      struct io_uring_cqe *completion = &disk->completions[head & *disk->completionMask];
+      UringEntry *entry = (UringEntry *) completion->user_data;
+      if (entry == NULL) {
+        isStopping = true;
+        continue;
+      }
+      if (completion->res != entry->expectedBytes) {
+        errno = completion->res < 0 ? -completion->res : EIO;
+        perror("io_uring");
+        cerr << "Could not " << (entry->pending->request->isWrite ? "write" : "read") << " file" << endl;
+        exit(1);
+      }
+      UringPendingRequest *pending = entry->pending;
+      delete entry;
+      if (--pending->remainingEntries == 0) {
+        finished.push_back(pending->request);
+        delete pending;
+      }
+    }
+    __atomic_store_n(disk->completionHead, head, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&disk->submitLock);
+    disk->inFlight -= reaped;
+    pthread_cond_broadcast(&disk->entryFreed);
+    pthread_mutex_unlock(&disk->submitLock);
+
+    for (size_t idx = 0; idx < finished.size(); idx++) {
+      function<void()> done = std::move(finished[idx]->done);
+      done();
+    }
+  }
+  return NULL;
+}
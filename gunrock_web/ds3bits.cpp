@@ -2,10 +2,12 @@
 #include <string>
 #include <algorithm>
 #include <cstring>
+#include <vector>
 
 #include "LocalFileSystem.h"
 #include "Disk.h"
 #include "ufs.h"
+#include "ufs_format.h"
 
 using namespace std;
 
@@ -17,7 +19,7 @@ int main(int argc, char *argv[]) {
   }
 
   // Parse command line arguments
-  Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
+  Disk *disk = openDisk(argv[1], imageBlockSize(argv[1]));
   LocalFileSystem *fileSystem = new LocalFileSystem(disk);
   super_t superBlock;
   fileSystem->readSuperBlock(&superBlock);
@@ -28,17 +30,21 @@ int main(int argc, char *argv[]) {
   cout << "data_region_addr" << " " << superBlock.data_region_addr << endl;
   cout << "data_region_len" << " " << superBlock.data_region_len << endl;
   cout << "num_data" << " " << superBlock.num_data << endl;
+  // only shown for the formats that came after the original one
+  if(superBlock.inode_format != UFS_INODE_DIRECT) {
+    cout << "inode_format" << " " << ufs_inode_format_name(superBlock.inode_format) << endl;
+  }
   cout << endl;
-  unsigned char inodeBitmap[UFS_BLOCK_SIZE];
-  fileSystem->readInodeBitmap(&superBlock, inodeBitmap);
+  vector<unsigned char> inodeBitmap(superBlock.inode_bitmap_len * disk->getBlockSize());
+  fileSystem->readInodeBitmap(&superBlock, inodeBitmap.data());
   int inodeBitmapSize = (superBlock.num_inodes + 7) / 8;
   cout << "Inode bitmap" << endl;
   for(int i = 0; i < inodeBitmapSize; i++) {
     cout << (unsigned int)(inodeBitmap[i]) << " ";
   }
   cout << endl << endl;
-  unsigned char dataBitmap[UFS_BLOCK_SIZE];
-  fileSystem->readDataBitmap(&superBlock, dataBitmap);
+  vector<unsigned char> dataBitmap(superBlock.data_bitmap_len * disk->getBlockSize());
+  fileSystem->readDataBitmap(&superBlock, dataBitmap.data());
   int dataBitmapSize = (superBlock.num_data + 7) / 8;
   cout << "Data bitmap" << endl;
   for(int i = 0; i < dataBitmapSize; i++) {
@@ -2,6 +2,7 @@
 #include <string>
 #include <algorithm>
 #include <cstring>
+#include <vector>
 #include <unistd.h>
 #include "LocalFileSystem.h"
 #include "Disk.h"
@@ -17,7 +18,7 @@ int main(int argc, char *argv[]) {
   }
 
   // Parse command line arguments
-  Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
+  Disk *disk = openDisk(argv[1], imageBlockSize(argv[1]));
   LocalFileSystem *fileSystem = new LocalFileSystem(disk);
   int inodeNumber = stoi(argv[2]);
   inode_t inode;
@@ -28,11 +29,17 @@ int main(int argc, char *argv[]) {
     delete disk;
     return 1;
   }
+  vector<int> blockNumbers;
+  if(fileSystem->listBlocks(inodeNumber, blockNumbers) != 0) {
+    cerr << "Error reading file" << endl;
+    delete fileSystem;
+    delete disk;
+    return 1;
+  }
   cout << "File blocks" << endl;
-  int numBlocks = (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
-  for(int i = 0; i < numBlocks; i++) {
-    if(inode.direct[i] != 0) {
-      cout << inode.direct[i] << endl;
+  for(size_t i = 0; i < blockNumbers.size(); i++) {
+    if(blockNumbers[i] != 0) {
+      cout << blockNumbers[i] << endl;
     }
   }
   cout << endl;
@@ -0,0 +1,103 @@
+#include <pthread.h>
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Disk.h"
+
+using namespace std;
+
+// Two transactions on different threads read the same block, add one to
+// the counter at its start and write it back. The first commits, and the
+// second must then fail validation and succeed when it runs again, so
+// that the block ends up two higher instead of losing an update.
+
+struct ConflictArgs {
+  Disk *disk;
+  int blockNumber;
+  pthread_barrier_t *barrier;
+  bool isFirst;
+  vector<bool> commits;
+};
+
+static void increment(Disk *disk, int blockNumber) {
+  vector<unsigned char> block(disk->getBlockSize());
+  disk->readBlock(blockNumber, block.data());
+  unsigned int counter;
+  memcpy(&counter, block.data(), sizeof(counter));
+  counter++;
+  memcpy(block.data(), &counter, sizeof(counter));
+  disk->writeBlock(blockNumber, block.data());
+}
+
+static void *runTransaction(void *arg) {
+  ConflictArgs *args = (ConflictArgs *) arg;
+  args->disk->beginTransaction();
+  increment(args->disk, args->blockNumber);
+  // both have read the block before either commits
+  pthread_barrier_wait(args->barrier);
+  if (args->isFirst) {
+    args->commits.push_back(args->disk->commit());
+    pthread_barrier_wait(args->barrier);
+    return NULL;
+  }
+  pthread_barrier_wait(args->barrier);
+  bool isCommitted = args->disk->commit();
+  args->commits.push_back(isCommitted);
+  if (!isCommitted) {
+    args->disk->beginTransaction();
+    increment(args->disk, args->blockNumber);
+    args->commits.push_back(args->disk->commit());
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    cerr << argv[0] << ": diskImageFile blockNumber" << endl;
+    cerr << "For example:" << endl;
+    cerr << "    $ " << argv[0] << " a.img 40" << endl;
+    return 1;
+  }
+
+  // Parse command line arguments
+  Disk *disk = openDisk(argv[1], imageBlockSize(argv[1]));
+  int blockNumber = stoi(argv[2]);
+
+  vector<unsigned char> block(disk->getBlockSize(), 0);
+  disk->writeBlock(blockNumber, block.data());
+
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, 2);
+  ConflictArgs args[2];
+  pthread_t workers[2];
+  for (int idx = 0; idx < 2; idx++) {
+    args[idx].disk = disk;
+    args[idx].blockNumber = blockNumber;
+    args[idx].barrier = &barrier;
+    args[idx].isFirst = idx == 0;
+    pthread_create(&workers[idx], NULL, runTransaction, &args[idx]);
+  }
+  for (int idx = 0; idx < 2; idx++) {
+    pthread_join(workers[idx], NULL);
+  }
+  pthread_barrier_destroy(&barrier);
+
+  for (int idx = 0; idx < 2; idx++) {
+    cout << (idx == 0 ? "first" : "second") << " transaction commits:";
+    for (size_t commit = 0; commit < args[idx].commits.size(); commit++) {
+      cout << " " << (args[idx].commits[commit] ? "true" : "false");
+    }
+    cout << endl;
+  }
+  disk->readBlock(blockNumber, block.data());
+  unsigned int counter;
+  memcpy(&counter, block.data(), sizeof(counter));
+  cout << "counter " << counter << endl;
+
+  delete disk;
+  bool isExpected = args[0].commits == vector<bool>{true} && args[1].commits == vector<bool>{false, true} && counter == 2;
+  return isExpected ? 0 : 1;
+}
@@ -22,7 +22,7 @@ int main(int argc, char *argv[]) {
   }
 
   // Parse command line arguments
-  Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
+  Disk *disk = openDisk(argv[1], imageBlockSize(argv[1]));
   LocalFileSystem *fileSystem = new LocalFileSystem(disk);
   string srcFile = string(argv[2]);
   int dstInode = stoi(argv[3]);
@@ -48,8 +48,17 @@ int main(int argc, char *argv[]) {
     buffer.insert(buffer.end(), tempBuffer, tempBuffer + bytesRead);
   }
   buffer.push_back('\0');
+  disk->beginTransaction();
   int writeResult = fileSystem->write(dstInode, buffer.data(), buffer.size());
   if(writeResult == -EINVALIDINODE || writeResult == -EINVALIDTYPE || writeResult == -EINVALIDSIZE || writeResult == -ENOTENOUGHSPACE) {
+    disk->rollback();
+    cerr << "Could not write to dst_file" << endl;
+    delete fileSystem;
+    delete disk;
+    return 1;
+  }
+  if(!disk->commit()) {
+    // too big for the journal
     cerr << "Could not write to dst_file" << endl;
     delete fileSystem;
     delete disk;
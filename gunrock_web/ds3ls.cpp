@@ -59,7 +59,7 @@ int main(int argc, char *argv[]) {
   }
 
   // parse command line arguments
-  Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
+  Disk *disk = openDisk(argv[1], imageBlockSize(argv[1]));
   LocalFileSystem *fileSystem = new LocalFileSystem(disk);
   string directory = string(argv[2]);
   vector<string> pathComponents = splitPath(directory);
@@ -0,0 +1,158 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <cstring>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "AlignedBuffer.h"
+#include "Disk.h"
+#include "DiskTrace.h"
+#include "Histogram.h"
+
+using namespace std;
+
+struct ReplayThread {
+  pthread_t thread;
+  Disk *disk;
+  int blockSize;
+  bool isTimed;
+  unsigned long long startNanoseconds;
+  vector<DiskTraceRecord> records;
+  Histogram *latency;
+};
+
+static unsigned long long monotonicNanoseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void sleepUntil(unsigned long long deadlineNanoseconds) {
+  struct timespec deadline;
+  deadline.tv_sec = deadlineNanoseconds / 1000000000ULL;
+  deadline.tv_nsec = deadlineNanoseconds % 1000000000ULL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+  }
+}
+
+// Replays one traced thread's records, in order.
+static void *replay(void *arg) {
+  ReplayThread *replayThread = (ReplayThread *) arg;
+  Disk *disk = replayThread->disk;
+  AlignedBuffer buffer(replayThread->blockSize);
+  for (size_t idx = 0; idx < replayThread->records.size(); idx++) {
+    DiskTraceRecord &record = replayThread->records[idx];
+    if (replayThread->isTimed) {
+      sleepUntil(replayThread->startNanoseconds + record.timestamp);
+    }
+    unsigned long long start = monotonicNanoseconds();
+    switch (record.operation) {
+    case DISK_OPERATION_READ:
+      disk->readBlock(record.blockNumber, buffer.data());
+      break;
+    case DISK_OPERATION_WRITE:
+      // The trace doesn't keep the data, so any bytes will do.
+      memset(buffer.data(), record.blockNumber & 0xff, replayThread->blockSize);
+      disk->writeBlock(record.blockNumber, buffer.data());
+      break;
+    case DISK_OPERATION_SYNC:
+      disk->sync();
+      break;
+    }
+    replayThread->latency[record.operation].record(monotonicNanoseconds() - start);
+  }
+  return NULL;
+}
+
+static void printLatency(string name, HistogramSummary summary) {
+  cout << "  " << left << setw(8) << name << right << fixed << setprecision(1)
+       << "count " << summary.count << " mean " << summary.mean / 1000
+       << " p50 " << summary.p50 / 1000.0 << " p90 " << summary.p90 / 1000.0
+       << " p99 " << summary.p99 / 1000.0 << " p99.9 " << summary.p999 / 1000.0
+       << " max " << summary.max / 1000.0 << endl;
+}
+
+int main(int argc, char *argv[]) {
+  bool isTimed = false;
+  int cacheMegabytes = 0;
+  int option;
+  while ((option = getopt(argc, argv, "tC:")) != -1) {
+    switch (option) {
+    case 't':
+      isTimed = true;
+      break;
+    case 'C':
+      cacheMegabytes = atoi(optarg);
+      break;
+    default:
+      cerr << argv[0] << ": [-t] [-C cacheMegabytes] diskImageFile traceFile" << endl;
+      return 1;
+    }
+  }
+  if (argc - optind != 2) {
+    cerr << argv[0] << ": [-t] [-C cacheMegabytes] diskImageFile traceFile" << endl;
+    return 1;
+  }
+
+  int blockSize;
+  vector<DiskTraceRecord> records;
+  DiskTrace::load(argv[optind + 1], &blockSize, &records);
+  Disk *disk = openDisk(argv[optind], blockSize);
+  disk->setCacheSize(cacheMegabytes);
+
+  // Give every traced thread its own replay thread, so that the requests
+  // overlap the way they did when they were recorded.
+  vector<ReplayThread *> threads;
+  Histogram latency[DISK_OPERATIONS];
+  for (size_t idx = 0; idx < records.size(); idx++) {
+    DiskTraceRecord &record = records[idx];
+    if (record.operation > DISK_OPERATION_SYNC ||
+        (record.operation != DISK_OPERATION_SYNC &&
+         (record.blockNumber < 0 || record.blockNumber >= disk->numberOfBlocks()))) {
+      cerr << "The trace has a record the disk can't replay: operation " << (int) record.operation
+           << " of block " << record.blockNumber << endl;
+      delete disk;
+      return 1;
+    }
+    while (threads.size() <= record.thread) {
+      ReplayThread *replayThread = new ReplayThread;
+      replayThread->disk = disk;
+      replayThread->blockSize = blockSize;
+      replayThread->isTimed = isTimed;
+      replayThread->latency = latency;
+      threads.push_back(replayThread);
+    }
+    threads[record.thread]->records.push_back(record);
+  }
+
+  unsigned long long start = monotonicNanoseconds();
+  for (size_t idx = 0; idx < threads.size(); idx++) {
+    threads[idx]->startNanoseconds = start;
+    pthread_create(&threads[idx]->thread, NULL, replay, threads[idx]);
+  }
+  for (size_t idx = 0; idx < threads.size(); idx++) {
+    pthread_join(threads[idx]->thread, NULL);
+    delete threads[idx];
+  }
+  double seconds = (monotonicNanoseconds() - start) / 1e9;
+
+  unsigned long long blocks = latency[DISK_OPERATION_READ].count() + latency[DISK_OPERATION_WRITE].count();
+  cout << "replayed " << records.size() << " records from " << threads.size() << " threads in "
+       << fixed << setprecision(3) << seconds << " s" << endl;
+  cout << "  " << setprecision(0) << records.size() / seconds << " operations/s, " << setprecision(1)
+       << blocks * blockSize / seconds / (1024 * 1024) << " MB/s" << endl;
+  cout << "latency in microseconds" << endl;
+  printLatency("read", latency[DISK_OPERATION_READ].summary());
+  printLatency("write", latency[DISK_OPERATION_WRITE].summary());
+  printLatency("sync", latency[DISK_OPERATION_SYNC].summary());
+  cout << endl;
+  disk->printStats(cout);
+
+  delete disk;
+  return 0;
+}
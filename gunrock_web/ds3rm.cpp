@@ -17,12 +17,21 @@ int main(int argc, char *argv[]) {
   }
 
   // Parse command line arguments
-  Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
+  Disk *disk = openDisk(argv[1], imageBlockSize(argv[1]));
   LocalFileSystem *fileSystem = new LocalFileSystem(disk);
   int parentInode = stoi(argv[2]);
   string entryName = string(argv[3]);
+  disk->beginTransaction();
   int unlinkResult = fileSystem->unlink(parentInode, entryName);
   if(unlinkResult != 0) {
+    disk->rollback();
+    cerr << "Error removing entry" << endl;
+    delete disk;
+    delete fileSystem;
+    return 1;
+  }
+  if(!disk->commit()) {
+    // too big for the journal
     cerr << "Error removing entry" << endl;
     delete disk;
     delete fileSystem;
@@ -0,0 +1,90 @@
+#include <pthread.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+struct StressArgs {
+  Disk *disk;
+  LocalFileSystem *fileSystem;
+  int parentInode;
+  int thread;
+  int filesPerThread;
+  int failures;
+};
+
+static string fileName(int thread, int file) {
+  return "t" + to_string(thread) + "_" + to_string(file);
+}
+
+// Creates this thread's files, each in its own transaction. The threads
+// share one LocalFileSystem, whose lock runs their transactions one at a
+// time, so a commit only fails when the transaction is too big for the
+// journal.
+static void *createFiles(void *arg) {
+  StressArgs *args = (StressArgs *) arg;
+  for (int file = 0; file < args->filesPerThread; file++) {
+    args->disk->beginTransaction();
+    int result = args->fileSystem->create(args->parentInode, UFS_REGULAR_FILE, fileName(args->thread, file));
+    if (result < 0) {
+      args->disk->rollback();
+      args->failures++;
+    } else if (!args->disk->commit()) {
+      args->failures++;
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 5) {
+    cerr << argv[0] << ": diskImageFile parentInode threads filesPerThread" << endl;
+    cerr << "For example:" << endl;
+    cerr << "    $ " << argv[0] << " a.img 0 2 20" << endl;
+    return 1;
+  }
+
+  // Parse command line arguments
+  Disk *disk = openDisk(argv[1], imageBlockSize(argv[1]));
+  LocalFileSystem *fileSystem = new LocalFileSystem(disk);
+  int parentInode = stoi(argv[2]);
+  int threads = stoi(argv[3]);
+  int filesPerThread = stoi(argv[4]);
+
+  vector<StressArgs> args(threads);
+  vector<pthread_t> workers(threads);
+  for (int thread = 0; thread < threads; thread++) {
+    args[thread] = {disk, fileSystem, parentInode, thread, filesPerThread, 0};
+    pthread_create(&workers[thread], NULL, createFiles, &args[thread]);
+  }
+  int failures = 0;
+  for (int thread = 0; thread < threads; thread++) {
+    pthread_join(workers[thread], NULL);
+    failures += args[thread].failures;
+  }
+
+  // every file must be in the directory afterwards
+  int missing = 0;
+  for (int thread = 0; thread < threads; thread++) {
+    for (int file = 0; file < filesPerThread; file++) {
+      if (fileSystem->lookup(parentInode, fileName(thread, file)) < 0) {
+        missing++;
+      }
+    }
+  }
+  cout << "created " << threads * filesPerThread - failures << " missing " << missing << endl;
+
+  delete fileSystem;
+  delete disk;
+  if (failures > 0) {
+    cerr << "Error creating file" << endl;
+    return 1;
+  }
+  return missing == 0 ? 0 : 1;
+}
@@ -17,12 +17,19 @@ int main(int argc, char *argv[]) {
   }
 
   // Parse command line arguments
-  Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
+  Disk *disk = openDisk(argv[1], imageBlockSize(argv[1]));
   LocalFileSystem *fileSystem = new LocalFileSystem(disk);
   int parentInode = stoi(argv[2]);
   string fileName = string(argv[3]);
+  disk->beginTransaction();
   int result = fileSystem->create(parentInode, UFS_REGULAR_FILE, fileName);
   if(result < 0) {
+    disk->rollback();
+    cerr << "Error creating file" << endl;
+    return 1;
+  }
+  if(!disk->commit()) {
+    // too big for the journal
     cerr << "Error creating file" << endl;
     return 1;
   }
@@ -21,6 +21,9 @@
 #include "MySocket.h"
 #include "MyServerSocket.h"
 #include "dthread.h"
+#include "Disk.h"
+#include "LatencyDisk.h"
+#include "ufs.h"
 
 using namespace std;
 int PORT = 8080;
@@ -30,8 +33,19 @@ string BASEDIR = "static";
 string SCHEDALG = "FIFO";
 string LOGFILE = "/dev/null";
 string DISKFILE = "disk.img";
+string DURABILITY = "";
+int GROUP_COMMIT_WINDOW = 0;
+int CACHE_MEGABYTES = 8;
+int READAHEAD_BLOCKS = -1;
+string LATENCY = "";
+string TRACEFILE = "";
 
 vector<HttpService *> services;
+Disk *disk = NULL;
+// Read locked while a request runs its service, so that requests run in
+// parallel, and write locked by shutdown, which then waits for them to
+// finish with the disk and keeps any from starting after it is closed.
+pthread_rwlock_t requestLock = PTHREAD_RWLOCK_INITIALIZER;
 
 HttpService *find_service(HTTPRequest *request) {
    // find a service that is registered for this path prefix
@@ -103,7 +117,9 @@ void handle_request(MySocket *client) {
   }
   
   HttpService *service = find_service(request);
+  pthread_rwlock_rdlock(&requestLock);
   invoke_service_method(service, request, response);
+  pthread_rwlock_unlock(&requestLock);
 
   // send data back to the client and clean up
   payload.str(""); payload.clear();
@@ -122,12 +138,48 @@ void handle_request(MySocket *client) {
   delete client;
 }
 
+// Dumps the disk statistics every time the server gets a SIGUSR1, and
+// closes the disk before exiting on SIGINT or SIGTERM, so that cached
+// writes are flushed and a RAM disk can snapshot itself. The signals are
+// blocked everywhere else, so they are only ever taken here. Closing
+// write locks requestLock, which waits for the requests in progress, and
+// keeps it until the process exits so that no other request reaches the
+// deleted disk. It
+// exits with _exit, since exit would run the global destructors while
+// the main thread may still be accepting a connection.
+void *handle_signals(void *arg) {
+  sigset_t *signals = (sigset_t *) arg;
+  while (true) {
+    int signal;
+    if (sigwait(signals, &signal) != 0 || disk == NULL) {
+      continue;
+    }
+    if (signal == SIGUSR1) {
+      disk->printStats(cerr);
+    } else {
+      pthread_rwlock_wrlock(&requestLock);
+      delete disk;
+      cout.flush();
+      _exit(0);
+    }
+  }
+  return NULL;
+}
+
 int main(int argc, char *argv[]) {
 
   signal(SIGPIPE, SIG_IGN);
+  // Block the handled signals before any thread starts so that they all
+  // inherit the mask.
+  static sigset_t handledSignals;
+  sigemptyset(&handledSignals);
+  sigaddset(&handledSignals, SIGUSR1);
+  sigaddset(&handledSignals, SIGINT);
+  sigaddset(&handledSignals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &handledSignals, NULL);
   int option;
 
-  while ((option = getopt(argc, argv, "d:p:t:b:s:l:i:")) != -1) {
+  while ((option = getopt(argc, argv, "d:p:t:b:s:l:i:D:G:C:R:L:T:")) != -1) {
     switch (option) {
     case 'd':
       BASEDIR = string(optarg);
@@ -150,8 +202,29 @@ int main(int argc, char *argv[]) {
     case 'i':
       DISKFILE = string(optarg);
       break;
+    case 'D':
+      DURABILITY = string(optarg);
+      break;
+    case 'G':
+      GROUP_COMMIT_WINDOW = atoi(optarg);
+      break;
+    case 'C':
+      CACHE_MEGABYTES = atoi(optarg);
+      break;
+    case 'R':
+      READAHEAD_BLOCKS = atoi(optarg);
+      break;
+    case 'L':
+      LATENCY = string(optarg);
+      break;
+    case 'T':
+      TRACEFILE = string(optarg);
+      break;
     default:
-      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers] [-i diskFile]" << endl;
+      cerr<< "usage: " << argv[0] << " [-d baseDir] [-p port] [-t threads] [-b buffers] [-s schedAlg] [-l logFile]"
+          << " [-i [file:|mmap:|uring:|direct:|ram:|raid0:|raid1:]diskFile[?options]]"
+          << " [-D always|none|interval:ms] [-G groupCommitMicroseconds] [-C cacheMegabytes]"
+          << " [-R readaheadBlocks] [-L latency] [-T traceFile]" << endl;
       exit(1);
     }
   }
@@ -166,8 +239,38 @@ int main(int argc, char *argv[]) {
 
   // The order that you push services dictates the search order
   // for path prefix matching
-  services.push_back(new DistributedFileSystemService(DISKFILE));
+  if (LATENCY != "") {
+    // the LatencyDisk keeps the journal
+    disk = new LatencyDisk(openRawDisk(DISKFILE, imageBlockSize(DISKFILE)), LATENCY);
+  } else {
+    disk = openDisk(DISKFILE, imageBlockSize(DISKFILE));
+  }
+  if (TRACEFILE != "") {
+    disk->startTrace(TRACEFILE);
+  }
+  if (DURABILITY == "always") {
+    disk->setDurabilityPolicy(DURABILITY_ALWAYS);
+  } else if (DURABILITY == "none") {
+    disk->setDurabilityPolicy(DURABILITY_NONE);
+  } else if (DURABILITY.compare(0, 9, "interval:") == 0) {
+    disk->setDurabilityPolicy(DURABILITY_INTERVAL, atoi(DURABILITY.substr(9).c_str()));
+  } else if (DURABILITY != "") {
+    cerr << "unknown durability policy " << DURABILITY << endl;
+    exit(1);
+  }
+  disk->setGroupCommitWindow(GROUP_COMMIT_WINDOW);
+  disk->setCacheSize(CACHE_MEGABYTES);
+  if (READAHEAD_BLOCKS >= 0) {
+    disk->setReadahead(READAHEAD_BLOCKS);
+  }
+  services.push_back(new DistributedFileSystemService(disk));
   services.push_back(new FileService(BASEDIR));
+
+  // A plain pthread: it isn't part of request handling, so it stays out
+  // of the dthread log.
+  pthread_t signalThread;
+  pthread_create(&signalThread, NULL, handle_signals, &handledSignals);
+  pthread_detach(signalThread);
   
   while(true) {
     sync_print("waiting_to_accept", "");
@@ -0,0 +1,36 @@
+#ifndef _ALIGNEDBUFFER_H_
+#define _ALIGNEDBUFFER_H_
+
+#include <cstddef>
+
+// Alignment that O_DIRECT accepts on every device we run on.
+#define DIRECT_IO_ALIGNMENT (4096)
+
+/**
+ * A zeroed, DIRECT_IO_ALIGNMENT aligned buffer for block I/O.
+ *
+ * Use it in place of a stack or heap array whenever the memory is handed
+ * to a Disk, so that an O_DIRECT backend can transfer straight into it.
+ * The memory comes from a process wide pool of recently freed buffers of
+ * the same size and goes back to it when the AlignedBuffer is destroyed.
+ */
+class AlignedBuffer {
+ public:
+  explicit AlignedBuffer(size_t size);
+  ~AlignedBuffer();
+
+  unsigned char *data() { return buffer; }
+  size_t size() { return length; }
+
+  static bool isAligned(const void *address, size_t size);
+
+ private:
+  // not copyable: the buffer has a single owner
+  AlignedBuffer(const AlignedBuffer &);
+  AlignedBuffer &operator=(const AlignedBuffer &);
+
+  unsigned char *buffer;
+  size_t length;
+};
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef _BITMAPALLOCATOR_H_
+#define _BITMAPALLOCATOR_H_
+
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+/**
+ * Finds free bits in an allocation bitmap, where bit i is bit i % 8 of
+ * byte i / 8, as in the inode and data bitmaps.
+ *
+ * The search tests 64 bits at a time and takes the lowest clear one with
+ * count trailing zeros. On CPUs with AVX2 it first skips 256 bit spans
+ * that are completely full.
+ *
+ * A cursor remembers where the last search found the first free bit.
+ * Every bit below it is set, so the next search starts there instead of
+ * rescanning the full prefix. Clearing a bit moves the cursor back to
+ * it, which keeps the search first-fit: it finds the same bit a scan
+ * from 0 would.
+ *
+ * For runs of bits, findExtents uses an index of the free extents, the
+ * maximal runs of clear bits, by start and by length. It is built from
+ * the bitmap the first time it is needed and kept up to date by set and
+ * clear from then on.
+ */
+class BitmapAllocator {
+ public:
+  BitmapAllocator();
+
+  // Searches bitmap, of which the first numBits bits are allocatable.
+  // Its size must be a multiple of 8 bytes.
+  void attach(std::vector<unsigned char> *bitmap, int numBits);
+
+  // Returns the lowest clear bit at or after from, or -1 if there isn't one.
+  int findFree(int from);
+
+  /**
+   * Finds count clear bits in as few runs as possible and puts them in
+   * bits, in increasing order. The smallest free extent that holds them
+   * all is used. If none does, the largest extents are taken whole until
+   * the rest fits in one, and the smallest one it fits in.
+   *
+   * Nothing is set. Returns false, leaving bits empty, if fewer than
+   * count bits are clear.
+   */
+  bool findExtents(int count, std::vector<int> &bits);
+
+  bool isSet(int bit);
+  void set(int bit);
+  void clear(int bit);
+
+  // Bits from bit on may have been set or cleared without set() or
+  // clear(), for instance by copying older blocks back into the bitmap.
+  void rewind(int bit);
+
+ private:
+  // Returns the lowest bit at or after start that is clear (or set, if
+  // findSet), or numBits if there isn't one.
+  int scan(int start, bool findSet);
+  void buildExtentIndex();
+  void addExtent(int start, int length);
+  void removeExtent(int start, int length);
+
+  std::vector<unsigned char> *bitmap;
+  int numBits;
+  // every bit below cursor is set
+  int cursor;
+
+  // the free extents as start -> length, and as (length, start)
+  bool hasExtentIndex;
+  std::map<int, int> extentsByStart;
+  std::set<std::pair<int, int> > extentsByLength;
+};
+
+#endif
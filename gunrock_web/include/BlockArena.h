@@ -0,0 +1,31 @@
+#ifndef _BLOCKARENA_H_
+#define _BLOCKARENA_H_
+
+#include <vector>
+
+/**
+ * Hands out block sized buffers carved from large slabs.
+ *
+ * Buffers are never freed one at a time: reset() makes every slab
+ * available again at once, and the slabs themselves are kept for the
+ * next round, so a steady workload stops allocating after warming up.
+ */
+class BlockArena {
+ public:
+  BlockArena(int blockSize, int blocksPerSlab = 64);
+  ~BlockArena();
+
+  unsigned char *allocate();
+  // Invalidates every buffer handed out since the last reset.
+  void reset();
+
+ private:
+  int blockSize;
+  int blocksPerSlab;
+  std::vector<unsigned char *> slabs;
+  // slab the next buffer comes from, and its position in that slab
+  int currentSlab;
+  int nextBlockInSlab;
+};
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef _BLOCKCACHE_H_
+#define _BLOCKCACHE_H_
+
+#include <pthread.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "AlignedBuffer.h"
+
+class Disk;
+
+struct BlockCacheStats {
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long evictions;
+  unsigned long long writeBacks;
+  int capacityBlocks;
+  int dirtyBlocks;
+};
+
+/**
+ * A fixed size write-back cache of disk blocks, keyed by block number.
+ *
+ * Frames are recycled with the CLOCK algorithm: every hit sets a frame's
+ * reference bit and the clock hand clears reference bits until it finds
+ * a frame that has not been used since the last sweep. Writes only mark a
+ * frame dirty; dirty frames go back to the image when they are evicted or
+ * when the owning Disk flushes the cache.
+ *
+ * Every public method takes the cache's own lock, so threads working on
+ * different blocks can share it.
+ */
+class BlockCache {
+ public:
+  BlockCache(Disk *disk, int blockSize, int capacityBlocks);
+  ~BlockCache();
+
+  // Copies a cached block into buffer. Returns false on a miss.
+  bool read(int blockNumber, void *buffer);
+  // Caches a block that was just read from the image.
+  void fill(int blockNumber, const void *buffer);
+  // Caches a new version of a block and marks it dirty.
+  void write(int blockNumber, const void *buffer);
+  // Writes every dirty block back to the image, in block order.
+  void flush();
+  // Forgets a block, dropping any changes that weren't written back.
+  void discard(int blockNumber);
+
+  BlockCacheStats stats();
+
+ private:
+  struct Frame {
+    int blockNumber;
+    bool isDirty;
+    bool isReferenced;
+  };
+
+  int frameFor(int blockNumber);
+  unsigned char *frameData(int frame);
+  void writeBack(int frame);
+
+  Disk *disk;
+  int blockSize;
+  int capacityBlocks;
+  AlignedBuffer data;
+  std::vector<Frame> frames;
+  std::unordered_map<int, int> frameOfBlock;
+  int clockHand;
+  int dirtyBlocks;
+  pthread_mutex_t lock;
+
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long evictions;
+  unsigned long long writeBacks;
+};
+
+#endif
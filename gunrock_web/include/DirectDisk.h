@@ -0,0 +1,33 @@
+#ifndef _DIRECTDISK_H_
+#define _DIRECTDISK_H_
+
+#include <string>
+
+#include "FileDisk.h"
+
+/**
+ * A Disk that opens the image with O_DIRECT, so that block I/O bypasses
+ * the kernel page cache and the Disk's own block cache is the only copy.
+ *
+ * O_DIRECT transfers need DIRECT_IO_ALIGNMENT aligned memory: callers
+ * should use AlignedBuffer, and any unaligned buffer that still reaches
+ * the backend is bounced through an aligned one. When the file system
+ * holding the image doesn't support O_DIRECT, this behaves like FileDisk.
+ */
+class DirectDisk : public FileDisk {
+ public:
+  DirectDisk(std::string imageFile, int blockSize);
+  virtual ~DirectDisk();
+
+ protected:
+  virtual void readImageBlock(int blockNumber, void *buffer);
+  virtual void writeImageBlock(int blockNumber, const void *buffer);
+  virtual void readImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers);
+  virtual void writeImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers);
+  virtual void prefetchImageBlocks(int firstBlockNumber, int count);
+
+ private:
+  bool isDirect;
+};
+
+#endif
@@ -1,31 +1,413 @@
 #ifndef _DISK_H_
 #define _DISK_H_
 
+#include <pthread.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <iosfwd>
 #include <string>
-#include <deque>
+#include <functional>
+#include <future>
+#include <vector>
 
-struct UndoRecord {
-  int blockNumber;
-  unsigned char *blockData;
+#include "BlockCache.h"
+#include "Histogram.h"
+#include "Journal.h"
+#include "Readahead.h"
+#include "StripedLock.h"
+#include "Transaction.h"
+
+class DiskTrace;
+
+/**
+ * A run of adjacent blocks handed to a backend to move asynchronously.
+ *
+ * The backend moves done out of the request before calling it, so done
+ * may free the request.
+ */
+struct BlockRequest {
+  bool isWrite;
+  int firstBlockNumber;
+  int count;
+  const struct iovec *buffers;
+  std::function<void()> done;
 };
 
+// When writes made outside of a transaction are forced to storage.
+enum DurabilityPolicy {
+  // flush after every write
+  DURABILITY_ALWAYS,
+  // flush on a write once the interval has passed since the last flush
+  DURABILITY_INTERVAL,
+  // only flush at commit(), sync() and when the Disk is destroyed
+  DURABILITY_NONE
+};
+
+// Operations whose latency the Disk records.
+enum DiskOperation {
+  // readBlock, readBlocks and readBlockAsync calls
+  DISK_OPERATION_READ,
+  // writeBlock, writeBlocks and writeBlockAsync calls, including any flush
+  // the durability policy adds
+  DISK_OPERATION_WRITE,
+  // flushes of the image to storage
+  DISK_OPERATION_SYNC,
+  // commit() calls
+  DISK_OPERATION_COMMIT,
+  DISK_OPERATIONS
+};
+
+struct DiskStats {
+  unsigned long long blocksRead;
+  unsigned long long blocksWritten;
+  unsigned long long bytesRead;
+  unsigned long long bytesWritten;
+  unsigned long long blocksDiscarded;
+  unsigned long long syncs;
+  unsigned long long transactionsBegun;
+  unsigned long long commits;
+  unsigned long long rollbacks;
+  // distinct blocks buffered by the calling thread's open transaction, and
+  // the most any transaction has buffered
+  int transactionDepth;
+  int maxTransactionDepth;
+  // blocks written by each finished transaction
+  HistogramSummary transactionBlocks;
+  // in nanoseconds, indexed by DiskOperation
+  HistogramSummary latency[DISK_OPERATIONS];
+};
+
+/**
+ * A disk image, read and written one block at a time.
+ *
+ * Disk holds the logic every image shares (transactions, the journal, the
+ * block cache, readahead and statistics) and leaves moving blocks to a
+ * backend, which implements the protected image hooks. openDisk picks the
+ * backend.
+ *
+ * A Disk may be shared by many threads. Accesses to a block are
+ * serialized by a striped lock over block numbers, so threads working on
+ * different blocks don't wait for each other. Configuration (durability,
+ * cache size, readahead) should be set before the Disk is shared.
+ */
 class Disk {
  public:
   Disk(std::string imageFile, int blockSize);
+  virtual ~Disk();
   void readBlock(int blockNumber, void *buffer);
   void writeBlock(int blockNumber, void *buffer);
+  int getBlockSize();
   int numberOfBlocks();
 
-  void beginTransaction();
-  void commit();
+  /**
+   * Vectored block I/O.
+   *
+   * Reads or writes count blocks, where buffers[i] is the block sized
+   * buffer for blockNumbers[i]. The block numbers don't need to be sorted
+   * or contiguous: they are sorted and every run of adjacent blocks is
+   * moved with a single preadv/pwritev. If a block number appears more
+   * than once in a write, the last buffer for it wins.
+   */
+  void readBlocks(const int *blockNumbers, int count, const struct iovec *buffers);
+  void writeBlocks(const int *blockNumbers, int count, const struct iovec *buffers);
+
+  /**
+   * Asynchronous block I/O.
+   *
+   * These queue the transfer with the backend and return. done runs once
+   * the block has been moved, which may be on a backend thread, and the
+   * buffer must stay valid until then. Cache hits and cached writes
+   * complete before the call returns. Backends without native async
+   * support complete every request before returning.
+   */
+  void readBlockAsync(int blockNumber, void *buffer, std::function<void()> done);
+  void writeBlockAsync(int blockNumber, const void *buffer, std::function<void()> done);
+  std::future<void> readBlockAsync(int blockNumber, void *buffer);
+  std::future<void> writeBlockAsync(int blockNumber, const void *buffer);
+
+  /**
+   * Transactions.
+   *
+   * Writes inside a transaction are held in memory, one copy per block,
+   * so writing a block again only replaces the copy, and reads in the
+   * transaction see it. commit() writes every block once and makes all of
+   * them durable with a single flush, and rollback() drops them.
+   *
+   * On an image with a journal (mkfs -j), commit() appends the blocks to
+   * the journal, so an interrupted commit is either redone in full or not
+   * at all when the image is next opened. A transaction that writes more
+   * blocks than journalCapacity() can't be journaled: commit() rolls it
+   * back and returns false. Images without a journal have the blocks
+   * written in place.
+   *
+   * A transaction belongs to the thread that began it: its writes and
+   * reads go through the returned handle, and commit() and rollback()
+   * finish it, all from that same thread. Transactions on different
+   * threads run in parallel. Each one remembers which version of every
+   * block it read, and commit() locks the blocks it read, wrote or
+   * discarded, checks that none of those it read has changed since, and
+   * only then writes. The locks are held until the writes are in place,
+   * so commits that share no block don't wait for each other, and the
+   * transactions that commit behave as if they ran one at a time. When
+   * the check fails, commit() rolls the transaction back instead and
+   * returns false, and the caller can run it again.
+   */
+  Transaction *beginTransaction();
+  bool commit();
+  // Most blocks a transaction can write, or -1 for no limit.
+  int journalCapacity();
   void rollback();
+  // Has the calling thread's open transaction run action if it rolls
+  // back, once its writes are gone, so that state kept in memory can be
+  // put back along with the blocks. Actions run in the reverse of the
+  // order they were added. Outside of a transaction this does nothing.
+  void onRollback(std::function<void()> action);
+  // Has the calling thread's open transaction run action once it is over,
+  // whether it commits or rolls back, after any rollback actions. Returns
+  // false, and drops action, outside of a transaction.
+  bool onFinish(std::function<void()> action);
+
+  // Make every write issued so far durable on the underlying storage.
+  void sync();
+
+  /**
+   * Tells the Disk that the blocks no longer hold data, once the file
+   * system has freed them. With discards on, the backend releases their
+   * storage, an image file gets a hole punched for them, and they read
+   * back as zeros until they are written again. In a transaction, the
+   * blocks are released when it commits, unless the transaction writes
+   * them again first, and not at all when it rolls back. Discards are off
+   * by default, and then this does nothing.
+   */
+  void discardBlocks(const int *blockNumbers, int count);
+  void setDiscard(bool isEnabled);
+
+  void setDurabilityPolicy(DurabilityPolicy policy, int intervalMilliseconds = 0);
+
+  /**
+   * With a non-zero window, a commit() that has to flush the image waits
+   * this many microseconds for commits from other threads so that a single
+   * flush covers all of them. Commits that arrive while a flush is running
+   * share the next one.
+   */
+  void setGroupCommitWindow(int microseconds);
+
+  /**
+   * Puts a write-back block cache of the given size in front of the image,
+   * or removes it when megabytes is 0. Dirty blocks are written back at
+   * commit(), sync(), on eviction and as the durability policy requires.
+   */
+  void setCacheSize(int megabytes);
+  // Returns false when the Disk has no cache.
+  bool getCacheStats(BlockCacheStats *stats);
+
+  /**
+   * I/O counters and latency histograms, kept since the Disk was opened.
+   * printStats writes them, and the cache statistics, in a human readable
+   * form.
+   */
+  void getStats(DiskStats *stats);
+  void printStats(std::ostream &out);
+
+  /**
+   * Sequential readahead. When reads keep starting where the previous one
+   * ended, the backend is asked to prefetch the blocks after them, with a
+   * window that grows up to maxBlocks while the stream continues and
+   * shrinks on random reads. 0 turns readahead off.
+   */
+  void setReadahead(int maxBlocks);
+  void getReadaheadStats(ReadaheadStats *stats);
+
+  /**
+   * Logs every block read and written through this Disk, and every flush
+   * of the image, to a binary trace file that ds3replay can replay. The
+   * trace is complete once the Disk is destroyed.
+   */
+  void startTrace(std::string traceFile);
   
- private:
+ protected:
+  // Backends implement these to move a single, already validated block
+  // between the caller and the image, and to make written blocks durable.
+  // The transaction logic above them is shared by every backend.
+  virtual void readImageBlock(int blockNumber, void *buffer) = 0;
+  virtual void writeImageBlock(int blockNumber, const void *buffer) = 0;
+  virtual void syncImage() = 0;
+  // Move count adjacent blocks starting at firstBlockNumber, one buffer
+  // per block. The default moves them one block at a time.
+  virtual void readImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers);
+  virtual void writeImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers);
+  // Starts every request and calls its done when it finishes. The default
+  // moves them one after another before returning.
+  virtual void submitImageRequests(std::vector<BlockRequest *> &requests);
+  // Hints that the blocks will be read soon. This must not block on the
+  // I/O; the default does nothing.
+  virtual void prefetchImageBlocks(int firstBlockNumber, int count);
+  // Releases the storage behind count adjacent blocks, which need not
+  // keep their contents. The default does nothing.
+  virtual void discardImageBlocks(int firstBlockNumber, int count);
+
+  // Backends call this from their constructor once the image can be read
+  // through their hooks. It checks the size and replays the journal.
+  void openImage(int imageSize);
+  // Writes every dirty cached block to the image.
+  void flushDirtyBlocks();
+  // Flushes dirty blocks and checkpoints the journal. Every backend's
+  // destructor calls this first, while its hooks still work.
+  void finishWrites();
+
   std::string imageFile;
   int blockSize;
   int imageFileSize;
-  bool isInTransaction;
-  std::deque<struct UndoRecord> undoLog;
+  bool isReadOnly;
+  // set by every write and cleared by a flush that started after it
+  std::atomic<bool> hasUnsyncedWrites;
+
+ private:
+  friend class BlockCache;
+  friend class DiskWorker;
+  friend class Journal;
+  friend class LatencyDisk;
+  friend class MirroredDisk;
+  friend class StripedDisk;
+
+  void checkBlockNumber(int blockNumber);
+  // The calling thread's open transaction, or NULL.
+  Transaction *currentTransaction();
+  // Copies a block written earlier in the calling thread's transaction,
+  // if there is one.
+  bool readDirty(int blockNumber, void *buffer);
+  // Writes that bypass the journal must not be overwritten by a replay of
+  // an older journaled copy. The caller holds the block's stripe.
+  void checkpointBefore(int blockNumber);
+  void commitRedo(Transaction *transaction);
+  // A block's version changes whenever its contents do. The caller holds
+  // the block's stripe.
+  void noteRead(int blockNumber);
+  void changeVersion(int blockNumber);
+  // Whether every block the transaction read is still the version it
+  // read. The caller holds their stripes.
+  bool isUnchanged(Transaction *transaction);
+  // Writes the blocks of a transaction to their home locations, each one
+  // once. The caller holds their stripes.
+  void storeDirtyBlocks(Transaction *transaction);
+  void finishTransaction(Transaction *transaction, bool isCommit);
+  // Runs the durability policy after a write outside of a transaction.
+  void writeCompleted(bool isInTransaction);
+  // Sorts the blocks and hands every contiguous run to the backend.
+  void transferRuns(const int *blockNumbers, int count, const struct iovec *buffers, bool isWrite);
+
+  // Block access through the cache, when there is one.
+  void fetchBlock(int blockNumber, void *buffer);
+  void storeBlock(int blockNumber, const void *buffer);
+  void groupSync();
+  // syncImage, counted and timed
+  void flushImage();
+  void readAhead(const int *blockNumbers, int count);
+  // Drops the sorted blocks from the cache and discards them in the image.
+  // The caller holds their stripes.
+  void releaseBlocks(const std::vector<int> &blockNumbers);
+  void traceBlocks(DiskOperation operation, const int *blockNumbers, int count);
+
+  BlockCache *cache;
+  StripedLock blockLocks;
+  // NULL unless startTrace was called
+  DiskTrace *trace;
+
+  // NULL when the image has no journal
+  Journal *journal;
+  // Finished transactions kept for reuse, so their arenas stay warm.
+  std::vector<Transaction *> idleTransactions;
+  pthread_mutex_t transactionLock;
+  // Block versions, shared by blocks a multiple of VERSION_SLOTS apart.
+  // Those are on the same stripe, which guards the slot.
+  std::vector<unsigned int> blockVersions;
+
+  bool isDiscardEnabled;
+  DurabilityPolicy durabilityPolicy;
+  int durabilityIntervalMilliseconds;
+  std::atomic<long long> lastSyncMilliseconds;
+
+  std::atomic<unsigned long long> blocksRead;
+  std::atomic<unsigned long long> blocksWritten;
+  std::atomic<unsigned long long> blocksDiscarded;
+  std::atomic<unsigned long long> syncCount;
+  std::atomic<unsigned long long> transactionsBegun;
+  std::atomic<unsigned long long> commitCount;
+  std::atomic<unsigned long long> rollbackCount;
+  std::atomic<int> maxTransactionDepth;
+  Histogram transactionBlocks;
+  Histogram latency[DISK_OPERATIONS];
+
+  Readahead readahead;
+  pthread_mutex_t readaheadLock;
+
+  // group commit state, protected by syncLock
+  pthread_mutex_t syncLock;
+  pthread_cond_t syncDone;
+  int groupCommitWindowMicroseconds;
+  bool isSyncInProgress;
+  unsigned long syncRequests;
+  unsigned long syncedRequests;
 };
 
+/**
+ * Opens the disk image named by spec.
+ *
+ * spec is either the path to an image file or a URI naming a backend,
+ * scheme:path[?option&option=value...]. The path may also be written as
+ * scheme://path.
+ *
+ *   disk.img        read and write the image with pread/pwrite
+ *   file:disk.img   the same
+ *   mmap:disk.img   map the whole image and only msync at commit()/sync()
+ *   uring:disk.img  queue block reads and writes to io_uring
+ *   direct:disk.img open the image with O_DIRECT, bypassing the page cache
+ *   ram:disk.img    load the whole image into memory (see RamDisk.h)
+ *   raid0:a.img,b.img
+ *                   stripe the image across several member images, each
+ *                   itself a spec without options (see StripedDisk.h)
+ *   raid1:a.img,b.img
+ *                   mirror the image on several replicas, which are
+ *                   specs without options (see MirroredDisk.h)
+ *
+ * ram: takes these options:
+ *
+ *   snapshot        write the image back to path when the Disk is destroyed
+ *   format          format a new image instead of loading path, which may
+ *                   then be empty (ram:?format)
+ *   inodes=N, data=N, journal=N
+ *                   the size of the formatted image, as for mkfs
+ *   inodeformat=F   the inode format, direct, indirect or extent, as for mkfs -F
+ *   blocksize=N     the block size, 4096 (the default), 16384 or 65536, as
+ *                   for mkfs -B. blockSize must match it, which it does
+ *                   when it comes from imageBlockSize(spec).
+ *
+ * raid0: takes format, inodes, data, journal, inodeformat and blocksize the same
+ * way, creating the member files, and
+ *
+ *   unit=N          the stripe unit in blocks, 16 by default
+ *
+ * Every scheme takes
+ *
+ *   discard         release the storage of freed blocks (see discardBlocks)
+ */
+Disk *openDisk(std::string spec, int blockSize);
+
+/**
+ * Opens spec as one part of a larger image, like a member of a raid0:
+ * disk. The Disk never looks for a journal of its own. With a non-zero
+ * createSize, the image file is first created, or truncated, at that many
+ * bytes.
+ */
+Disk *openRawDisk(std::string spec, int blockSize, long long createSize = 0);
+
+// The image file that spec names.
+std::string diskImagePath(std::string spec);
+
+// The block size the file system on spec was formatted with, read from
+// its super block, to pass to openDisk. A format spec formats with its
+// blocksize= option. Images that don't exist yet, and ones from before
+// the super block recorded it, use UFS_BLOCK_SIZE.
+int imageBlockSize(std::string spec);
+
 #endif
@@ -0,0 +1,61 @@
+#ifndef _DISKTRACE_H_
+#define _DISKTRACE_H_
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#include "Disk.h"
+
+// The first bytes of a trace file.
+struct DiskTraceHeader {
+  unsigned int magic;
+  unsigned int version;
+  int blockSize;
+  unsigned int reserved;
+};
+
+// One block access or flush, as stored in a trace file.
+struct DiskTraceRecord {
+  // nanoseconds since the trace started
+  unsigned long long timestamp;
+  // -1 for a flush
+  int blockNumber;
+  // numbered from 0 in the order threads first recorded anything
+  unsigned short thread;
+  // a DiskOperation
+  unsigned char operation;
+  unsigned char reserved;
+};
+
+/**
+ * A binary log of every block a Disk reads and writes and every flush
+ * of its image, for replaying the access pattern later with ds3replay.
+ *
+ * Records are 16 bytes and are buffered in memory, so tracing costs a
+ * lock and a copy per block. The buffer goes to the file when it fills
+ * up and when the trace is destroyed.
+ */
+class DiskTrace {
+ public:
+  // Creates traceFile, replacing any file already there.
+  DiskTrace(std::string traceFile, int blockSize);
+  ~DiskTrace();
+
+  void record(DiskOperation operation, int blockNumber);
+
+  // Reads every record of a trace file written by a DiskTrace.
+  static void load(std::string traceFile, int *blockSize, std::vector<DiskTraceRecord> *records);
+
+ private:
+  // Called with lock held.
+  void flush();
+
+  std::string traceFile;
+  int fileDescriptor;
+  unsigned long long startNanoseconds;
+  std::vector<DiskTraceRecord> buffer;
+  pthread_mutex_t lock;
+};
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef _DISKWORKER_H_
+#define _DISKWORKER_H_
+
+#include <pthread.h>
+#include <sys/uio.h>
+#include <deque>
+#include <functional>
+#include <vector>
+
+#include "Disk.h"
+
+/**
+ * A thread that moves blocks to and from one Disk's image, so that a Disk
+ * built from several images can keep all of them busy at once.
+ *
+ * Jobs go straight to the image hooks and run one at a time, in the order
+ * they were queued. Their done callbacks run on the worker thread.
+ */
+class DiskWorker {
+ public:
+  explicit DiskWorker(Disk *disk);
+  // Finishes the queued jobs before returning. The Disk isn't deleted.
+  ~DiskWorker();
+
+  // Reads or writes buffers.size() adjacent blocks from firstBlockNumber.
+  void queueTransfer(bool isWrite, int firstBlockNumber, std::vector<struct iovec> buffers,
+                     std::function<void()> done);
+  // Makes the image's writes durable.
+  void queueSync(std::function<void()> done);
+
+  // Returns a callback that calls done the count-th time it is called,
+  // for a request split among several workers.
+  static std::function<void()> joinCallbacks(int count, std::function<void()> done);
+
+ private:
+  struct Job {
+    bool isSync;
+    bool isWrite;
+    int firstBlockNumber;
+    std::vector<struct iovec> buffers;
+    std::function<void()> done;
+  };
+
+  void queue(Job *job);
+  static void *run(void *arg);
+
+  Disk *disk;
+  pthread_t thread;
+  // the queue, protected by lock
+  pthread_mutex_t lock;
+  pthread_cond_t jobQueued;
+  std::deque<Job *> jobs;
+  bool isStopping;
+};
+
+#endif
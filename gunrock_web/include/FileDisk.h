@@ -0,0 +1,33 @@
+#ifndef _FILEDISK_H_
+#define _FILEDISK_H_
+
+#include <string>
+
+#include "Disk.h"
+
+/**
+ * A Disk backed by an image file, moving blocks with pread/pwrite.
+ *
+ * The image stays open for the lifetime of the Disk so that every block
+ * access is a single positioned read or write. The other file backends
+ * (mmap:, uring:, direct:) build on this one and share its descriptor.
+ */
+class FileDisk : public Disk {
+ public:
+  FileDisk(std::string imageFile, int blockSize);
+  virtual ~FileDisk();
+
+ protected:
+  virtual void readImageBlock(int blockNumber, void *buffer);
+  virtual void writeImageBlock(int blockNumber, const void *buffer);
+  virtual void syncImage();
+  virtual void readImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers);
+  virtual void writeImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers);
+  virtual void prefetchImageBlocks(int firstBlockNumber, int count);
+  // Punches a hole in the image file, where the file system supports it.
+  virtual void discardImageBlocks(int firstBlockNumber, int count);
+
+  int imageFileDescriptor;
+};
+
+#endif
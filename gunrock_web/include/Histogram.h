@@ -0,0 +1,54 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <atomic>
+
+// A point in time view of a Histogram.
+struct HistogramSummary {
+  unsigned long long count;
+  double mean;
+  unsigned long long p50;
+  unsigned long long p90;
+  unsigned long long p99;
+  unsigned long long p999;
+  unsigned long long max;
+};
+
+/**
+ * A histogram of non-negative integers with bounded relative error, in
+ * the style of HdrHistogram.
+ *
+ * Values below 16 get a bucket each. Every power of two above that is
+ * split into 16 equal buckets, so a recorded value is known to within
+ * 1/16th (about 6%) whatever its magnitude, and the whole range of a
+ * 64 bit value fits in under a thousand counters. Recording is lock-free,
+ * so any thread can record while another one reads percentiles.
+ */
+class Histogram {
+ public:
+  Histogram();
+
+  void record(unsigned long long value);
+
+  unsigned long long count();
+  unsigned long long max();
+  double mean();
+  // The highest value that is equivalent to the value at the given
+  // percentile, where percentile is between 0 and 100.
+  unsigned long long percentile(double percentile);
+  HistogramSummary summary();
+
+ private:
+  static const int SUB_BUCKETS = 16;
+  static const int NUMBER_OF_BUCKETS = (64 - 3) * SUB_BUCKETS;
+
+  static int bucketFor(unsigned long long value);
+  static unsigned long long highestValueIn(int bucket);
+
+  std::atomic<unsigned long long> buckets[NUMBER_OF_BUCKETS];
+  std::atomic<unsigned long long> total;
+  std::atomic<unsigned long long> sum;
+  std::atomic<unsigned long long> largest;
+};
+
+#endif
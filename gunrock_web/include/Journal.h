@@ -0,0 +1,78 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <pthread.h>
+
+#include <map>
+#include <set>
+#include <vector>
+
+class Disk;
+
+/**
+ * The redo journal at the end of a disk image (see ufs.h for the layout).
+ *
+ * A transaction's writes are buffered in memory until it commits. Commit
+ * appends them to the journal with one sequential write and one flush,
+ * and only then copies them to their home locations without flushing
+ * those. The home copies are made durable lazily, at a checkpoint, which
+ * happens when the journal fills up, on sync() and when the Disk closes.
+ *
+ * Appends from several threads take turns writing their records, then
+ * share one flush. A checkpoint waits for the appends in flight.
+ *
+ * A transaction with more blocks than one descriptor can list is written
+ * as a chain of descriptors under a single commit block, and is replayed
+ * only when the whole chain is intact. One that does not fit in the
+ * journal at all can't be journaled, and Disk::commit() refuses it.
+ */
+class Journal {
+ public:
+  // Returns NULL when the image has no journal.
+  static Journal *open(Disk *disk);
+  ~Journal();
+
+  // First block of the journal, which is also the number of file system blocks.
+  int address();
+  // Most distinct blocks a single transaction can journal.
+  int capacity();
+  // Journal blocks taken by a transaction that writes count blocks.
+  int recordLength(int count);
+
+  // Replays every committed transaction that has not been checkpointed.
+  void recover();
+
+  // Appends a transaction and makes it durable.
+  void append(std::map<int, unsigned char *> &blocks);
+
+  // Whether a block has committed contents that may not be home yet.
+  bool isPending(int blockNumber);
+
+  // Makes every home copy durable and empties the journal.
+  void checkpoint();
+
+ private:
+  Journal(Disk *disk, int journalAddress, int journalLength, unsigned int checkpointedSequence);
+  // checkpoint() for a caller that holds the lock
+  void checkpointLocked();
+  void writeHeader();
+  unsigned long long checksum(const unsigned char *data, int length, unsigned long long hash);
+
+  Disk *disk;
+  int journalAddress;
+  int journalLength;
+  // most home block numbers a descriptor block holds
+  int descriptorCapacity;
+  int maxBlocksPerTransaction;
+  unsigned int checkpointedSequence;
+  unsigned int lastSequence;
+  // next free record block, relative to journalAddress
+  int head;
+  std::set<int> pendingBlocks;
+  // appends that have written their records but not their home copies
+  int inFlight;
+  pthread_mutex_t lock;
+  pthread_cond_t appendsDone;
+};
+
+#endif
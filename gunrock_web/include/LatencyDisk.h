@@ -0,0 +1,87 @@
+#ifndef _LATENCYDISK_H_
+#define _LATENCYDISK_H_
+
+#include <pthread.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "Disk.h"
+
+/**
+ * A Disk that makes another one slower, for measuring the server against
+ * storage it doesn't have, like a disk drive or a network block device.
+ *
+ * Every image read, write and flush of the wrapped Disk first waits for a
+ * latency drawn from that operation's model, and reads and writes then
+ * share a link of limited bandwidth. Threads wait in parallel, like
+ * requests queued on a device, while the bandwidth is shared among them.
+ * Requests submitted asynchronously are moved one after another.
+ */
+class LatencyDisk : public Disk {
+ public:
+  /**
+   * Wraps inner, which the LatencyDisk then owns. inner must come from
+   * openRawDisk: the LatencyDisk opens and recovers the journal itself,
+   * so that journal writes are slowed down like any other and the image
+   * has a single journal. spec is a comma separated list of:
+   *
+   *   read=MODEL, write=MODEL, sync=MODEL
+   *                  the latency of each image read, write and flush
+   *   bandwidth=MB   megabytes per second that reads and writes share
+   *
+   * where MODEL is one of
+   *
+   *   fixed:US            always US microseconds
+   *   normal:MEAN:STDDEV  normally distributed, in microseconds
+   *   trace:FILE          replayed from a text file of microsecond
+   *                       latencies, one per line, repeated when it ends
+   *
+   * Operations without a model and an unset bandwidth aren't slowed down.
+   */
+  LatencyDisk(Disk *inner, std::string spec);
+  virtual ~LatencyDisk();
+
+ protected:
+  virtual void readImageBlock(int blockNumber, void *buffer);
+  virtual void writeImageBlock(int blockNumber, const void *buffer);
+  virtual void syncImage();
+  virtual void readImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers);
+  virtual void writeImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers);
+  virtual void prefetchImageBlocks(int firstBlockNumber, int count);
+  virtual void discardImageBlocks(int firstBlockNumber, int count);
+
+ private:
+  enum LatencyKind {
+    LATENCY_NONE,
+    LATENCY_FIXED,
+    LATENCY_NORMAL,
+    LATENCY_TRACE
+  };
+
+  struct LatencyModel {
+    LatencyKind kind;
+    long long meanMicroseconds;
+    long long deviationMicroseconds;
+    std::vector<long long> trace;
+    std::atomic<unsigned long> nextTraceEntry;
+  };
+
+  void parseModel(LatencyModel *model, std::string spec);
+  long long sampleMicroseconds(LatencyModel *model);
+  // Waits for the model's latency and then for bytes to cross the link.
+  void delay(LatencyModel *model, long long bytes);
+
+  Disk *inner;
+  LatencyModel readLatency;
+  LatencyModel writeLatency;
+  LatencyModel syncLatency;
+
+  // 0 when the bandwidth isn't limited
+  long long bytesPerSecond;
+  // when the link finishes the transfers already given to it
+  long long linkFreeNanoseconds;
+  pthread_mutex_t linkLock;
+};
+
+#endif
@@ -1,8 +1,12 @@
 #ifndef _LOCAL_FILE_SYSTEM_H_
 #define _LOCAL_FILE_SYSTEM_H_
 
+#include <pthread.h>
+#include <map>
 #include <string>
+#include <vector>
 
+#include "BitmapAllocator.h"
 #include "Disk.h"
 #include "ufs.h"
 
@@ -17,6 +21,12 @@
  * callers operate will not align on disk block boundaries, so your job is
  * to manage the interactions with the underlying storage to provide a higher
  * level of abstraction for any code that uses this class.
+ *
+ * Threads may share a LocalFileSystem. Every operation locks the mounted
+ * super block, bitmaps and indirect block cache, and in a transaction the
+ * lock is held until the transaction commits or rolls back, because a
+ * rollback puts the mounted bitmaps back as they were. Transactions that
+ * use the file system therefore run one at a time.
  */
 
 // Note: If a function invocation has more than one error, return
@@ -44,9 +54,21 @@
 // Unlinking '.' or '..'
 #define EUNLINKNOTALLOWED  (10)
 
+// The sizes that follow from a block size, as compile-time constants in
+// the code LocalFileSystem instantiates for every block size.
+template <int BlockSize>
+struct BlockGeometry {
+  static constexpr int blockSize = BlockSize;
+  static constexpr int inodesPerBlock = BlockSize / sizeof(inode_t);
+  static constexpr int entriesPerBlock = BlockSize / sizeof(dir_ent_t);
+};
+
 class LocalFileSystem {
  public:
+  // The disk must have been opened with the block size the file system
+  // was formatted with (see imageBlockSize).
   LocalFileSystem(Disk *disk);
+  ~LocalFileSystem();
   /**
    * Lookup an inode.
    *
@@ -113,6 +135,18 @@ class LocalFileSystem {
    */
   int read(int inodeNumber, void *buffer, int size);
 
+  /**
+   * List the blocks of a file or directory.
+   *
+   * Fills in blockNumbers with the disk blocks that hold the data of
+   * inodeNumber, in order, following indirect blocks. A hole is a 0.
+   *
+   * Success: return 0
+   * Failure: return -EINVALIDINODE
+   * Failure modes: invalid inodeNumber
+   */
+  int listBlocks(int inodeNumber, std::vector<int> &blockNumbers);
+
   /**
    * Remove a file or directory.
    *
@@ -132,6 +166,12 @@ class LocalFileSystem {
    * implementation of the higher-level functions. When you operate on
    * file system metadata, you must read/write the entire structure instead
    * of trying to identify individual disk blocks and accessing only these.
+   *
+   * The super block and both bitmaps are read once, when the file system
+   * is constructed, and kept in memory. Reading them copies the mounted
+   * version, and writing one replaces it and writes only the bitmap
+   * blocks that changed. In a transaction that rolls back, the mounted
+   * bitmaps go back to what they were, like the disk.
    */
   void readSuperBlock(super_t *super);
 
@@ -147,6 +187,79 @@ class LocalFileSystem {
   // it in a function you add that is not part of the LocalFileSystem object but
   // can still access the disk.
   Disk *disk;
+
+ private:
+  // Take and release fileSystemLock around a public operation.
+  void lock();
+  void unlock();
+
+  // The operations for one block size. The public methods call the ones
+  // for the block size of the image.
+  template <int BlockSize> int lookup(BlockGeometry<BlockSize> geometry, int parentInodeNumber, std::string name);
+  template <int BlockSize> int stat(BlockGeometry<BlockSize> geometry, int inodeNumber, inode_t *inode);
+  template <int BlockSize> int create(BlockGeometry<BlockSize> geometry, int parentInodeNumber, int type, std::string name);
+  template <int BlockSize> int write(BlockGeometry<BlockSize> geometry, int inodeNumber, const void *buffer, int size);
+  template <int BlockSize> int read(BlockGeometry<BlockSize> geometry, int inodeNumber, void *buffer, int size);
+  template <int BlockSize> int unlink(BlockGeometry<BlockSize> geometry, int parentInodeNumber, std::string name);
+  // Writes the blocks of the bitmap at address that differ from onDisk,
+  // and brings onDisk up to date.
+  void writeBitmap(int address, std::vector<unsigned char> &bitmap, std::vector<unsigned char> &onDisk,
+                   BitmapAllocator &allocator);
+
+  // Appends the disk blocks of the first count blocks of the file to
+  // blocks, and when pointerBlocks isn't NULL, the blocks that map them:
+  // the indirect block, the double indirect block and then the blocks it
+  // points to, or the extent tree blocks, root first. Returns
+  // -EINVALIDINODE, with blocks incomplete, when the inode maps fewer
+  // than count blocks or points outside the data region.
+  int mapBlocks(const inode_t &inode, int count, std::vector<int> &blocks, std::vector<int> *pointerBlocks);
+  // Whether a block number lies in the data region.
+  bool isDataBlock(unsigned int blockNumber);
+  bool areDataBlocks(const unsigned int *blockNumbers, int count);
+  // How many indirect or extent tree blocks mapping blocks takes, or -1
+  // if the inode can't map them.
+  int pointerBlocksFor(const std::vector<int> &blocks);
+  // Points inode at blocks, through pointerBlocks, which mapBlocks would
+  // return for them, and writes the indirect or extent tree blocks.
+  void writePointers(inode_t &inode, const std::vector<int> &blocks, const std::vector<int> &pointerBlocks);
+  // The extents an extent format inode maps, and when treeBlocks isn't
+  // NULL, the tree blocks holding them, root first. Returns
+  // -EINVALIDINODE when a tree block has a bad header, the tree is deeper
+  // than a root and its leaves, or an extent lies outside the data region.
+  int readExtents(const inode_t &inode, std::vector<extent_t> &extents, std::vector<int> *treeBlocks);
+  // Whether a tree block's header is intact and at depth.
+  bool isTreeBlock(const extent_header_t *header, int depth);
+  bool areDataExtents(const extent_t *extents, int count);
+  void writeExtents(inode_t &inode, const std::vector<int> &blocks, const std::vector<int> &treeBlocks);
+  // How many extents a leaf, or entries a root, tree block holds.
+  int extentsPerTreeBlock();
+  // Writes the pointer or tree blocks in one go and caches them.
+  void writePointerBlocks(const std::vector<int> &blockNumbers, std::vector<std::vector<unsigned int> > &contents);
+  // The pointers in an indirect or extent tree block. They stay valid
+  // until the next call, which may evict them from pointerBlockCache.
+  const unsigned int *readPointerBlock(int blockNumber);
+  const unsigned int *cachePointerBlock(int blockNumber, std::vector<unsigned int> &pointers);
+
+  int blockSize;
+  int inodeFormat;
+  // the pointers in an inode that point at data, and the largest file
+  int directPointers;
+  int maxFileSize;
+  super_t mountedSuper;
+  std::vector<unsigned char> mountedInodeBitmap;
+  std::vector<unsigned char> mountedDataBitmap;
+  // the bitmaps as last written to the disk
+  std::vector<unsigned char> inodeBitmapOnDisk;
+  std::vector<unsigned char> dataBitmapOnDisk;
+  // find free bits in the mounted bitmaps
+  BitmapAllocator inodeAllocator;
+  BitmapAllocator dataAllocator;
+  // indirect blocks as last read or written
+  std::map<int, std::vector<unsigned int> > pointerBlockCache;
+
+  // recursive, and held once more while the lock belongs to a transaction
+  pthread_mutex_t fileSystemLock;
+  bool isLockedForTransaction;
 };  
 
 #endif
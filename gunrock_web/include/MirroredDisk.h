@@ -0,0 +1,90 @@
+#ifndef _MIRROREDDISK_H_
+#define _MIRROREDDISK_H_
+
+#include <pthread.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "Disk.h"
+#include "DiskWorker.h"
+
+/**
+ * A Disk mirrored on two or more replica images (RAID-1), typically on
+ * different devices.
+ *
+ * Every write goes to all replicas in parallel, each on the DiskWorker of
+ * its replica. A read goes to one replica: the one a sequential stream
+ * has been reading from, so its readahead stays useful, or else the one
+ * with the fewest reads outstanding. Read throughput so grows with the
+ * number of replicas.
+ *
+ * A replica whose image is missing, smaller than the others, or left
+ * behind by an interrupted resync is stale. The Disk opens in degraded
+ * mode as long as one replica is current: it serves reads from the
+ * current replicas, writes to all of them, and copies the current image
+ * onto the stale replicas on a background thread. A marker file next to
+ * a stale replica, named after it with a ".resync" suffix, survives a
+ * crash until its copy finishes.
+ */
+class MirroredDisk : public Disk {
+ public:
+  // Opens the replicas, each a spec for openDisk.
+  MirroredDisk(std::vector<std::string> replicaSpecs, int blockSize);
+  virtual ~MirroredDisk();
+
+  // Replicas still being resynced, 0 once every replica is current.
+  int staleReplicas();
+
+ protected:
+  virtual void readImageBlock(int blockNumber, void *buffer);
+  virtual void writeImageBlock(int blockNumber, const void *buffer);
+  virtual void syncImage();
+  virtual void readImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers);
+  virtual void writeImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers);
+  virtual void submitImageRequests(std::vector<BlockRequest *> &requests);
+  virtual void prefetchImageBlocks(int firstBlockNumber, int count);
+  virtual void discardImageBlocks(int firstBlockNumber, int count);
+
+ private:
+  struct Replica {
+    std::string spec;
+    Disk *disk;
+    DiskWorker *worker;
+    // reads may only go to a current replica
+    std::atomic<bool> isCurrent;
+    std::atomic<int> outstandingReads;
+    // the block after the last one read here
+    std::atomic<int> nextReadBlockNumber;
+  };
+
+  // Picks the replica for a read of the blocks from firstBlockNumber on.
+  // A prefetch doesn't move the stream along.
+  Replica *chooseReplica(int firstBlockNumber, int count, bool isPrefetch);
+  void read(int firstBlockNumber, int count, const struct iovec *buffers);
+  // Writes to every replica and waits for all of them.
+  void write(int firstBlockNumber, int count, const struct iovec *buffers);
+  // Every write to the replicas runs between these, and they wait while
+  // the resync copies a range, so a copy never overwrites a newer write
+  // with older data.
+  void beginWrite();
+  void endWrite();
+  // Copies the image onto every stale replica.
+  static void *resync(void *arg);
+
+  std::vector<Replica *> replicas;
+  // where chooseReplica starts looking, so that ties alternate
+  std::atomic<unsigned int> readTurn;
+
+  // resync state, protected by resyncLock
+  pthread_mutex_t resyncLock;
+  pthread_cond_t resyncTurn;
+  int writesInFlight;
+  bool isCopying;
+
+  pthread_t resyncThread;
+  bool isResyncing;
+  std::atomic<bool> isClosing;
+};
+
+#endif
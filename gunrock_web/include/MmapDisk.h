@@ -0,0 +1,33 @@
+#ifndef _MMAPDISK_H_
+#define _MMAPDISK_H_
+
+#include <string>
+
+#include "FileDisk.h"
+
+/**
+ * A Disk that maps the whole image into memory with MAP_SHARED.
+ *
+ * Reads and writes are memcpys against the mapping and the kernel writes
+ * dirty pages back on its own schedule. By default writes are only forced
+ * to storage with msync at commit() and sync(), so a crash can lose
+ * writes made outside of a transaction since the last sync point.
+ */
+class MmapDisk : public FileDisk {
+ public:
+  MmapDisk(std::string imageFile, int blockSize);
+  virtual ~MmapDisk();
+
+ protected:
+  virtual void readImageBlock(int blockNumber, void *buffer);
+  virtual void writeImageBlock(int blockNumber, const void *buffer);
+  virtual void syncImage();
+  virtual void readImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers);
+  virtual void writeImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers);
+  virtual void prefetchImageBlocks(int firstBlockNumber, int count);
+
+ private:
+  unsigned char *image;
+};
+
+#endif
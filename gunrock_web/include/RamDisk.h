@@ -0,0 +1,44 @@
+#ifndef _RAMDISK_H_
+#define _RAMDISK_H_
+
+#include <string>
+#include <vector>
+
+#include "Disk.h"
+
+/**
+ * A Disk held entirely in memory, in one contiguous buffer.
+ *
+ * The image is either loaded from a file when the Disk opens or formatted
+ * from scratch, and block I/O is a memcpy. Nothing is durable: flushes
+ * return at once, and the image only reaches a file when the Disk is
+ * destroyed and snapshots are on. That makes it a fast, ephemeral tier,
+ * and a way to measure the file system's CPU cost without any device in
+ * the way.
+ */
+class RamDisk : public Disk {
+ public:
+  // Loads imageFile.
+  RamDisk(std::string imageFile, int blockSize, bool isSnapshotOnClose);
+  // Formats a new image the way mkfs does. imageFile is only used for the
+  // snapshot and may be empty when there is none.
+  RamDisk(std::string imageFile, int blockSize, int numInodes, int numData, int numJournal,
+          int inodeFormat, bool isSnapshotOnClose);
+  virtual ~RamDisk();
+
+ protected:
+  virtual void readImageBlock(int blockNumber, void *buffer);
+  virtual void writeImageBlock(int blockNumber, const void *buffer);
+  virtual void syncImage();
+
+ private:
+  // Reads the whole file open as fileDescriptor into image.
+  void load(int fileDescriptor);
+  // Replaces imageFile with the image, atomically.
+  void writeSnapshot();
+
+  std::vector<unsigned char> image;
+  bool isSnapshotOnClose;
+};
+
+#endif
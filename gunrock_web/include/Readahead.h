@@ -0,0 +1,54 @@
+#ifndef _READAHEAD_H_
+#define _READAHEAD_H_
+
+struct ReadaheadStats {
+  // reads that continued the previous one, and reads that didn't
+  unsigned long long sequentialReads;
+  unsigned long long randomReads;
+  // blocks handed to the backend to prefetch, and reads they covered
+  unsigned long long prefetchedBlocks;
+  unsigned long long hits;
+  int window;
+  int maxWindow;
+};
+
+/**
+ * Detects sequential reads and sizes the readahead window.
+ *
+ * Every read that starts where the previous one ended doubles the
+ * window, up to maxWindow blocks, and every read that jumps elsewhere
+ * halves it, so a streaming reader quickly gets large prefetches while a
+ * random one stops paying for them.
+ */
+class Readahead {
+ public:
+  Readahead(int maxWindow);
+
+  void setMaxWindow(int maxWindow);
+
+  /**
+   * Records a read of count blocks starting at firstBlockNumber. Returns
+   * how many blocks after it to prefetch and sets *prefetchStart to the
+   * first of them. Blocks an earlier call already returned are not
+   * returned again.
+   */
+  int observe(int firstBlockNumber, int count, int *prefetchStart);
+
+  ReadaheadStats stats();
+
+ private:
+  int maxWindow;
+  int window;
+  // where a sequential read would start next
+  int nextBlockNumber;
+  // blocks in [prefetchedFrom, prefetchedTo) were already prefetched
+  int prefetchedFrom;
+  int prefetchedTo;
+
+  unsigned long long sequentialReads;
+  unsigned long long randomReads;
+  unsigned long long prefetchedBlocks;
+  unsigned long long hits;
+};
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef _STRIPEDDISK_H_
+#define _STRIPEDDISK_H_
+
+#include <string>
+#include <vector>
+
+#include "Disk.h"
+#include "DiskWorker.h"
+
+/**
+ * A Disk striped across several member images (RAID-0), typically on
+ * different devices.
+ *
+ * Logical blocks are dealt out to the members in stripe units of
+ * stripeBlocks adjacent blocks, round robin, so a sequential run spreads
+ * over every member. A run that crosses a stripe unit boundary is split
+ * into one piece per member and the pieces move in parallel, each on the
+ * DiskWorker of its member. Runs inside a single stripe unit go to
+ * their member directly from the calling thread.
+ *
+ * The image holds as many whole stripes as the smallest member does, and
+ * the journal, if any, lives in the last logical blocks like on any other
+ * image. Losing a member loses the image.
+ */
+class StripedDisk : public Disk {
+ public:
+  // Opens the members, each a spec for openDisk, in stripe order.
+  StripedDisk(std::vector<std::string> memberSpecs, int blockSize, int stripeBlocks);
+  // Creates the member files and formats a new image across them the way
+  // mkfs does. numData is rounded up so the image fills whole stripes.
+  StripedDisk(std::vector<std::string> memberSpecs, int blockSize, int stripeBlocks, int numInodes,
+              int numData, int numJournal, int inodeFormat);
+  virtual ~StripedDisk();
+
+ protected:
+  virtual void readImageBlock(int blockNumber, void *buffer);
+  virtual void writeImageBlock(int blockNumber, const void *buffer);
+  virtual void syncImage();
+  virtual void readImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers);
+  virtual void writeImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers);
+  virtual void submitImageRequests(std::vector<BlockRequest *> &requests);
+  virtual void prefetchImageBlocks(int firstBlockNumber, int count);
+  virtual void discardImageBlocks(int firstBlockNumber, int count);
+
+ private:
+  // Opens every member and starts its worker. With a non-zero memberSize
+  // the member files are created at that many bytes first.
+  void openMembers(const std::vector<std::string> &memberSpecs, long long memberSize);
+  // Size of the striped image, in bytes.
+  long long stripedImageSize();
+  // The member holding a logical block and the block's number there.
+  int locate(int blockNumber, int *memberBlockNumber);
+  // The range of member blocks a run of logical blocks covers on each
+  // member, with a count of 0 for the members it misses.
+  void splitRun(int firstBlockNumber, int count, std::vector<int> &memberFirst, std::vector<int> &memberCount);
+  // Moves a single run and waits for it.
+  void transfer(bool isWrite, int firstBlockNumber, int count, const struct iovec *buffers);
+
+  std::vector<Disk *> members;
+  // one per member
+  std::vector<DiskWorker *> workers;
+  int stripeBlocks;
+};
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef _STRIPEDLOCK_H_
+#define _STRIPEDLOCK_H_
+
+#include <pthread.h>
+#include <vector>
+
+/**
+ * Locks over block numbers, hashed onto a fixed number of stripes.
+ *
+ * Two blocks on different stripes never contend, so concurrent accesses
+ * to unrelated blocks proceed in parallel while accesses to the same
+ * block are serialized. A stripe isn't owned by a thread: any thread may
+ * release it, which lets an asynchronous request hold its block until the
+ * backend completes it. Stripes aren't reentrant.
+ *
+ * Every stripe has its own mutex and condition, on its own cache line, so
+ * taking one stripe never waits on a thread that is taking another.
+ */
+class StripedLock {
+ public:
+  StripedLock(int stripes = 64);
+  ~StripedLock();
+
+  void lock(int blockNumber);
+  void unlock(int blockNumber);
+
+  // Locks the stripes of every block, each one once and in stripe order,
+  // so that threads locking overlapping sets can't deadlock. stripes
+  // receives what to pass to unlockAll.
+  void lockAll(const int *blockNumbers, int count, std::vector<int> *stripes);
+  void unlockAll(const std::vector<int> &stripes);
+
+ private:
+  struct alignas(64) Stripe {
+    pthread_mutex_t mutex;
+    pthread_cond_t released;
+    bool isLocked;
+  };
+
+  int stripeOf(int blockNumber);
+  void lockStripe(int stripe);
+  void unlockStripe(int stripe);
+
+  Stripe *stripes;
+  int stripeCount;
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef _TRANSACTION_H_
+#define _TRANSACTION_H_
+
+#include <functional>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "BlockArena.h"
+
+/**
+ * The state of one open transaction.
+ *
+ * Disk::beginTransaction hands one to the calling thread, and the reads
+ * and writes that thread makes until it commits or rolls back go through
+ * it. Each transaction has its own dirty blocks, so transactions on
+ * different threads don't share any state.
+ */
+class Transaction {
+ public:
+  // Distinct blocks written so far.
+  int blockCount();
+
+ private:
+  friend class Disk;
+
+  Transaction(int blockSize);
+  // Forgets every write, ready for the next transaction to reuse.
+  void clear();
+  // Buffers a write, replacing any earlier one of the same block.
+  void writeDirty(int blockNumber, const void *buffer);
+  bool readDirty(int blockNumber, void *buffer);
+  // The block numbers written, in ascending order.
+  std::vector<int> blockNumbers();
+
+  int blockSize;
+  // The latest contents of every block written, held until commit. The
+  // buffers come from dirtyArena.
+  std::map<int, unsigned char *> dirtyBlocks;
+  BlockArena dirtyArena;
+  // The version of every block read from the image, as of the first
+  // read, which commit checks is still current.
+  std::map<int, unsigned int> readVersions;
+  // Blocks to discard once the transaction commits.
+  std::set<int> discardedBlocks;
+  // Run, last first, if it rolls back.
+  std::vector<std::function<void()> > rollbackActions;
+  // Run, in order, when it commits or rolls back.
+  std::vector<std::function<void()> > finishActions;
+};
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef _URINGDISK_H_
+#define _URINGDISK_H_
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#include <linux/io_uring.h>
+
+#include "FileDisk.h"
+
+/**
+ * A Disk that moves blocks through an io_uring instead of blocking
+ * pread/pwrite calls.
+ *
+ * Requests from every thread share one submission queue, so concurrent
+ * readers keep many reads outstanding on the device at once, and the
+ * runs of a vectored readBlocks/writeBlocks go out with a single
+ * io_uring_enter. A completion thread reaps finished requests and runs
+ * their done callbacks. The synchronous block calls submit and wait.
+ *
+ * If the kernel refuses to set up a ring, this falls back to the
+ * pread/pwrite implementation in Disk.
+ */
+class UringDisk : public FileDisk {
+ public:
+  UringDisk(std::string imageFile, int blockSize, int queueDepth = 64);
+  virtual ~UringDisk();
+
+ protected:
+  virtual void readImageBlock(int blockNumber, void *buffer);
+  virtual void writeImageBlock(int blockNumber, const void *buffer);
+  virtual void readImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers);
+  virtual void writeImageBlocks(int firstBlockNumber, int count, const struct iovec *buffers);
+  virtual void submitImageRequests(std::vector<BlockRequest *> &requests);
+
+ private:
+  // Waits for a single run to be transferred.
+  void transfer(bool isWrite, int firstBlockNumber, int count, const struct iovec *buffers);
+  void queueEntry(int opcode, unsigned long long offset, const struct iovec *buffers, int count, void *userData);
+  void enterQueuedEntries();
+  static void *reapCompletions(void *arg);
+
+  bool hasRing;
+  int ringFileDescriptor;
+  unsigned int submissionEntries;
+  void *submissionRing;
+  size_t submissionRingSize;
+  void *completionRing;
+  size_t completionRingSize;
+  struct io_uring_sqe *entries;
+  unsigned int *submissionTail;
+  unsigned int *submissionMask;
+  unsigned int *submissionArray;
+  unsigned int *completionHead;
+  unsigned int *completionTail;
+  unsigned int *completionMask;
+  struct io_uring_cqe *completions;
+
+  // submission state, protected by submitLock
+  pthread_mutex_t submitLock;
+  pthread_cond_t entryFreed;
+  unsigned int inFlight;
+  unsigned int queued;
+
+  pthread_t reaper;
+};
+
+#endif
@@ -6,12 +6,42 @@
 
 #define UFS_ROOT_DIRECTORY_INODE_NUMBER (0)
 
+// Block sizes are chosen by mkfs -B and recorded in the super block. The
+// default is also the size of images formatted before block_size existed,
+// which have a 0 there.
 #define UFS_BLOCK_SIZE (4096)
+#define UFS_MAX_BLOCK_SIZE (65536)
+#define UFS_IS_BLOCK_SIZE(size) ((size) == 4096 || (size) == 16384 || (size) == 65536)
 
 #define DIRECT_PTRS (30)
 
+// with the default block size and UFS_INODE_DIRECT
 #define MAX_FILE_SIZE (DIRECT_PTRS * UFS_BLOCK_SIZE)
 
+// How inodes point at their blocks, chosen by mkfs -F and recorded in the
+// super block. Images formatted before inode_format existed have a 0 there.
+//
+// UFS_INODE_DIRECT: direct[i] is block i of the file.
+// UFS_INODE_INDIRECT: the first INDIRECT_DIRECT_PTRS pointers are direct.
+// direct[INDIRECT_PTR] is a block of block_size / 4 pointers to the blocks
+// that follow, and direct[DOUBLE_INDIRECT_PTR] a block of pointers to such
+// blocks, for the rest. Either is 0 when the file doesn't reach it.
+// UFS_INODE_EXTENT: the file is a list of extents, runs of consecutive
+// blocks. The first INODE_EXTENTS are extent_t pairs in direct[], and a
+// 0 length ends them. direct[EXTENT_TREE_PTR] is 0 or the root block of
+// an extent tree holding the rest.
+// Directories only use what fits in the inode itself.
+#define UFS_INODE_DIRECT (0)
+#define UFS_INODE_INDIRECT (1)
+#define UFS_INODE_EXTENT (2)
+
+#define INDIRECT_DIRECT_PTRS (DIRECT_PTRS - 2)
+#define INDIRECT_PTR (DIRECT_PTRS - 2)
+#define DOUBLE_INDIRECT_PTR (DIRECT_PTRS - 1)
+
+#define INODE_EXTENTS (14)
+#define EXTENT_TREE_PTR (DIRECT_PTRS - 2)
+
 // Note: Bitmap indexes identify disk blocks relative to the start of a region.
 
 typedef struct {
@@ -38,7 +68,61 @@ typedef struct __super {
     int data_region_len;   // in blocks
     int num_inodes;        // just the number of inodes
     int num_data;          // and data blocks...
+    int block_size;        // in bytes, 0 for UFS_BLOCK_SIZE
+    int inode_format;      // UFS_INODE_DIRECT, UFS_INODE_INDIRECT or UFS_INODE_EXTENT
 } super_t;
 
+// An extent tree block is a header followed by num_entries extent_t. In a
+// leaf (depth 0) they are the extents of the file that follow the ones in
+// the inode, in order. In the root of a deeper tree (depth 1) each one is
+// a leaf block and the number of extents in it.
+#define UFS_EXTENT_TREE_MAGIC (0x45534433) // "3DSE"
+
+typedef struct {
+    unsigned int magic;    // UFS_EXTENT_TREE_MAGIC
+    int depth;
+    int num_entries;
+    int unused;
+} extent_header_t;
+
+typedef struct {
+    unsigned int start;    // first block
+    unsigned int length;   // in blocks
+} extent_t;
+
+// Optional redo journal, created with mkfs -j. It follows the data region
+// at the end of the image: journal_len record blocks starting at
+// journal_addr and then one header block, which is always the last block
+// of the image. The Disk layer finds the journal through the header and
+// hides all of these blocks from the file system.
+//
+// A committed transaction is stored as a descriptor block, one block for
+// each block it wrote and a commit block. A transaction that writes more
+// blocks than a descriptor can list chains several descriptors, each
+// followed by its blocks, with the same sequence ahead of the one commit
+// block, whose checksum covers all of them. On open, every transaction
+// after checkpointed_sequence with an intact commit block is replayed.
+#define UFS_JOURNAL_MAGIC            (0x4a534433) // "3DSJ"
+#define UFS_JOURNAL_DESCRIPTOR_MAGIC (0x44534433) // "3DSD"
+#define UFS_JOURNAL_COMMIT_MAGIC     (0x43534433) // "3DSC"
+
+typedef struct {
+    unsigned int magic;                 // UFS_JOURNAL_MAGIC
+    int journal_addr;                   // first record block
+    int journal_len;                    // in blocks, excluding this header
+    unsigned int checkpointed_sequence; // transactions up to here are home
+} journal_header_t;
+
+typedef struct {
+    unsigned int magic;    // UFS_JOURNAL_DESCRIPTOR_MAGIC
+    unsigned int sequence;
+    int num_blocks;        // followed by num_blocks home block numbers
+} journal_descriptor_t;
+
+typedef struct {
+    unsigned int magic;              // UFS_JOURNAL_COMMIT_MAGIC
+    unsigned int sequence;
+    unsigned long long checksum;     // FNV-1a over descriptor and data blocks
+} journal_commit_t;
 
 #endif // __ufs_h__
@@ -0,0 +1,27 @@
+#ifndef __ufs_format_h__
+#define __ufs_format_h__
+
+#include "ufs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Lays out an empty file system in the file open as fd: the super block,
+// both bitmaps, an inode table holding the root directory, and a journal
+// of num_journal blocks when that isn't 0, all in blocks of block_size
+// bytes, with inodes in inode_format. Fills in *s and returns the total
+// number of blocks in the image.
+int ufs_format(int fd, int block_size, int inode_format, int num_inodes, int num_data, int num_journal,
+               super_t *s);
+
+// The UFS_INODE_* format called name ("direct", "indirect", "extent"), or -1.
+int ufs_inode_format(const char *name);
+// The name of a UFS_INODE_* format, or NULL.
+const char *ufs_inode_format_name(int inode_format);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __ufs_format_h__
@@ -5,10 +5,12 @@
 #include <string.h>
 #include <unistd.h>
 
-#include "ufs.h"
+#include "ufs_format.h"
 
 void usage() {
-    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>]\n");
+    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>] [-j <num_journal_blocks>] [-B <block_size>] [-F <inode_format>]\n");
+    fprintf(stderr, "       the block size is 4096 (the default), 16384 or 65536 bytes\n");
+    fprintf(stderr, "       the inode format is direct (the default), indirect or extent, for files larger than 30 blocks\n");
     exit(1);
 }
 
@@ -17,9 +19,12 @@ int main(int argc, char *argv[]) {
     char *image_file = NULL;
     int num_inodes = 32;
     int num_data = 32;
+    int num_journal = 0;
+    int block_size = UFS_BLOCK_SIZE;
+    int inode_format = UFS_INODE_DIRECT;
     int visual = 0;
 
-    while ((ch = getopt(argc, argv, "i:d:f:v")) != -1) {
+    while ((ch = getopt(argc, argv, "i:d:f:j:B:F:v")) != -1) {
 	switch (ch) {
 	case 'i':
 	    num_inodes = atoi(optarg);
@@ -30,6 +35,15 @@ int main(int argc, char *argv[]) {
 	case 'f':
 	    image_file = optarg;
 	    break;
+	case 'j':
+	    num_journal = atoi(optarg);
+	    break;
+	case 'B':
+	    block_size = atoi(optarg);
+	    break;
+	case 'F':
+	    inode_format = ufs_inode_format(optarg);
+	    break;
 	case 'v':
 	    visual = 1;
 	    break;
@@ -40,146 +54,29 @@ int main(int argc, char *argv[]) {
     argc -= optind;
     argv += optind;
 
-    if (image_file == NULL)
+    if (image_file == NULL || !UFS_IS_BLOCK_SIZE(block_size) || inode_format < 0)
 	usage();
 
-    unsigned char *empty_buffer;
-    empty_buffer = calloc(UFS_BLOCK_SIZE, 1);
-    if (empty_buffer == NULL) {
-	perror("calloc");
-	exit(1);
-    }
-
     int fd = open(image_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
     if (fd < 0) {
 	perror("open");
 	exit(1);
     }
 
-    assert(num_inodes >= 32);
-    assert(num_data >= 32);
-
     // presumed: block 0 is the super block
     super_t s;
+    int total_blocks = ufs_format(fd, block_size, inode_format, num_inodes, num_data, num_journal, &s);
+    int journal_addr = total_blocks - num_journal - 1;
 
-    // totals
-    s.num_inodes = num_inodes;
-    s.num_data = num_data;
-
-    // inode bitmap
-    int bits_per_block = (8 * UFS_BLOCK_SIZE); // remember, there are 8 bits per byte
-
-    s.inode_bitmap_addr = 1;
-    s.inode_bitmap_len = num_inodes / bits_per_block;
-    if (num_inodes % bits_per_block != 0)
-	s.inode_bitmap_len++;
-
-    // data bitmap
-    s.data_bitmap_addr = s.inode_bitmap_addr + s.inode_bitmap_len;
-    s.data_bitmap_len = num_data / bits_per_block;
-    if (num_data % bits_per_block != 0)
-	s.data_bitmap_len++;
-
-    // inode table
-    s.inode_region_addr = s.data_bitmap_addr + s.data_bitmap_len;
-    int total_inode_bytes = num_inodes * sizeof(inode_t);
-    s.inode_region_len = total_inode_bytes / UFS_BLOCK_SIZE;
-    if (total_inode_bytes % UFS_BLOCK_SIZE != 0)
-	s.inode_region_len++;
-
-    // data blocks
-    s.data_region_addr = s.inode_region_addr + s.inode_region_len;
-    s.data_region_len = num_data;
-
-    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.data_region_len;
-
-    // super block is the first block
-    int rc = pwrite(fd, &s, sizeof(super_t), 0);
-    if (rc != sizeof(super_t)) {
-	perror("write");
-	exit(1);
-    }
-
-    printf("total blocks        %d\n", total_blocks);
+    printf("total blocks        %d [size of each: %d]\n", total_blocks, block_size);
     printf("  inodes            %d [size of each: %lu]\n", num_inodes, sizeof(inode_t));
+    printf("  inode format      %s\n", ufs_inode_format_name(inode_format));
     printf("  data blocks       %d\n", num_data);
     printf("layout details\n");
     printf("  inode bitmap address/len %d [%d]\n", s.inode_bitmap_addr, s.inode_bitmap_len);
     printf("  data bitmap address/len  %d [%d]\n", s.data_bitmap_addr, s.data_bitmap_len);
-
-    // first, zero out all the blocks
-    int i;
-    for (i = 1; i < total_blocks; i++) {
-        rc = pwrite(fd, empty_buffer, UFS_BLOCK_SIZE, i * UFS_BLOCK_SIZE);
-        if (rc != UFS_BLOCK_SIZE) {
-            perror("write");
-            exit(1);
-        }
-    }
-    free(empty_buffer);
-
-    //
-    // need to allocate first inode in inode bitmap
-    //
-    typedef struct {
-	unsigned char bits[UFS_BLOCK_SIZE / sizeof(unsigned char)];
-    } bitmap_t;
-    assert(sizeof(bitmap_t) == UFS_BLOCK_SIZE);
-
-    bitmap_t b;
-    for (i = 0; i < 4096; i++)
-	b.bits[i] = 0;
-    b.bits[0] = 0x1; // first entry is allocated
-    
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.inode_bitmap_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
-
-    //
-    // need to allocate first data block in data bitmap
-    // (can just reuse this to write out data bitmap too)
-    //
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.data_bitmap_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
-
-    //
-    // need to write out inode
-    //
-    typedef struct {
-	inode_t inodes[UFS_BLOCK_SIZE / sizeof(inode_t)];
-    } inode_block;
-
-    inode_block itable;
-    itable.inodes[0].type = UFS_DIRECTORY;
-    itable.inodes[0].size = 2 * sizeof(dir_ent_t); // in bytes
-    itable.inodes[0].direct[0] = s.data_region_addr;
-    for (i = 1; i < DIRECT_PTRS; i++)
-	itable.inodes[0].direct[i] = -1;
-
-    rc = pwrite(fd, &itable, UFS_BLOCK_SIZE, s.inode_region_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
-
-    // 
-    // need to write out root directory contents to first data block
-    // create a root directory, with nothing in it
-    // 
-    typedef struct {
-	dir_ent_t entries[128];
-    } dir_block_t;
-    // xxx assumes 4096 block, 32 byte entries
-    assert(sizeof(dir_ent_t) * 128 == UFS_BLOCK_SIZE);
-
-    dir_block_t parent;
-    strcpy(parent.entries[0].name, ".");
-    parent.entries[0].inum = 0;
-
-    strcpy(parent.entries[1].name, "..");
-    parent.entries[1].inum = 0;
-
-    for (i = 2; i < 128; i++)
-	parent.entries[i].inum = -1;
-
-    rc = pwrite(fd, &parent, UFS_BLOCK_SIZE, s.data_region_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    if (num_journal > 0)
+	printf("  journal address/len      %d [%d]\n", journal_addr, num_journal);
 
     if (visual) {
 	int i;
@@ -193,6 +90,10 @@ int main(int argc, char *argv[]) {
 	    printf("I");
 	for (i = 0; i < s.data_region_len; i++)
 	    printf("D");
+	for (i = 0; i < num_journal; i++)
+	    printf("J");
+	if (num_journal > 0)
+	    printf("H");
 	printf("\n\n");
     }
 
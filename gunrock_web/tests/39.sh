@@ -0,0 +1,14 @@
+#!/bin/bash
+set -e
+
+# Four threads create files in the root directory of a fresh image, without
+# and with a journal, and every entry must survive.
+mkdir -p tests-out
+./mkfs -f tests-out/39.img -d 256 -i 512
+./ds3stress tests-out/39.img 0 4 50
+./ds3ls tests-out/39.img / | wc -l
+
+./mkfs -f tests-out/39.img -d 256 -i 512 -j 64
+./ds3stress tests-out/39.img 0 4 50
+./ds3ls tests-out/39.img / | wc -l
+rm -f tests-out/39.img
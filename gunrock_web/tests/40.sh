@@ -0,0 +1,18 @@
+#!/bin/bash
+set -e
+
+# A file of 56 blocks, past the 28 direct pointers of the indirect format,
+# is copied in and read back, and removing it frees every data block and
+# the indirect block.
+mkdir -p tests-out
+seq 1 40000 > tests-out/40.txt
+./mkfs -f tests-out/40.img -d 128 -i 32 -F indirect > /dev/null
+./ds3bits tests-out/40.img > tests-out/40.before
+./ds3touch tests-out/40.img 0 big.txt
+./ds3cp tests-out/40.img tests-out/40.txt 1
+./ds3cat tests-out/40.img 1 | sed -n '/^File blocks$/,/^$/p' | grep -c '^[0-9]'
+./ds3cat tests-out/40.img 1 | sed '1,/^File data$/d' | cmp - tests-out/40.txt && echo "contents match"
+./ds3bits tests-out/40.img | tail -2
+./ds3rm tests-out/40.img 0 big.txt
+./ds3bits tests-out/40.img | diff tests-out/40.before - && echo "all blocks freed"
+rm -f tests-out/40.txt tests-out/40.img tests-out/40.before
@@ -0,0 +1,31 @@
+#!/bin/bash
+set -e
+
+# One block files fill most of an extent format image, and every other
+# one is removed, so that a 56 block file copied in next is split into
+# more extents than the inode holds and needs a tree block. It is
+# read back, and removing it frees every data block and the tree block.
+mkdir -p tests-out
+seq 1 40000 > tests-out/41.txt
+echo small > tests-out/41.small
+./mkfs -f tests-out/41.img -d 100 -i 96 -F extent > /dev/null
+./ds3bits tests-out/41.img > tests-out/41.before
+for file in $(seq 1 80); do
+  ./ds3touch tests-out/41.img 0 small$file
+  ./ds3cp tests-out/41.img tests-out/41.small $file
+done
+for file in $(seq 1 2 80); do
+  ./ds3rm tests-out/41.img 0 small$file
+done
+./ds3touch tests-out/41.img 0 big.txt
+big=$(./ds3ls tests-out/41.img / | awk '$2 == "big.txt" { print $1 }')
+./ds3cp tests-out/41.img tests-out/41.txt $big
+./ds3cat tests-out/41.img $big | sed -n '/^File blocks$/,/^$/p' | grep -c '^[0-9]'
+./ds3cat tests-out/41.img $big | sed '1,/^File data$/d' | cmp - tests-out/41.txt && echo "contents match"
+./ds3bits tests-out/41.img | tail -2
+./ds3rm tests-out/41.img 0 big.txt
+for file in $(seq 2 2 80); do
+  ./ds3rm tests-out/41.img 0 small$file
+done
+./ds3bits tests-out/41.img | diff tests-out/41.before - && echo "all blocks freed"
+rm -f tests-out/41.txt tests-out/41.small tests-out/41.img tests-out/41.before
@@ -0,0 +1,13 @@
+#!/bin/bash
+set -e
+
+# ds3bits on an image with 16 KB blocks, fresh and after adding a
+# directory and a file.
+mkdir -p tests-out
+./mkfs -f tests-out/42.img -d 64 -i 64 -B 16384 > /dev/null
+./ds3bits tests-out/42.img
+./ds3mkdir tests-out/42.img 0 a
+./ds3touch tests-out/42.img 1 b.txt
+./ds3cp tests-out/42.img tests/6kwords.txt 2
+./ds3bits tests-out/42.img
+rm -f tests-out/42.img
@@ -0,0 +1,12 @@
+#!/bin/bash
+set -e
+
+# journal.img holds a transaction that wrote /logs/journal.txt and
+# committed to the journal, but whose home blocks never made it to the
+# image. Opening a copy replays it, and a second open finds it home.
+mkdir -p tests-out
+cp tests/disk_images/journal.img tests-out/43.img
+./ds3cat tests-out/43.img 2
+./ds3bits tests-out/43.img
+./ds3ls tests-out/43.img /logs
+rm -f tests-out/43.img
@@ -0,0 +1,13 @@
+#!/bin/bash
+set -e
+
+# Two transactions read and write the same unused data block directly on
+# the Disk, without and with a journal. The one that commits second must
+# fail validation and succeed when it runs again.
+mkdir -p tests-out
+./mkfs -f tests-out/44.img -d 64 -i 32 > /dev/null
+./ds3conflict tests-out/44.img 67
+
+./mkfs -f tests-out/44.img -d 64 -i 32 -j 16 > /dev/null
+./ds3conflict tests-out/44.img 67
+rm -f tests-out/44.img
@@ -0,0 +1,166 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ufs_format.h"
+
+static const char *inode_format_names[] = { "direct", "indirect", "extent" };
+
+int ufs_inode_format(const char *name) {
+    int i;
+    for (i = 0; i < (int) (sizeof(inode_format_names) / sizeof(inode_format_names[0])); i++)
+	if (strcmp(name, inode_format_names[i]) == 0)
+	    return i;
+    return -1;
+}
+
+const char *ufs_inode_format_name(int inode_format) {
+    if (inode_format < 0 || inode_format >= (int) (sizeof(inode_format_names) / sizeof(inode_format_names[0])))
+	return NULL;
+    return inode_format_names[inode_format];
+}
+
+int ufs_format(int fd, int block_size, int inode_format, int num_inodes, int num_data, int num_journal,
+               super_t *s) {
+    assert(UFS_IS_BLOCK_SIZE(block_size));
+    assert(ufs_inode_format_name(inode_format) != NULL);
+    unsigned char *empty_buffer;
+    empty_buffer = calloc(block_size, 1);
+    if (empty_buffer == NULL) {
+	perror("calloc");
+	exit(1);
+    }
+
+    assert(num_inodes >= 32);
+    assert(num_data >= 32);
+    // a journal needs room for at least a descriptor, a block and a commit
+    assert(num_journal == 0 || num_journal >= 3);
+
+    // totals
+    s->num_inodes = num_inodes;
+    s->num_data = num_data;
+    s->block_size = block_size;
+    s->inode_format = inode_format;
+
+    // inode bitmap
+    int bits_per_block = (8 * block_size); // remember, there are 8 bits per byte
+
+    s->inode_bitmap_addr = 1;
+    s->inode_bitmap_len = num_inodes / bits_per_block;
+    if (num_inodes % bits_per_block != 0)
+	s->inode_bitmap_len++;
+
+    // data bitmap
+    s->data_bitmap_addr = s->inode_bitmap_addr + s->inode_bitmap_len;
+    s->data_bitmap_len = num_data / bits_per_block;
+    if (num_data % bits_per_block != 0)
+	s->data_bitmap_len++;
+
+    // inode table
+    s->inode_region_addr = s->data_bitmap_addr + s->data_bitmap_len;
+    int total_inode_bytes = num_inodes * sizeof(inode_t);
+    s->inode_region_len = total_inode_bytes / block_size;
+    if (total_inode_bytes % block_size != 0)
+	s->inode_region_len++;
+
+    // data blocks
+    s->data_region_addr = s->inode_region_addr + s->inode_region_len;
+    s->data_region_len = num_data;
+
+    int total_blocks = 1 + s->inode_bitmap_len + s->data_bitmap_len + s->inode_region_len + s->data_region_len;
+
+    // optional journal after the data region, plus its header block
+    int journal_addr = total_blocks;
+    if (num_journal > 0)
+	total_blocks += num_journal + 1;
+
+    // super block is the first block
+    int rc = pwrite(fd, s, sizeof(super_t), 0);
+    if (rc != sizeof(super_t)) {
+	perror("write");
+	exit(1);
+    }
+
+    // first, zero out all the blocks: size the file without writing them,
+    // so the image starts out sparse and formatting takes no time
+    int i;
+    if (ftruncate(fd, block_size) != 0 || ftruncate(fd, (off_t) total_blocks * block_size) != 0) {
+	perror("ftruncate");
+	exit(1);
+    }
+
+    if (num_journal > 0) {
+	journal_header_t h;
+	h.magic = UFS_JOURNAL_MAGIC;
+	h.journal_addr = journal_addr;
+	h.journal_len = num_journal;
+	h.checkpointed_sequence = 0;
+	memcpy(empty_buffer, &h, sizeof(journal_header_t));
+	rc = pwrite(fd, empty_buffer, block_size, (off_t) (total_blocks - 1) * block_size);
+	assert(rc == block_size);
+    }
+
+    //
+    // need to allocate first inode in inode bitmap
+    //
+    unsigned char *b = empty_buffer;
+    memset(b, 0, block_size);
+    b[0] = 0x1; // first entry is allocated
+    
+    rc = pwrite(fd, b, block_size, (off_t) s->inode_bitmap_addr * block_size);
+    assert(rc == block_size);
+
+    //
+    // need to allocate first data block in data bitmap
+    // (can just reuse this to write out data bitmap too)
+    //
+    rc = pwrite(fd, b, block_size, (off_t) s->data_bitmap_addr * block_size);
+    assert(rc == block_size);
+
+    //
+    // need to write out inode
+    //
+    inode_t *itable = (inode_t *) empty_buffer;
+    memset(itable, 0, block_size);
+    itable[0].type = UFS_DIRECTORY;
+    itable[0].size = 2 * sizeof(dir_ent_t); // in bytes
+    itable[0].direct[0] = s->data_region_addr;
+    for (i = 1; i < DIRECT_PTRS; i++)
+	itable[0].direct[i] = -1;
+    if (inode_format == UFS_INODE_INDIRECT)
+	itable[0].direct[INDIRECT_PTR] = itable[0].direct[DOUBLE_INDIRECT_PTR] = 0;
+    if (inode_format == UFS_INODE_EXTENT) {
+	// one extent of one block
+	for (i = 1; i < DIRECT_PTRS; i++)
+	    itable[0].direct[i] = 0;
+	itable[0].direct[1] = 1;
+    }
+
+    rc = pwrite(fd, itable, block_size, (off_t) s->inode_region_addr * block_size);
+    assert(rc == block_size);
+
+    // 
+    // need to write out root directory contents to first data block
+    // create a root directory, with nothing in it
+    // 
+    int entries_per_block = block_size / sizeof(dir_ent_t);
+    dir_ent_t *parent = (dir_ent_t *) empty_buffer;
+    memset(parent, 0, block_size);
+    strcpy(parent[0].name, ".");
+    parent[0].inum = 0;
+
+    strcpy(parent[1].name, "..");
+    parent[1].inum = 0;
+
+    for (i = 2; i < entries_per_block; i++)
+	parent[i].inum = -1;
+
+    rc = pwrite(fd, parent, block_size, (off_t) s->data_region_addr * block_size);
+    assert(rc == block_size);
+    free(empty_buffer);
+
+
+    return total_blocks;
+}